@@ -0,0 +1,81 @@
+#include <stdlib.h>
+
+#include "allocator.h"
+
+/* ===== Static functions ===== */
+
+/**
+ * Gets the size class that serves blocks of a size.
+ * @param size the size of the block.
+ * @return the index of the size class.
+ */
+static int sizeClass(size_t size) {
+    return (int)((size - 1) / SIZE_CLASS_GRANULARITY);
+}
+
+/**
+ * Reserves a new arena from the system allocator and makes it current.
+ * The remainder of the previous arena is abandoned.
+ * @param allocator the allocator.
+ */
+static void newArena(Allocator *allocator) {
+    Arena *arena = (Arena*)malloc(ARENA_SIZE);
+    if (arena == NULL) exit(1);
+
+    arena->next = allocator->arenas;
+    allocator->arenas = arena;
+
+    // Arena headers are one pointer wide, so round up to keep blocks aligned.
+    allocator->arenaNext = (char*)arena + SIZE_CLASS_GRANULARITY;
+    allocator->arenaEnd = (char*)arena + ARENA_SIZE;
+}
+
+/* ===== End static functions ===== */
+
+void initAllocator(Allocator *allocator) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        allocator->freeLists[i] = NULL;
+    }
+    allocator->arenas = NULL;
+    allocator->arenaNext = NULL;
+    allocator->arenaEnd = NULL;
+}
+
+void freeAllocator(Allocator *allocator) {
+    Arena *arena = allocator->arenas;
+    while (arena != NULL) {
+        Arena *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+
+    initAllocator(allocator);
+}
+
+void *allocateBlock(Allocator *allocator, size_t size) {
+    int index = sizeClass(size);
+
+    FreeBlock *block = allocator->freeLists[index];
+    if (block != NULL) {
+        allocator->freeLists[index] = block->next;
+        return block;
+    }
+
+    size_t blockSize = (size_t)(index + 1) * SIZE_CLASS_GRANULARITY;
+    if (allocator->arenaNext == NULL ||
+            (size_t)(allocator->arenaEnd - allocator->arenaNext) < blockSize) {
+        newArena(allocator);
+    }
+
+    void *result = allocator->arenaNext;
+    allocator->arenaNext += blockSize;
+    return result;
+}
+
+void freeBlock(Allocator *allocator, void *block, size_t size) {
+    int index = sizeClass(size);
+
+    FreeBlock *freed = (FreeBlock*)block;
+    freed->next = allocator->freeLists[index];
+    allocator->freeLists[index] = freed;
+}
@@ -0,0 +1,73 @@
+#ifndef CLOX_ALLOCATOR_H
+#define CLOX_ALLOCATOR_H
+
+#include "common.h"
+
+/** The granularity of the small block size classes, in bytes. */
+#define SIZE_CLASS_GRANULARITY 16
+
+/** The number of small block size classes. */
+#define SIZE_CLASS_COUNT 16
+
+/** The largest block served by the allocator. Larger blocks use the system allocator. */
+#define SMALL_BLOCK_MAX (SIZE_CLASS_GRANULARITY * SIZE_CLASS_COUNT)
+
+/** The number of bytes reserved from the system allocator for each arena. */
+#define ARENA_SIZE (64 * 1024)
+
+/**
+ * A freed small block, threaded onto the free list of its size class.
+ */
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+/**
+ * A region of memory that small blocks are carved from.
+ */
+typedef struct Arena {
+    struct Arena *next;
+} Arena;
+
+/**
+ * A size-class allocator for small blocks.
+ * Blocks are recycled through a free list per size class, and new blocks are
+ * bump allocated from the current arena. Arenas are only returned to the
+ * system when the allocator is freed.
+ */
+typedef struct {
+    FreeBlock *freeLists[SIZE_CLASS_COUNT];
+    Arena *arenas;
+    char *arenaNext;
+    char *arenaEnd;
+} Allocator;
+
+/**
+ * Initialises an empty allocator.
+ * @param allocator the allocator.
+ */
+void initAllocator(Allocator *allocator);
+
+/**
+ * Frees an allocator and every block it has handed out.
+ * @param allocator the allocator.
+ */
+void freeAllocator(Allocator *allocator);
+
+/**
+ * Allocates a small block.
+ * @param allocator the allocator.
+ * @param size the size of the block, at most SMALL_BLOCK_MAX bytes.
+ * @return the block.
+ */
+void *allocateBlock(Allocator *allocator, size_t size);
+
+/**
+ * Returns a small block to its size class.
+ * @param allocator the allocator.
+ * @param block the block.
+ * @param size the size the block was allocated with.
+ */
+void freeBlock(Allocator *allocator, void *block, size_t size);
+
+#endif //CLOX_ALLOCATOR_H
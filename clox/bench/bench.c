@@ -0,0 +1,322 @@
+/*
+ * Runs the Lox benchmarks and reports the median wall-clock time and the peak
+ * resident set size of each, optionally next to jlox and a stored baseline.
+ *
+ * Usage: bench [options] interpreter benchmark.lox...
+ *   --runs N             timed runs per benchmark (default 5)
+ *   --warmup N           untimed runs before them (default 1)
+ *   --jlox "command"     also run each benchmark with this jlox command line
+ *   --baseline path      compare against the medians stored in this file
+ *   --save-baseline path store the medians in this file
+ *
+ * Each benchmark runs as a child process with its output discarded. The time of
+ * a run includes starting the interpreter, as a user would see it.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** The longest command line accepted for an interpreter, in words. */
+#define MAX_ARGS 32
+
+/** The most benchmarks a baseline file may hold. */
+#define MAX_BASELINE 64
+
+/**
+ * The result of running one benchmark with one interpreter.
+ */
+typedef struct {
+    bool ok;
+    /** The median wall-clock time of the timed runs, in seconds. */
+    double median;
+    /** The largest peak resident set size of any run, in KiB. */
+    long peakKib;
+} Result;
+
+/**
+ * A benchmark result read from a baseline file.
+ */
+typedef struct {
+    char name[64];
+    double median;
+    long peakKib;
+} BaselineEntry;
+
+/* ===== Static functions ===== */
+
+/**
+ * Gets the current monotonic time.
+ * @return the time in seconds.
+ */
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/**
+ * Runs a command once with its output discarded.
+ * @param argv the command and its arguments, ending with NULL.
+ * @param seconds set to the wall-clock time of the run.
+ * @param peakKib set to the peak resident set size of the run, in KiB.
+ * @return whether the command ran and exited with status 0.
+ */
+static bool runOnce(char **argv, double *seconds, long *peakKib) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) return false;
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) return false;
+    }
+    *seconds = now() - start;
+
+#ifdef __APPLE__
+    *peakKib = usage.ru_maxrss / 1024;
+#else
+    *peakKib = usage.ru_maxrss;
+#endif
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Orders two doubles for qsort().
+ * @param a the first double.
+ * @param b the second double.
+ * @return the order.
+ */
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Runs a benchmark with an interpreter: warm-up runs first, then the timed runs.
+ * @param command the interpreter's command line, with a free slot for the script and one for NULL.
+ * @param words the number of words in the command line.
+ * @param script the path of the benchmark.
+ * @param warmup the number of warm-up runs.
+ * @param runs the number of timed runs.
+ * @return the result.
+ */
+static Result runBenchmark(char **command, int words, const char *script, int warmup, int runs) {
+    Result result = {false, 0, 0};
+    command[words] = (char*)script;
+    command[words + 1] = NULL;
+
+    double seconds;
+    long peakKib;
+    for (int i = 0; i < warmup; i++) {
+        if (!runOnce(command, &seconds, &peakKib)) return result;
+    }
+
+    double *times = (double*)malloc(sizeof(double) * runs);
+    if (times == NULL) return result;
+    for (int i = 0; i < runs; i++) {
+        if (!runOnce(command, &times[i], &peakKib)) {
+            free(times);
+            return result;
+        }
+        if (peakKib > result.peakKib) result.peakKib = peakKib;
+    }
+
+    qsort(times, runs, sizeof(double), compareDoubles);
+    result.median = runs % 2 == 1 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    result.ok = true;
+    free(times);
+    return result;
+}
+
+/**
+ * Splits a command line into words at spaces. Quoting is not supported.
+ * @param line the command line, which is modified.
+ * @param words set to the words, with two free slots at the end.
+ * @return the number of words.
+ */
+static int splitCommand(char *line, char **words) {
+    int count = 0;
+    for (char *word = strtok(line, " "); word != NULL && count < MAX_ARGS - 2; word = strtok(NULL, " ")) {
+        words[count++] = word;
+    }
+    return count;
+}
+
+/**
+ * Gets the name of a benchmark from its path: the file name without its extension.
+ * @param path the path.
+ * @param name set to the name.
+ * @param size the size of the name buffer.
+ */
+static void benchmarkName(const char *path, char *name, size_t size) {
+    const char *start = strrchr(path, '/');
+    start = start == NULL ? path : start + 1;
+    snprintf(name, size, "%s", start);
+
+    char *extension = strrchr(name, '.');
+    if (extension != NULL) *extension = '\0';
+}
+
+/**
+ * Reads a baseline file of "name median peakKib" lines. Lines starting with # are comments.
+ * @param path the path of the file.
+ * @param entries set to the entries.
+ * @return the number of entries, or -1 if the file cannot be read.
+ */
+static int readBaseline(const char *path, BaselineEntry *entries) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    int count = 0;
+    char line[256];
+    while (count < MAX_BASELINE && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#') continue;
+        BaselineEntry *entry = &entries[count];
+        if (sscanf(line, "%63s %lf %ld", entry->name, &entry->median, &entry->peakKib) == 3) count++;
+    }
+
+    fclose(file);
+    return count;
+}
+
+/**
+ * Finds a benchmark in a baseline.
+ * @param entries the entries.
+ * @param count the number of entries.
+ * @param name the name of the benchmark.
+ * @return the entry, or NULL if the benchmark is not in the baseline.
+ */
+static BaselineEntry *findBaseline(BaselineEntry *entries, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) return &entries[i];
+    }
+    return NULL;
+}
+
+/**
+ * Prints the usage message and exits.
+ */
+static void usage() {
+    fprintf(stderr, "Usage: bench [--runs N] [--warmup N] [--jlox \"command\"] [--baseline path] "
+                    "[--save-baseline path] interpreter benchmark.lox...\n");
+    exit(64);
+}
+
+/* ===== End static functions ===== */
+
+int main(int argc, char *argv[]) {
+    int runs = 5;
+    int warmup = 1;
+    char *jloxLine = NULL;
+    const char *baselinePath = NULL;
+    const char *savePath = NULL;
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg += 2) {
+        if (arg + 1 >= argc) usage();
+        if (strcmp(argv[arg], "--runs") == 0) {
+            runs = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "--warmup") == 0) {
+            warmup = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "--jlox") == 0) {
+            if (argv[arg + 1][0] != '\0') jloxLine = argv[arg + 1];
+        } else if (strcmp(argv[arg], "--baseline") == 0) {
+            baselinePath = argv[arg + 1];
+        } else if (strcmp(argv[arg], "--save-baseline") == 0) {
+            savePath = argv[arg + 1];
+        } else {
+            usage();
+        }
+    }
+    if (runs < 1 || warmup < 0 || argc - arg < 2) usage();
+
+    char *clox[MAX_ARGS];
+    clox[0] = argv[arg++];
+    int cloxWords = 1;
+
+    char *jlox[MAX_ARGS];
+    int jloxWords = jloxLine == NULL ? 0 : splitCommand(jloxLine, jlox);
+
+    BaselineEntry baseline[MAX_BASELINE];
+    int baselineCount = baselinePath == NULL ? -1 : readBaseline(baselinePath, baseline);
+
+    FILE *save = NULL;
+    if (savePath != NULL) {
+        save = fopen(savePath, "w");
+        if (save == NULL) {
+            fprintf(stderr, "Could not write \"%s\".\n", savePath);
+            exit(74);
+        }
+        fprintf(save, "# benchmark median-seconds peak-KiB, %d runs after %d warm-up\n", runs, warmup);
+    }
+
+    printf("%-18s %10s %10s", "benchmark", "clox (s)", "RSS (MiB)");
+    if (baselineCount >= 0) printf(" %12s %8s", "baseline (s)", "change");
+    if (jloxWords > 0) printf(" %10s %10s %8s", "jlox (s)", "RSS (MiB)", "speedup");
+    printf("\n");
+
+    bool failed = false;
+    for (; arg < argc; arg++) {
+        char name[64];
+        benchmarkName(argv[arg], name, sizeof(name));
+        printf("%-18s", name);
+        fflush(stdout);
+
+        Result result = runBenchmark(clox, cloxWords, argv[arg], warmup, runs);
+        if (!result.ok) {
+            printf(" %10s\n", "failed");
+            failed = true;
+            continue;
+        }
+        printf(" %10.3f %10.1f", result.median, result.peakKib / 1024.0);
+
+        if (baselineCount >= 0) {
+            BaselineEntry *entry = findBaseline(baseline, baselineCount, name);
+            if (entry == NULL) {
+                printf(" %12s %8s", "-", "-");
+            } else {
+                printf(" %12.3f %+7.1f%%", entry->median, 100.0 * (result.median - entry->median) / entry->median);
+            }
+        }
+
+        if (jloxWords > 0) {
+            fflush(stdout);
+            Result jloxResult = runBenchmark(jlox, jloxWords, argv[arg], warmup, runs);
+            if (jloxResult.ok) {
+                printf(" %10.3f %10.1f %7.1fx", jloxResult.median, jloxResult.peakKib / 1024.0,
+                       jloxResult.median / result.median);
+            } else {
+                printf(" %10s", "failed");
+            }
+        }
+        printf("\n");
+
+        if (save != NULL) fprintf(save, "%s %.4f %ld\n", name, result.median, result.peakKib);
+    }
+
+    if (save != NULL) fclose(save);
+    return failed ? 70 : 0;
+}
@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+
+/** The first four bytes of every bytecode file. */
+#define BYTECODE_MAGIC "LOXC"
+
+/** The length written in place of a missing string, such as the name of the script function. */
+#define NO_STRING 0xffffffff
+
+/**
+ * The kinds of constant stored in a bytecode file.
+ */
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantTag;
+
+/**
+ * The state of a bytecode file being loaded.
+ */
+typedef struct {
+    VM *vm;
+    FILE *file;
+
+    /** The size of the file, which bounds every count read from it. */
+    long size;
+
+    /** Set once the file turns out to be truncated or malformed. */
+    bool failed;
+} Reader;
+
+/* ===== Static functions ===== */
+
+/**
+ * Hashes the source code of a script using 64-bit FNV-1a.
+ * @param source the source code.
+ * @return the hash.
+ */
+static uint64_t hashSource(const char *source) {
+    uint64_t hash = 14695981039346656037u;
+    for (const char *c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+/**
+ * Writes a 32-bit integer in little-endian byte order.
+ * @param file the file.
+ * @param value the integer.
+ */
+static void writeU32(FILE *file, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        fputc((value >> (i * 8)) & 0xff, file);
+    }
+}
+
+/**
+ * Writes a 64-bit integer in little-endian byte order.
+ * @param file the file.
+ * @param value the integer.
+ */
+static void writeU64(FILE *file, uint64_t value) {
+    writeU32(file, (uint32_t)value);
+    writeU32(file, (uint32_t)(value >> 32));
+}
+
+/**
+ * Writes a string as its length followed by its characters.
+ * @param file the file.
+ * @param string the string, or NULL.
+ */
+static void writeString(FILE *file, ObjString *string) {
+    if (string == NULL) {
+        writeU32(file, NO_STRING);
+        return;
+    }
+
+    writeU32(file, (uint32_t)string->length);
+    fwrite(string->chars, sizeof(char), string->length, file);
+}
+
+static void writeFunction(FILE *file, ObjFunction *function);
+
+/**
+ * Writes a constant as its tag followed by its contents.
+ * @param file the file.
+ * @param value the constant.
+ */
+static void writeConstant(FILE *file, Value value) {
+    if (IS_NIL(value)) {
+        fputc(CONSTANT_NIL, file);
+    } else if (IS_BOOL(value)) {
+        fputc(AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE, file);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        fputc(CONSTANT_NUMBER, file);
+        writeU64(file, bits);
+    } else if (IS_STRING(value)) {
+        fputc(CONSTANT_STRING, file);
+        writeString(file, AS_STRING(value));
+    } else {
+        fputc(CONSTANT_FUNCTION, file);
+        writeFunction(file, AS_FUNCTION(value));
+    }
+}
+
+/**
+ * Compiles the deferred bodies of a function and every function nested in it,
+ * since a bytecode file holds only compiled code.
+ * @param vm the virtual machine.
+ * @param function the function.
+ * @return whether every body compiled.
+ */
+static bool compileDeferred(VM *vm, ObjFunction *function) {
+    if (function->lazy != NULL && !compileFunction(vm, function)) return false;
+
+    for (int i = 0; i < function->chunk.constants.count; i++) {
+        Value constant = function->chunk.constants.values[i];
+        if (IS_FUNCTION(constant) && !compileDeferred(vm, AS_FUNCTION(constant))) return false;
+    }
+    return true;
+}
+
+/**
+ * Writes a function and, through its constants, every function nested in it.
+ * Inline caches are written as a count only, as they are empty until the code runs.
+ * @param file the file.
+ * @param function the function.
+ */
+static void writeFunction(FILE *file, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+
+    writeU32(file, (uint32_t)function->arity);
+    writeU32(file, (uint32_t)function->upvalueCount);
+    writeString(file, function->name);
+
+    writeU32(file, (uint32_t)chunk->count);
+    fwrite(chunk->code, sizeof(uint8_t), chunk->count, file);
+
+    writeU32(file, (uint32_t)chunk->lineCount);
+    for (int i = 0; i < chunk->lineCount; i++) {
+        writeU32(file, (uint32_t)chunk->lines[i].offset);
+        writeU32(file, (uint32_t)chunk->lines[i].line);
+    }
+
+    writeU32(file, (uint32_t)chunk->cacheCount);
+
+    writeU32(file, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeConstant(file, chunk->constants.values[i]);
+    }
+}
+
+/**
+ * Reads a 32-bit integer in little-endian byte order.
+ * @param reader the reader.
+ * @return the integer, or 0 if the file ended.
+ */
+static uint32_t readU32(Reader *reader) {
+    uint8_t bytes[4];
+    if (fread(bytes, 1, sizeof(bytes), reader->file) != sizeof(bytes)) {
+        reader->failed = true;
+        return 0;
+    }
+
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+           ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+/**
+ * Reads a 64-bit integer in little-endian byte order.
+ * @param reader the reader.
+ * @return the integer, or 0 if the file ended.
+ */
+static uint64_t readU64(Reader *reader) {
+    uint64_t low = readU32(reader);
+    uint64_t high = readU32(reader);
+    return low | (high << 32);
+}
+
+/**
+ * Reads the number of elements in an array, which cannot exceed the size of the file.
+ * @param reader the reader.
+ * @return the count, or 0 if it is invalid.
+ */
+static int readCount(Reader *reader) {
+    uint32_t count = readU32(reader);
+    if (count > (uint32_t)reader->size) {
+        reader->failed = true;
+        return 0;
+    }
+    return (int)count;
+}
+
+/**
+ * Reads a string and interns it.
+ * @param reader the reader.
+ * @return the string, or NULL if it was written as missing or the file is malformed.
+ */
+static ObjString *readString(Reader *reader) {
+    uint32_t length = readU32(reader);
+    if (reader->failed || length == NO_STRING) return NULL;
+    if (length > (uint32_t)reader->size) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    char *chars = (char*)malloc(length + 1);
+    if (chars == NULL || fread(chars, sizeof(char), length, reader->file) != length) {
+        free(chars);
+        reader->failed = true;
+        return NULL;
+    }
+
+    ObjString *string = copyString(reader->vm, chars, (int)length);
+    free(chars);
+    return string;
+}
+
+static ObjFunction *readFunction(Reader *reader);
+
+/**
+ * Reads a constant.
+ * @param reader the reader.
+ * @return the constant, or nil if the file is malformed.
+ */
+static Value readConstant(Reader *reader) {
+    switch (fgetc(reader->file)) {
+        case CONSTANT_NIL: return NIL_VAL;
+        case CONSTANT_FALSE: return BOOL_VAL(false);
+        case CONSTANT_TRUE: return BOOL_VAL(true);
+        case CONSTANT_NUMBER: {
+            uint64_t bits = readU64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case CONSTANT_STRING: {
+            ObjString *string = readString(reader);
+            if (string != NULL) return OBJ_VAL(string);
+            break;
+        }
+        case CONSTANT_FUNCTION: {
+            ObjFunction *function = readFunction(reader);
+            if (function != NULL) return OBJ_VAL(function);
+            break;
+        }
+        default:
+            break;
+    }
+
+    reader->failed = true;
+    return NIL_VAL;
+}
+
+/**
+ * Reads a function and the functions nested in it.
+ * The function is kept on the VM's stack while it is being filled in.
+ * @param reader the reader.
+ * @return the function, or NULL if the file is malformed.
+ */
+static ObjFunction *readFunction(Reader *reader) {
+    VM *vm = reader->vm;
+    ObjFunction *function = newFunction(vm);
+    push(vm, OBJ_VAL(function));
+    Chunk *chunk = &function->chunk;
+
+    function->arity = (int)readU32(reader);
+    function->upvalueCount = (int)readU32(reader);
+    function->name = readString(reader);
+    if (function->name != NULL) {
+        WRITE_BARRIER(vm, function, OBJ_VAL(function->name));
+    }
+
+    int count = readCount(reader);
+    if (count > 0) {
+        chunk->code = GROW_ARRAY(vm, uint8_t, NULL, 0, count);
+        chunk->capacity = count;
+        if (fread(chunk->code, sizeof(uint8_t), count, reader->file) != (size_t)count) {
+            reader->failed = true;
+        }
+        chunk->count = count;
+    }
+
+    int lineCount = readCount(reader);
+    if (lineCount > 0) {
+        chunk->lines = GROW_ARRAY(vm, LineStart, NULL, 0, lineCount);
+        chunk->lineCapacity = lineCount;
+        chunk->lineCount = lineCount;
+        for (int i = 0; i < lineCount; i++) {
+            chunk->lines[i].offset = (int)readU32(reader);
+            chunk->lines[i].line = (int)readU32(reader);
+        }
+    }
+
+    int cacheCount = readCount(reader);
+    for (int i = 0; i < cacheCount; i++) {
+        addInlineCache(vm, chunk);
+    }
+
+    int constantCount = readCount(reader);
+    for (int i = 0; i < constantCount && !reader->failed; i++) {
+        Value constant = readConstant(reader);
+        addConstant(vm, chunk, constant);
+        WRITE_BARRIER(vm, function, constant);
+    }
+
+    pop(vm);
+    return reader->failed ? NULL : function;
+}
+
+/**
+ * Reads the global variable names recorded when the file was written, reserving
+ * their slots in the VM. The compiled code refers to globals by slot, so every
+ * name must land in the slot it had when the script was compiled.
+ * @param reader the reader.
+ * @return whether every global has the same slot as when the file was written.
+ */
+static bool readGlobals(Reader *reader) {
+    int count = readCount(reader);
+    for (int i = 0; i < count; i++) {
+        ObjString *name = readString(reader);
+        if (name == NULL || globalSlot(reader->vm, name) != i) return false;
+    }
+    return !reader->failed;
+}
+
+/* ===== End static functions ===== */
+
+bool saveBytecode(VM *vm, ObjFunction *function, const char *source, const char *path) {
+    // Compiling may collect garbage, and nothing else refers to the script yet.
+    push(vm, OBJ_VAL(function));
+    bool compiled = compileDeferred(vm, function);
+    pop(vm);
+    if (!compiled) return false;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    fwrite(BYTECODE_MAGIC, sizeof(char), 4, file);
+    writeU32(file, BYTECODE_VERSION);
+    writeU32(file, (uint32_t)strlen(source));
+    writeU64(file, hashSource(source));
+
+    writeU32(file, (uint32_t)vm->globalNames.count);
+    for (int i = 0; i < vm->globalNames.count; i++) {
+        writeString(file, AS_STRING(vm->globalNames.values[i]));
+    }
+
+    writeFunction(file, function);
+
+    bool written = !ferror(file);
+    if (fclose(file) != 0) written = false;
+    if (!written) remove(path);
+    return written;
+}
+
+ObjFunction *loadBytecode(VM *vm, const char *source, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    Reader reader;
+    reader.vm = vm;
+    reader.file = file;
+    reader.failed = false;
+
+    fseek(file, 0L, SEEK_END);
+    reader.size = ftell(file);
+    rewind(file);
+
+    char magic[4];
+    ObjFunction *function = NULL;
+    if (fread(magic, sizeof(char), 4, file) == 4 && memcmp(magic, BYTECODE_MAGIC, 4) == 0 &&
+        readU32(&reader) == BYTECODE_VERSION &&
+        readU32(&reader) == (uint32_t)strlen(source) &&
+        readU64(&reader) == hashSource(source) &&
+        readGlobals(&reader)) {
+        function = readFunction(&reader);
+    }
+
+    fclose(file);
+    return function;
+}
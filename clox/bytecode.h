@@ -0,0 +1,36 @@
+#ifndef CLOX_BYTECODE_H
+#define CLOX_BYTECODE_H
+
+#include "object.h"
+#include "vm.h"
+
+/** The file name suffix appended to a script's path to name its bytecode cache. */
+#define BYTECODE_SUFFIX "c"
+
+/** The version of the bytecode file format. Files of any other version are ignored. */
+#define BYTECODE_VERSION 5
+
+/**
+ * Writes a compiled script to a bytecode file. The file records a hash of the
+ * source and the VM's global variable slots, which the compiled code refers to by index.
+ * Function bodies deferred to their first call are compiled first.
+ * @param vm the virtual machine the script was compiled by.
+ * @param function the top-level function of the script.
+ * @param source the source code the script was compiled from.
+ * @param path the path of the bytecode file.
+ * @return whether the file was written.
+ */
+bool saveBytecode(VM *vm, ObjFunction *function, const char *source, const char *path);
+
+/**
+ * Reads a compiled script from a bytecode file.
+ * Bytecode files are trusted: only the header is checked, not the bytecode itself.
+ * @param vm the virtual machine.
+ * @param source the current source code of the script.
+ * @param path the path of the bytecode file.
+ * @return the top-level function of the script, or NULL if the file is missing,
+ *         was written for other source or cannot be loaded into this VM.
+ */
+ObjFunction *loadBytecode(VM *vm, const char *source, const char *path);
+
+#endif //CLOX_BYTECODE_H
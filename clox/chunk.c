@@ -2,39 +2,158 @@
 
 #include "memory.h"
 #include "chunk.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk *chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+        return;
+    }
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(vm, LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
 }
 
-void freeChunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM *vm, Chunk *chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+    freeValueArray(vm, &chunk->constants);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
-int addConstant(Chunk *chunk, Value value) {
-    push(value);
-    writeValueArray(&chunk->constants, value);
-    pop(value);
+int getLine(Chunk *chunk, int offset) {
+    int start = 0;
+    int end = chunk->lineCount - 1;
+
+    while (start < end) {
+        int mid = start + (end - start + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            start = mid;
+        } else {
+            end = mid - 1;
+        }
+    }
+
+    return chunk->lines[start].line;
+}
+
+int instructionLength(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_BUILD_LIST:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SUPER_INVOKE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT_LOCALS:
+        case OP_MULTIPLY_LOCALS:
+        case OP_DIVIDE_LOCALS:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_ADD_REGISTERS:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY_REGISTERS:
+        case OP_DIVIDE_REGISTERS:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE_LONG:
+        case OP_GET_LOCAL_PROPERTY:
+            return 5;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+            return 6;
+        case OP_INVOKE_LONG:
+            return 7;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        case OP_CLOSURE_LONG: {
+            int constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 4 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+int addConstant(VM *vm, Chunk *chunk, Value value) {
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
 }
+
+int addInlineCache(VM *vm, Chunk *chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->nextEntry = 0;
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        cache->entries[i].shape = NULL;
+        cache->entries[i].slot = -1;
+        cache->entries[i].transition = NULL;
+        cache->entries[i].version = 0;
+        cache->entries[i].method = NULL;
+    }
+
+    return chunk->cacheCount++;
+}
@@ -6,9 +6,12 @@
 
 /**
  * Lox opcodes.
+ * The _LONG variants take a 24-bit constant index instead of a single byte
+ * and are only emitted once a chunk has more than 256 constants.
  */
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
@@ -21,9 +24,13 @@ typedef enum {
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_GET_PROPERTY,
+    OP_GET_PROPERTY_LONG,
     OP_SET_PROPERTY,
+    OP_SET_PROPERTY_LONG,
     OP_GET_SUPER,
+    OP_GET_SUPER_LONG,
     OP_SUPER_INVOKE,
+    OP_SUPER_INVOKE_LONG,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -38,15 +45,113 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    /** A call whose result is returned at once. It reuses the caller's frame when calling a Lox function. */
+    OP_TAIL_CALL,
     OP_INVOKE,
+    OP_INVOKE_LONG,
     OP_CLOSURE,
+    OP_CLOSURE_LONG,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
+    OP_CLASS_LONG,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    OP_METHOD_LONG,
+    /** Pops the given number of values into a new list. */
+    OP_BUILD_LIST,
+    /** Pops a collection and an index and pushes the element. */
+    OP_GET_INDEX,
+    /** Pops a collection, an index and a value, stores the value and pushes it. */
+    OP_SET_INDEX,
+
+    /* Superinstructions, only emitted by optimizeChunk(). */
+
+    /** Adds a constant to a local variable in place: GET_LOCAL, CONSTANT, ADD, SET_LOCAL, POP. */
+    OP_ADD_LOCAL_CONSTANT,
+    /** Pops two numbers and jumps unless the first is less: LESS, JUMP_IF_FALSE, POP. */
+    OP_JUMP_IF_NOT_LESS,
+    /** Pops two numbers and jumps unless the first is greater: GREATER, JUMP_IF_FALSE, POP. */
+    OP_JUMP_IF_NOT_GREATER,
+    /** Pops two values and jumps unless they are equal: EQUAL, JUMP_IF_FALSE, POP. */
+    OP_JUMP_IF_NOT_EQUAL,
+    /** Pushes a property of a local variable, such as this.x: GET_LOCAL, GET_PROPERTY. */
+    OP_GET_LOCAL_PROPERTY,
+
+    /*
+     * Register instructions, also only emitted by optimizeChunk(). Their operands
+     * name local slots of the current frame, which serve as registers.
+     */
+
+    /** Stores the sum of two locals in a third: GET_LOCAL, GET_LOCAL, ADD, SET_LOCAL, POP. */
+    OP_ADD_REGISTERS,
+    /** Stores the difference of two locals in a third: GET_LOCAL, GET_LOCAL, SUBTRACT, SET_LOCAL, POP. */
+    OP_SUBTRACT_REGISTERS,
+    /** Stores the product of two locals in a third: GET_LOCAL, GET_LOCAL, MULTIPLY, SET_LOCAL, POP. */
+    OP_MULTIPLY_REGISTERS,
+    /** Stores the quotient of two locals in a third: GET_LOCAL, GET_LOCAL, DIVIDE, SET_LOCAL, POP. */
+    OP_DIVIDE_REGISTERS,
+    /** Pushes the sum of two locals: GET_LOCAL, GET_LOCAL, ADD. */
+    OP_ADD_LOCALS,
+    /** Pushes the difference of two locals: GET_LOCAL, GET_LOCAL, SUBTRACT. */
+    OP_SUBTRACT_LOCALS,
+    /** Pushes the product of two locals: GET_LOCAL, GET_LOCAL, MULTIPLY. */
+    OP_MULTIPLY_LOCALS,
+    /** Pushes the quotient of two locals: GET_LOCAL, GET_LOCAL, DIVIDE. */
+    OP_DIVIDE_LOCALS
 } OpCode;
 
+/** The number of opcodes. */
+#define OPCODE_COUNT (OP_DIVIDE_LOCALS + 1)
+
+/** The largest constant index a long instruction can address. */
+#define MAX_LONG_CONSTANT 0xffffff
+
+/** The number of receiver classes an inline cache remembers. */
+#define INLINE_CACHE_SIZE 4
+
+/**
+ * A property lookup resolved for one receiver shape.
+ */
+typedef struct {
+    /** The receiver shape, or NULL if the entry is empty. */
+    ObjShape *shape;
+
+    /** The field slot holding the property, or -1 if it names a method. */
+    int slot;
+
+    /** For stores that add a field, the shape the receiver transitions to. */
+    ObjShape *transition;
+
+    /** The receiver class's version when the method was resolved. */
+    uint32_t version;
+
+    /** The resolved method. */
+    ObjClosure *method;
+} CacheEntry;
+
+/**
+ * Per-call-site cache for property and method lookups.
+ */
+typedef struct {
+    /** The next entry to replace once the cache is full. */
+    int nextEntry;
+
+    /** The shapes resolved at this site, monomorphic entry first. */
+    CacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
+/**
+ * The start of a run of bytecode that originated on the same source line.
+ */
+typedef struct {
+    /** The offset of the first byte in the run. */
+    int offset;
+
+    /** The source line of every byte in the run. */
+    int line;
+} LineStart;
+
 /**
  * Lox chunk.
  */
@@ -60,11 +165,26 @@ typedef struct {
     /** The opcodes stored within this chunk. */
     uint8_t *code;
 
-    /** The lines that each instruction originated within the source. */
-    int *lines;
+    /** The number of line runs. */
+    int lineCount;
+
+    /** The capacity of the line run array. */
+    int lineCapacity;
+
+    /** The source lines of the bytecode, run-length encoded in offset order. */
+    LineStart *lines;
 
     /** The constants in this chunk. */
     ValueArray constants;
+
+    /** The number of inline caches in this chunk. */
+    int cacheCount;
+
+    /** The capacity of the inline cache array. */
+    int cacheCapacity;
+
+    /** The inline caches used by property access and invoke instructions. */
+    InlineCache *caches;
 } Chunk;
 
 /**
@@ -75,24 +195,51 @@ void initChunk(Chunk *chunk);
 
 /**
  * Appends a byte to the end of the given chunk.
+ * @param vm the virtual machine.
  * @param chunk a pointer to the chunk.
  * @param byte the byte to append.
  * @param line the line that the instruction originated within the source.
  */
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
 
 /**
  * Frees a chunk's allocated memory.
+ * @param vm the virtual machine.
  * @param chunk a pointer to the chunk.
  */
-void freeChunk(Chunk *chunk);
+void freeChunk(VM *vm, Chunk *chunk);
+
+/**
+ * Gets the source line that the byte at the given offset originated from.
+ * @param chunk a pointer to the chunk.
+ * @param offset the offset of the byte within the chunk.
+ * @return the source line.
+ */
+int getLine(Chunk *chunk, int offset);
+
+/**
+ * Gets the length of the instruction at the given offset, including its operands.
+ * @param chunk a pointer to the chunk.
+ * @param offset the offset of the instruction within the chunk.
+ * @return the length in bytes.
+ */
+int instructionLength(Chunk *chunk, int offset);
 
 /**
  * Appends a value to a chunk's constants.
+ * @param vm the virtual machine.
  * @param chunk the chunk.
  * @param value the new value.
  * @return the index where the constant was appended.
  */
-int addConstant(Chunk *chunk, Value value);
+int addConstant(VM *vm, Chunk *chunk, Value value);
+
+/**
+ * Appends an empty inline cache to a chunk.
+ * @param vm the virtual machine.
+ * @param chunk the chunk.
+ * @return the index of the new inline cache.
+ */
+int addInlineCache(VM *vm, Chunk *chunk);
 
 #endif //CLOX_CHUNK_H
@@ -6,10 +6,14 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+
+// CLOX_NO_DEBUG is defined for builds that are measured, such as clox-release.
+#ifndef CLOX_NO_DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
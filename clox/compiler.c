@@ -6,23 +6,13 @@
 #include "scanner.h"
 #include "value.h"
 #include "object.h"
+#include "memory.h"
+#include "optimizer.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#include "memory.h"
-
 #endif
 
-/**
- * Lox parser.
- */
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
-
 /**
  * Lox precedence levels.
  */
@@ -40,10 +30,12 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
+typedef struct Parser Parser;
+
 /**
  * Generic function for other parse functions.
  */
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 /**
  * Represents a parse rule for a specific precedence.
@@ -69,8 +61,35 @@ typedef struct {
 typedef struct {
     uint8_t index;
     bool isLocal;
+    /** The name the upvalue was resolved from. */
+    Token name;
 } Upvalue;
 
+/**
+ * The size of a chunk at some point during compilation, so that code emitted
+ * after it can be discarded.
+ */
+typedef struct {
+    int count;
+    int lineCount;
+    int constantCount;
+    int cacheCount;
+} Checkpoint;
+
+/**
+ * The code of an expression whose value is known at compile time.
+ */
+typedef struct {
+    /** Where the code of the expression starts. */
+    Checkpoint start;
+
+    /** The offset just past the code of the expression, or -1 if there is none. */
+    int end;
+
+    /** The value of the expression. */
+    Value value;
+} ConstantExpression;
+
 /**
  * Function types.
  */
@@ -93,6 +112,18 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+
+    /** The last constant expression compiled, which may be folded into the next. */
+    ConstantExpression constant;
+
+    /** The offset of the last OP_CALL emitted, or -1 if code since then was discarded. */
+    int lastCall;
+
+    /**
+     * Whether the function's body is only checked for errors and its upvalues
+     * resolved, to be compiled on its first call. No code is emitted for it.
+     */
+    bool isLazy;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -100,214 +131,481 @@ typedef struct ClassCompiler {
     bool hasSuperClass;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *currentClass = NULL;
+/**
+ * Lox parser. This holds all the state of a compilation.
+ */
+struct Parser {
+    VM *vm;
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    /** Whether the source is held open by the VM, so strings may refer into it. */
+    bool borrowSource;
+    /** Whether the bodies of functions are compiled on their first call rather than now. */
+    bool lazyFunctions;
+
+    /** The compiler of the innermost function being compiled. */
+    Compiler *compiler;
+    /** The innermost class being compiled, or NULL. */
+    ClassCompiler *currentClass;
+};
 
 /* ===== Static functions ===== */
 
 /**
- * Gets the current chunk.
- * @return the current chunk.
+ * Gets the parser->compiler chunk.
+ * @param parser the parser.
+ * @return the parser->compiler chunk.
+ */
+static Chunk *currentChunk(Parser *parser) {
+    return &parser->compiler->function->chunk;
+}
+
+/**
+ * Makes a string out of part of the source, referring to it rather than copying
+ * it when the VM holds the source open.
+ * @param parser the parser.
+ * @param chars the start of the string within the source.
+ * @param length the length of the string.
+ * @param hash the hash of the string, as computed by hashString().
+ * @return the string.
  */
-static Chunk *currentChunk() {
-    return &current->function->chunk;
+static ObjString *sourceString(Parser *parser, const char *chars, int length, uint32_t hash) {
+    if (parser->borrowSource) return referenceStringHashed(parser->vm, chars, length, hash);
+    return copyStringHashed(parser->vm, chars, length, hash);
+}
+
+/**
+ * Makes a string out of the text of an identifier, using the hash the scanner computed.
+ * @param parser the parser.
+ * @param name the identifier.
+ * @return the string.
+ */
+static ObjString *identifierString(Parser *parser, Token *name) {
+    return sourceString(parser, name->start, name->length, name->hash);
 }
 
 /**
  * Displays an error message for the specified token.
  * This function also sets the hadError flag.
+ * @param parser the parser.
  * @param token the token causing the error.
  * @param message the error message to display.
  */
-static void errorAt(Token *token, const char *message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+static void errorAt(Parser *parser, Token *token, const char *message) {
+    if (parser->panicMode) return;
+    parser->panicMode = true;
+
+    // A body compiled on its first call may come after what the script printed so far.
+    flushOutput(&parser->vm->output);
+    Output *errors = &parser->vm->errorOutput;
+    writeFormatted(errors, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        writeOutput(errors, " at end", 7);
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        writeFormatted(errors, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    writeFormatted(errors, ": %s\n", message);
+    parser->hadError = true;
 }
 
 /**
  * Reports an error with the given message.
+ * @param parser the parser.
  * @param message the error message.
  */
-static void error(const char *message) {
-    errorAt(&parser.previous, message);
+static void error(Parser *parser, const char *message) {
+    errorAt(parser, &parser->previous, message);
 }
 
 /**
- * Reports an error at the current token.
+ * Reports an error at the parser->compiler token.
+ * @param parser the parser.
  * @param message the error message.
  */
-static void errorAtCurrent(const char *message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser *parser, const char *message) {
+    errorAt(parser, &parser->current, message);
 }
 
 /**
  * Advances the parser and scans the next token.
+ * @param parser the parser.
  */
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser *parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
 /**
  * Consumes the next token of the given type. If the next token
  * is not of the expected type, an error is reported.
+ * @param parser the parser.
  * @param type the expected token type.
  * @param message the error message to display.
  */
-static void consume(TokenType type, const char *message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser *parser, TokenType type, const char *message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
 /**
- * Checks if the current token is of the given type.
+ * Checks if the parser->compiler token is of the given type.
+ * @param parser the parser.
  * @param type the token type.
- * @return if the current token is of the given type.
+ * @return if the parser->compiler token is of the given type.
  */
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser *parser, TokenType type) {
+    return parser->current.type == type;
 }
 
 /**
- * Checks if the current token matches the given type.
+ * Checks if the parser->compiler token matches the given type.
+ * @param parser the parser.
  * @param type the token type.
- * @return if the current token is of the given type.
+ * @return if the parser->compiler token is of the given type.
  */
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(Parser *parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
 /**
  * Writes a byte to the chunk.
+ * @param parser the parser.
  * @param byte the byte to write.
  */
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser *parser, uint8_t byte) {
+    if (parser->compiler->isLazy) return;
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
 /**
  * Writes two bytes to the chunk.
+ * @param parser the parser.
  * @param byte1 the first byte.
  * @param byte2 the second byte.
  */
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
+}
+
+/**
+ * Writes an instruction that takes a global variable slot as its operand.
+ * @param parser the parser.
+ * @param instruction the instruction.
+ * @param slot the global variable slot.
+ */
+static void emitGlobal(Parser *parser, uint8_t instruction, uint16_t slot) {
+    emitByte(parser, instruction);
+    emitByte(parser, (slot >> 8) & 0xff);
+    emitByte(parser, slot & 0xff);
+}
+
+/**
+ * Writes the operand of a property access or invoke instruction that
+ * refers to a new inline cache in the chunk.
+ * @param parser the parser.
+ */
+static void emitInlineCache(Parser *parser) {
+    if (parser->compiler->isLazy) return;
+
+    int cache = addInlineCache(parser->vm, currentChunk(parser));
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many property accesses in one chunk.");
+        return;
+    }
+
+    emitByte(parser, (cache >> 8) & 0xff);
+    emitByte(parser, cache & 0xff);
+}
+
+/**
+ * Records the current size of the chunk.
+ * @param parser the parser.
+ * @return the checkpoint.
+ */
+static Checkpoint checkpoint(Parser *parser) {
+    Chunk *chunk = currentChunk(parser);
+    Checkpoint checkpoint;
+    checkpoint.count = chunk->count;
+    checkpoint.lineCount = chunk->lineCount;
+    checkpoint.constantCount = chunk->constants.count;
+    checkpoint.cacheCount = chunk->cacheCount;
+    return checkpoint;
+}
+
+/**
+ * Discards the code, constants and inline caches added to the chunk since a checkpoint.
+ * Jumps emitted before the checkpoint must not have been patched to land after it.
+ * @param parser the parser.
+ * @param checkpoint the checkpoint.
+ */
+static void discardCode(Parser *parser, Checkpoint checkpoint) {
+    Chunk *chunk = currentChunk(parser);
+    chunk->count = checkpoint.count;
+    chunk->lineCount = checkpoint.lineCount;
+    chunk->constants.count = checkpoint.constantCount;
+    chunk->cacheCount = checkpoint.cacheCount;
+    parser->compiler->constant.end = -1;
+    parser->compiler->lastCall = -1;
+}
+
+/**
+ * Gets the expression just compiled if its value is known at compile time.
+ * @param parser the parser.
+ * @param value set to the value of the expression.
+ * @param start set to where the code of the expression starts.
+ * @return whether the last code emitted is a constant expression.
+ */
+static bool lastConstant(Parser *parser, Value *value, Checkpoint *start) {
+    // Nothing is folded in a body that emits no code.
+    if (parser->compiler->isLazy) return false;
+
+    ConstantExpression *constant = &parser->compiler->constant;
+    if (constant->end != currentChunk(parser)->count) return false;
+
+    *value = constant->value;
+    *start = constant->start;
+    return true;
 }
 
 /**
  * Emits a loop instruction.
+ * @param parser the parser.
  * @param loopStart the start index of the loop.
  */
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(Parser *parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = currentChunk(parser)->count - loopStart + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
 /**
  * Emits a jump instruction.
+ * @param parser the parser.
  * @param instruction the jump instruction.
  * @return the index of the jump instruction.
  */
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+static int emitJump(Parser *parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
 /**
  * Writes the return opcode to the chunk.
+ * @param parser the parser.
  */
-static void emitReturn() {
-    if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0);
+static void emitReturn(Parser *parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emitBytes(parser, OP_GET_LOCAL, 0);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_RETURN);
 }
 
 /**
  * Creates a new constant in the chunk, and returns the constant's index.
+ * @param parser the parser.
  * @param value the constant's value.
  * @return the index of the constant in the chunk.
  */
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+static int makeConstant(Parser *parser, Value value) {
+    if (parser->compiler->isLazy) return 0;
+
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
+    WRITE_BARRIER(parser->vm, parser->compiler->function, value);
+    if (constant > MAX_LONG_CONSTANT) {
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
+}
+
+/**
+ * Writes an instruction that takes a constant index as its operand.
+ * The long form with a 24-bit operand is only used when the index does not fit in a byte.
+ * @param parser the parser.
+ * @param instruction the instruction.
+ * @param longInstruction the long form of the instruction.
+ * @param constant the index of the constant.
+ */
+static void emitConstantOp(Parser *parser, uint8_t instruction, uint8_t longInstruction, int constant) {
+    if (constant <= UINT8_MAX) {
+        emitBytes(parser, instruction, (uint8_t)constant);
+        return;
+    }
+
+    emitByte(parser, longInstruction);
+    emitByte(parser, (constant >> 16) & 0xff);
+    emitByte(parser, (constant >> 8) & 0xff);
+    emitByte(parser, constant & 0xff);
 }
 
 /**
  * Writes a new constant to the chunk.
+ * @param parser the parser.
  * @param value the value of the constant.
  */
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser *parser, Value value) {
+    emitConstantOp(parser, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(parser, value));
+}
+
+/**
+ * Records the code at the end of the chunk as a constant expression. This is also
+ * used to restore one after the code that followed it was discarded.
+ * @param parser the parser.
+ * @param value the value of the expression.
+ * @param start where the code of the expression starts.
+ */
+static void keepConstant(Parser *parser, Value value, Checkpoint start) {
+    ConstantExpression *constant = &parser->compiler->constant;
+    constant->start = start;
+    constant->end = currentChunk(parser)->count;
+    constant->value = value;
+}
+
+/**
+ * Emits a literal value and records it as a constant expression.
+ * @param parser the parser.
+ * @param value the value.
+ */
+static void emitConstantExpression(Parser *parser, Value value) {
+    Checkpoint start = checkpoint(parser);
+    if (IS_NIL(value)) {
+        emitByte(parser, OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(parser, value);
+    }
+
+    keepConstant(parser, value, start);
+}
+
+/**
+ * Determines whether a constant is falsey, as the VM would.
+ * @param value the value.
+ * @return whether the value is nil or false.
+ */
+static bool isFalseyConstant(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void patchJump(int offset) {
-    int jump = currentChunk()->count - offset - 2;
+/**
+ * Evaluates a binary operator on two constants.
+ * Operands of the wrong type are not folded, so the VM raises the same error at runtime.
+ * @param parser the parser.
+ * @param operatorType the operator.
+ * @param a the left operand.
+ * @param b the right operand.
+ * @param result set to the result.
+ * @return whether the operator was evaluated.
+ */
+static bool foldBinary(Parser *parser, TokenType operatorType, Value a, Value b, Value *result) {
+    switch (operatorType) {
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+        default: break;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(parser->vm, char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(parser->vm, chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    // The negated comparisons mirror the OP_NOT the VM would apply, which matters for NaN.
+    switch (operatorType) {
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+        default: return false;
+    }
+}
+
+static void patchJump(Parser *parser, int offset) {
+    if (parser->compiler->isLazy) return;
+
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+
+    // Code before the jump's target can no longer be discarded.
+    parser->compiler->constant.end = -1;
 }
 
 /**
  * Initialise the compiler.
+ * @param parser the parser.
  * @param compiler the compiler.
+ * @param type the type of the function.
+ * @param function the function whose deferred body is compiled, or NULL to create a new function.
  */
-static void initCompiler(Compiler *compiler, FunctionType type) {
-    compiler->enclosing = current;
+static void initCompiler(Parser *parser, Compiler *compiler, FunctionType type, ObjFunction *function) {
+    Compiler *enclosing = parser->compiler;
+    compiler->enclosing = enclosing;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
-    if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+    compiler->constant.end = -1;
+    compiler->lastCall = -1;
+    compiler->isLazy = enclosing != NULL && (enclosing->isLazy || parser->lazyFunctions);
+    compiler->function = function != NULL ? function : newFunction(parser->vm);
+    parser->compiler = compiler;
+
+    // Functions nested in a lazy body are checked again when it is compiled, so only those deferred now need a name.
+    bool isNested = enclosing != NULL && enclosing->isLazy;
+    if (type != TYPE_SCRIPT && function == NULL && !isNested) {
+        parser->compiler->function->name = identifierString(parser, &parser->previous);
+        WRITE_BARRIER(parser->vm, parser->compiler->function, OBJ_VAL(parser->compiler->function->name));
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
 
@@ -322,61 +620,68 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 
 /**
  * Terminates the compiler.
+ * @param parser the parser.
  */
-static ObjFunction *endCompiler() {
-    emitReturn();
-    ObjFunction *function = current->function;
+static ObjFunction *endCompiler(Parser *parser) {
+    emitReturn(parser);
+    ObjFunction *function = parser->compiler->function;
+    bool hasCode = !parser->hadError && !parser->compiler->isLazy;
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    if (hasCode) {
+        disassembleChunk(parser->vm, currentChunk(parser), function->name);
     }
+#else
+    if (hasCode) optimizeChunk(currentChunk(parser));
 #endif
 
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
 /**
  * Begin a new scope.
+ * @param parser the parser.
  */
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(Parser *parser) {
+    parser->compiler->scopeDepth++;
 }
 
 /**
  * End a scope.
+ * @param parser the parser.
  */
-static void endScope() {
-    current->scopeDepth--;
-
-    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        emitByte(OP_POP);
+static void endScope(Parser *parser) {
+    parser->compiler->scopeDepth--;
 
-        if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE);
+    while (parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+        if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
         } else {
-            emitByte(OP_POP);
+            emitByte(parser, OP_POP);
         }
 
-        current->localCount--;
+        parser->compiler->localCount--;
     }
 }
 
 /**
  * Gets the next expression.
+ * @param parser the parser.
  */
-static void expression();
+static void expression(Parser *parser);
 
 /**
  * Gets the next statement.
+ * @param parser the parser.
  */
-static void statement();
+static void statement(Parser *parser);
 
 /**
  * Gets the next declaration.
+ * @param parser the parser.
  */
-static void declaration();
+static void declaration(Parser *parser);
 
 /**
  * Gets the parse rule for the given type.
@@ -387,42 +692,66 @@ static ParseRule *getRule(TokenType type);
 
 /**
  * Identifies the token's precedence and executes the relevant prefix and infix functions.
+ * @param parser the parser.
  * @param precedence the token's precedence.
  */
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser *parser, Precedence precedence);
 
 /**
  * Gets the next identifier constant.
+ * @param parser the parser.
  * @param name the name of the constant.
  * @return the index of the new constant.
  */
-static uint8_t identifierConstant(Token *name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifierConstant(Parser *parser, Token *name) {
+    if (parser->compiler->isLazy) return 0;
+    return makeConstant(parser, OBJ_VAL(identifierString(parser, name)));
+}
+
+/**
+ * Resolves a global variable to its slot in the VM's global array.
+ * @param parser the parser.
+ * @param name the name of the variable.
+ * @return the slot of the global variable.
+ */
+static uint16_t globalVariable(Parser *parser, Token *name) {
+    // A lazy body reserves its global slots when it is compiled.
+    if (parser->compiler->isLazy) return 0;
+
+    int slot = globalSlot(parser->vm, identifierString(parser, name));
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
 }
 
 /**
  * Determines whether two identifiers are equal.
+ * @param parser the parser.
  * @param a the first token.
  * @param b the second token.
  * @return if the two identifiers are equal.
  */
-static bool identifiersEqual(Token *a, Token *b) {
+static bool identifiersEqual(Parser *parser, Token *a, Token *b) {
     if (a->length != b->length) return false;
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
 /**
  * Resolves a local variable.
+ * @param parser the parser.
  * @param compiler the compiler.
  * @param name the variable's name.
  * @return the index of the variable, or -1 if it does not exist.
  */
-static int resolveLocal(Compiler *compiler, Token *name) {
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name) {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local *local = &compiler->locals[i];
-        if (identifiersEqual(name, &local->name)) {
+        if (identifiersEqual(parser, name, &local->name)) {
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -433,15 +762,18 @@ static int resolveLocal(Compiler *compiler, Token *name) {
 
 /**
  * Adds an upvalue.
+ * @param parser the parser.
  * @param compiler the compiler.
  * @param index the index of the upvalue.
  * @param isLocal whether the upvalue is local.
+ * @param name the name of the upvalue.
  * @return the number of upvalues.
  */
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index, bool isLocal, Token *name) {
     int upvalueCount = compiler->function->upvalueCount;
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].name = *name;
 
     for (int i = 0; i < upvalueCount; i++) {
         Upvalue *upvalue = &compiler->upvalues[i];
@@ -451,7 +783,7 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
     }
 
     if (upvalueCount == UINT8_COUNT) {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
 
@@ -460,22 +792,35 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
 
 /**
  * Resolves an upvalue.
+ * @param parser the parser.
  * @param compiler the compiler.
  * @param name the name of the upvalue.
  * @return the number of upvalues.
  */
-static int resolveUpvalue(Compiler *compiler, Token *name) {
-    if (compiler->enclosing == NULL) return -1;
+static int resolveUpvalue(Parser *parser, Compiler *compiler, Token *name) {
+    if (compiler->enclosing == NULL) {
+        // The enclosing functions of a deferred body have been compiled; their variables are reached by name.
+        LazyBody *lazy = compiler->function->lazy;
+        if (lazy == NULL) return -1;
 
-    int local = resolveLocal(compiler->enclosing, name);
+        for (int i = 0; i < compiler->function->upvalueCount; i++) {
+            ObjString *upvalue = lazy->upvalueNames[i];
+            if (upvalue->length == name->length && memcmp(upvalue->chars, name->start, name->length) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint8_t)local, true, name);
     }
 
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false, name);
     }
 
     return -1;
@@ -483,15 +828,16 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
 
 /**
  * Adds a bew variable to the scope.
+ * @param parser the parser.
  * @param name the variable name.
  */
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+static void addLocal(Parser *parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -499,520 +845,740 @@ static void addLocal(Token name) {
 
 /**
  * Declares a new variavle on the scope.
+ * @param parser the parser.
  */
-static void declareVariable() {
-    if (current->scopeDepth == 0) return;
+static void declareVariable(Parser *parser) {
+    if (parser->compiler->scopeDepth == 0) return;
 
-    Token *name = &parser.previous;
+    Token *name = &parser->previous;
 
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local *local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
-        if (identifiersEqual(name, &local->name)) {
-            error("Already a variable with this name in this scope.");
+        if (identifiersEqual(parser, name, &local->name)) {
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
 /**
- * Parses the current variable.
+ * Parses the parser->compiler variable.
+ * @param parser the parser.
  * @param errorMessage the error message to display if the next token is not an identifier.
  * @return the index of the new variable.
  */
-static uint8_t parseVariable(const char *errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+static uint16_t parseVariable(Parser *parser, const char *errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
-    if (current->scopeDepth > 0) return 0;
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(parser, &parser->previous);
 }
 
 /**
  * Marks a variable as initialised.
+ * @param parser the parser.
  */
-static void markInitialised() {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialised(Parser *parser) {
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
 /**
  * Defines a variable.
- * @param global the VM's global variables
+ * @param parser the parser.
+ * @param global the slot of the variable if it is a global.
  */
-static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) {
-        markInitialised();
+static void defineVariable(Parser *parser, uint16_t global) {
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialised(parser);
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(parser, OP_DEFINE_GLOBAL, global);
 }
 
 /**
  * Reads the argument list of a function definition.
+ * @param parser the parser.
  * @return the number of arguments.
  */
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser *parser) {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            expression();
+            expression(parser);
             if (argCount == 255) {
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             argCount++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
 
 /**
  * Compiles a logical and.
+ * @param parser the parser.
  * @param canAssign
  */
-static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser *parser, bool canAssign) {
+    Value left;
+    Checkpoint leftStart;
+    if (lastConstant(parser, &left, &leftStart)) {
+        if (isFalseyConstant(left)) {
+            Checkpoint rightStart = checkpoint(parser);
+            parsePrecedence(parser, PREC_AND);
+            discardCode(parser, rightStart);
+            keepConstant(parser, left, leftStart);
+        } else {
+            discardCode(parser, leftStart);
+            parsePrecedence(parser, PREC_AND);
+        }
+        return;
+    }
+
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
 /**
  * Compiles a logical or.
+ * @param parser the parser.
  * @param canAssign
  */
-static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+static void or_(Parser *parser, bool canAssign) {
+    Value left;
+    Checkpoint leftStart;
+    if (lastConstant(parser, &left, &leftStart)) {
+        if (isFalseyConstant(left)) {
+            discardCode(parser, leftStart);
+            parsePrecedence(parser, PREC_OR);
+        } else {
+            Checkpoint rightStart = checkpoint(parser);
+            parsePrecedence(parser, PREC_OR);
+            discardCode(parser, rightStart);
+            keepConstant(parser, left, leftStart);
+        }
+        return;
+    }
+
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
 /**
  * Compiles a binary expression into bytecode.
+ * @param parser the parser.
  */
-static void binary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void binary(Parser *parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
     ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+
+    Value left, right, result;
+    Checkpoint leftStart, rightStart;
+    bool isConstant = lastConstant(parser, &left, &leftStart);
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+    if (isConstant && lastConstant(parser, &right, &rightStart) &&
+        foldBinary(parser, operatorType, left, right, &result)) {
+        push(parser->vm, result);
+        discardCode(parser, leftStart);
+        emitConstantExpression(parser, result);
+        pop(parser->vm);
+        return;
+    }
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+        case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+        case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
+        case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;
         default: return;
     }
 }
 
 /**
  * Compiles a function call.
+ * @param parser the parser.
  * @param canAssign
  */
-static void call(bool canAssign) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+static void call(Parser *parser, bool canAssign) {
+    uint8_t argCount = argumentList(parser);
+    parser->compiler->lastCall = currentChunk(parser)->count;
+    emitBytes(parser, OP_CALL, argCount);
 }
 
 /**
  * Compiles a dot (instance set/get) statement.
+ * @param parser the parser.
  * @param canAssign if the previous object can be assigned to.
  */
-static void dot(bool canAssign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
-
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+static void dot(Parser *parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    int name = identifierConstant(parser, &parser->previous);
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitConstantOp(parser, OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+        emitInlineCache(parser);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        emitConstantOp(parser, OP_INVOKE, OP_INVOKE_LONG, name);
+        emitByte(parser, argCount);
+        emitInlineCache(parser);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitConstantOp(parser, OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+        emitInlineCache(parser);
     }
 }
 
 /**
- * Compiles a literal into bytecode.
+ * Compiles a list literal.
+ * @param parser the parser.
+ * @param canAssign
+ */
+static void list(Parser *parser, bool canAssign) {
+    int count = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression(parser);
+            if (count == 255) {
+                error(parser, "Can't have more than 255 elements in a list literal.");
+            }
+            count++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitBytes(parser, OP_BUILD_LIST, (uint8_t)count);
+}
+
+/**
+ * Compiles a subscript (element get/set).
+ * @param parser the parser.
+ * @param canAssign if the element can be assigned to.
  */
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL:   emitByte(OP_NIL); break;
-        case TOKEN_TRUE:  emitByte(OP_TRUE); break;
+static void subscript(Parser *parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitByte(parser, OP_SET_INDEX);
+    } else {
+        emitByte(parser, OP_GET_INDEX);
+    }
+}
+
+/**
+ * Compiles a literal into bytecode.
+ * @param parser the parser.
+ * @param parser the parser.
+ */
+static void literal(Parser *parser, bool canAssign) {
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitConstantExpression(parser, BOOL_VAL(false)); break;
+        case TOKEN_NIL:   emitConstantExpression(parser, NIL_VAL); break;
+        case TOKEN_TRUE:  emitConstantExpression(parser, BOOL_VAL(true)); break;
         default: return;
     }
 }
 
 /* Forward declared. */
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser *parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
 /**
  * Enters a new block.
- */
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+ * @param parser the parser.
+ */
+static void block(Parser *parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        bool isReturn = check(parser, TOKEN_RETURN);
+        declaration(parser);
+
+        // Nothing after a return in the same block can run, so it is compiled for errors only.
+        if (isReturn) {
+            Checkpoint unreachable = checkpoint(parser);
+            while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+                declaration(parser);
+            }
+            discardCode(parser, unreachable);
+        }
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 /**
  * Gets / creates a named variable.
+ * @param parser the parser.
  * @param name the name of the variable.
  * @param canAssign whether the variable can be assigned to.
  */
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser *parser, Token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
 
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+    bool isGlobal = getOp == OP_GET_GLOBAL;
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        if (isGlobal) {
+            emitGlobal(parser, setOp, (uint16_t)arg);
+        } else {
+            emitBytes(parser, setOp, (uint8_t)arg);
+        }
+    } else if (isGlobal) {
+        emitGlobal(parser, getOp, (uint16_t)arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitBytes(parser, getOp, (uint8_t)arg);
     }
 }
 
 /**
- * Compiles a function.
- * @param type the type of the function.
+ * Compiles the parameters and body of the current function.
+ * @param parser the parser.
  */
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+static void functionBody(Parser *parser) {
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent("Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
-        } while (match(TOKEN_COMMA));
+            uint16_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+
+
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+}
+
+/**
+ * Records where the body of the current function starts and what its upvalues
+ * are named, so that it can be compiled on its first call.
+ * @param parser the parser.
+ * @param start the token that starts the parameter list.
+ */
+static void deferBody(Parser *parser, Token *start) {
+    VM *vm = parser->vm;
+    Compiler *compiler = parser->compiler;
+    ObjFunction *function = compiler->function;
+
+    LazyBody *lazy = ALLOCATE(vm, LazyBody, 1);
+    lazy->start = start->start;
+    lazy->end = parser->scanner.end;
+    lazy->line = start->line;
+    lazy->type = (uint8_t)compiler->type;
+    lazy->inClass = parser->currentClass != NULL;
+    lazy->hasSuperClass = parser->currentClass != NULL && parser->currentClass->hasSuperClass;
+    lazy->upvalueNames = NULL;
+    function->lazy = lazy;
+
+    // The names are filled in one by one, as making each may collect garbage.
+    ObjString **names = ALLOCATE(vm, ObjString*, function->upvalueCount);
+    for (int i = 0; i < function->upvalueCount; i++) names[i] = NULL;
+    lazy->upvalueNames = names;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        names[i] = identifierString(parser, &compiler->upvalues[i].name);
+        WRITE_BARRIER(vm, function, OBJ_VAL(names[i]));
     }
+}
 
+/**
+ * Compiles a function.
+ * @param parser the parser.
+ * @param type the type of the function.
+ */
+static void function(Parser *parser, FunctionType type) {
+    Compiler compiler;
+    initCompiler(parser, &compiler, type, NULL);
+    bool isDeferred = compiler.isLazy && !compiler.enclosing->isLazy;
 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    Token start = parser->current;
+    functionBody(parser);
+    if (isDeferred && !parser->hadError) deferBody(parser, &start);
 
-    ObjFunction *function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    ObjFunction *function = endCompiler(parser);
+    emitConstantOp(parser, OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void method() {
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser *parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    int constant = identifierConstant(parser, &parser->previous);
 
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
 
-    function(type);
+    function(parser, type);
 
-    emitBytes(OP_METHOD, constant);
+    emitConstantOp(parser, OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 /**
  * Gets the next named variable.
+ * @param parser the parser.
  * @param canAssign  whether the variable can be assigned to.
  */
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser *parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 /**
  * Creates a synthetic token with the given text.
+ * @param parser the parser.
  * @param text the text.
  * @return the token.
  */
-static Token syntheticToken(const char *text) {
+static Token syntheticToken(Parser *parser, const char *text) {
     Token token;
     token.start = text;
     token.length = (int)strlen(text);
+    token.hash = hashString(text, token.length);
     return token;
 }
 
 /**
  * Creates a super reference.
+ * @param parser the parser.
  * @param canAssign if this can be assigned to.
  */
-static void super_(bool canAssign) {
-    if (currentClass == NULL) {
-        error("Can't use 'super' outside of a class.");
-    } else if (!currentClass->hasSuperClass) {
-        error("Can't use 'super' in a class with no superclass.");
+static void super_(Parser *parser, bool canAssign) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->currentClass->hasSuperClass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    int name = identifierConstant(parser, &parser->previous);
 
-    namedVariable(syntheticToken("this"), false);
-    if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+    namedVariable(parser, syntheticToken(parser, "this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken(parser, "super"), false);
+        emitConstantOp(parser, OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
+        emitByte(parser, argCount);
     } else {
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken(parser, "super"), false);
+        emitConstantOp(parser, OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
 /**
  * Creates a class.
+ * @param parser the parser.
  */
-static void classDeclaration() {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
-    declareVariable();
+static void classDeclaration(Parser *parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    int nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitConstantOp(parser, OP_CLASS, OP_CLASS_LONG, nameConstant);
+    defineVariable(parser, parser->compiler->scopeDepth > 0 ? 0 : globalVariable(parser, &className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperClass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    parser->currentClass = &classCompiler;
 
-    if (match(TOKEN_LESS)) {
-        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-        variable(false);
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous)) {
-            error("A class can't inherit from itself.");
+        if (identifiersEqual(parser, &className, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
         }
 
-        beginScope();
-        addLocal(syntheticToken("super"));
-        defineVariable(0);
+        beginScope(parser);
+        addLocal(parser, syntheticToken(parser, "super"));
+        defineVariable(parser, 0);
 
-        namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
         classCompiler.hasSuperClass = true;
     }
 
-    namedVariable(className, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        method();
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
 
     if (classCompiler.hasSuperClass) {
-        endScope();
+        endScope(parser);
     }
 
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
 
 /**
  * Creates a function.
+ * @param parser the parser.
+ * @param parser the parser.
+ * @param parser the parser.
  */
-static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
-    markInitialised();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+static void funDeclaration(Parser *parser) {
+    uint16_t global = parseVariable(parser, "Expect function name.");
+    markInitialised(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
 /* Forward declared. */
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser *parser) {
+    uint16_t global = parseVariable(parser, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
 /* Forward declared. */
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser *parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
 /**
  * Compiles a for statement.
+ * @param parser the parser.
  */
-static void forStatement() {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+static void forStatement(Parser *parser) {
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
-    if (match(TOKEN_SEMICOLON)) {
+    if (match(parser, TOKEN_SEMICOLON)) {
 
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+    bool neverRuns = false;
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+        Value condition;
+        Checkpoint conditionStart;
+        if (lastConstant(parser, &condition, &conditionStart)) {
+            discardCode(parser, conditionStart);
+            neverRuns = isFalseyConstant(condition);
+        } else {
+            exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+            emitByte(parser, OP_POP);
+        }
     }
+    Checkpoint loopCode = checkpoint(parser);
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' for after clauses.");
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' for after clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
+    if (neverRuns) discardCode(parser, loopCode);
 
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP);
     }
 
-    endScope();
+    endScope(parser);
 }
 
 /**
  * Compiles an if statement.
- */
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+ * @param parser the parser.
+ */
+static void ifStatement(Parser *parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    Value condition;
+    Checkpoint conditionStart;
+    if (lastConstant(parser, &condition, &conditionStart)) {
+        discardCode(parser, conditionStart);
+        bool isTrue = !isFalseyConstant(condition);
+
+        Checkpoint thenStart = checkpoint(parser);
+        statement(parser);
+        if (!isTrue) discardCode(parser, thenStart);
+
+        if (match(parser, TOKEN_ELSE)) {
+            Checkpoint elseStart = checkpoint(parser);
+            statement(parser);
+            if (isTrue) discardCode(parser, elseStart);
+        }
+        return;
+    }
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP);
 
-    patchJump(thenJump);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 }
 
 /**
  * Compiles a print statement.
+ * @param parser the parser.
  */
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void printStatement(Parser *parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
 /**
  * Compiles a return statement.
+ * @param parser the parser.
  */
-static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+static void returnStatement(Parser *parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON)) {
-        emitReturn();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
     } else {
-        if (current->type == TYPE_INITIALIZER) {
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
         }
 
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // The OP_RETURN stays after a tail call: jumps may land on it, and calls
+        // that cannot reuse the frame fall through to it.
+        Chunk *chunk = currentChunk(parser);
+        if (parser->compiler->lastCall == chunk->count - 2) chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+        emitByte(parser, OP_RETURN);
     }
 }
 
 /**
  * Compiles a while statement.
- */
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+ * @param parser the parser.
+ */
+static void whileStatement(Parser *parser) {
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    Value condition;
+    Checkpoint conditionStart;
+    if (lastConstant(parser, &condition, &conditionStart)) {
+        discardCode(parser, conditionStart);
+        statement(parser);
+        if (isFalseyConstant(condition)) {
+            discardCode(parser, conditionStart);
+        } else {
+            emitLoop(parser, loopStart);
+        }
+        return;
+    }
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
 /**
  * Synchronizes the VM.
+ * @param parser the parser.
  */
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser *parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -1026,95 +1592,120 @@ static void synchronize() {
                 ;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
 /**
  * Gets the next declaration.
- */
-static void declaration() {
-    if (match(TOKEN_CLASS)) {
-        classDeclaration();
-    } else if (match(TOKEN_FUN)) {
-        funDeclaration();
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+ * @param parser the parser.
+ */
+static void declaration(Parser *parser) {
+    if (match(parser, TOKEN_CLASS)) {
+        classDeclaration(parser);
+    } else if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 
-    if (parser.panicMode) synchronize();
+    if (parser->panicMode) synchronize(parser);
 }
 
 /**
  * Gets the next statement.
- */
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    } else if (match(TOKEN_FOR)) {
-        forStatement();
-    } else if (match(TOKEN_IF)) {
-        ifStatement();
-    } else if (match(TOKEN_RETURN)) {
-        returnStatement();
-    } else if (match(TOKEN_WHILE)) {
-        whileStatement();
-    } else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+ * @param parser the parser.
+ */
+static void statement(Parser *parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
 /**
  * Compiles a grouping into bytecode.
+ * @param parser the parser.
  */
-static void grouping(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser *parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 /**
  * Compiles a number into bytecode.
+ * @param parser the parser.
  */
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser *parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
+    emitConstantExpression(parser, NUMBER_VAL(value));
 }
 
 /**
- * Gets the next string and copies it onto the heap.
+ * Gets the next string literal.
+ * @param parser the parser.
  */
-static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser *parser, bool canAssign) {
+    if (parser->compiler->isLazy) return;
+
+    const char *chars = parser->previous.start + 1;
+    int length = parser->previous.length - 2;
+    emitConstantExpression(parser, OBJ_VAL(sourceString(parser, chars, length, hashString(chars, length))));
 }
 
 
 
-static void this_(bool canAssign) {
-    if (currentClass == NULL) {
-        error("Can't use 'this' outside of a class.");
+static void this_(Parser *parser, bool canAssign) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
 
-    variable(false);
+    variable(parser, false);
 }
 
 /**
  * Compiles a unary unary expression into bytecode.
+ * @param parser the parser.
  */
-static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser *parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
+
+    Value operand;
+    Checkpoint operandStart;
+    parsePrecedence(parser, PREC_UNARY);
 
-    parsePrecedence(PREC_UNARY);
+    if (lastConstant(parser, &operand, &operandStart)) {
+        if (operatorType == TOKEN_BANG) {
+            discardCode(parser, operandStart);
+            emitConstantExpression(parser, BOOL_VAL(isFalseyConstant(operand)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+            discardCode(parser, operandStart);
+            emitConstantExpression(parser, NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
 
     switch (operatorType) {
-        TOKEN_BANG:       emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG:  emitByte(parser, OP_NOT); break;
+        case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
         default: return;
     }
 }
@@ -1127,6 +1718,8 @@ ParseRule rules[] = {
         [TOKEN_RIGHT_PAREN]    = {NULL,     NULL,   PREC_NONE},
         [TOKEN_LEFT_BRACE]     = {NULL,     NULL,   PREC_NONE},
         [TOKEN_RIGHT_BRACE]    = {NULL,     NULL,   PREC_NONE},
+        [TOKEN_LEFT_BRACKET]   = {list,     subscript, PREC_CALL},
+        [TOKEN_RIGHT_BRACKET]  = {NULL,     NULL,   PREC_NONE},
         [TOKEN_COMMA]          = {NULL,     NULL,   PREC_NONE},
         [TOKEN_DOT]            = {NULL,     dot,    PREC_CALL},
         [TOKEN_MINUS]          = {unary,    binary, PREC_TERM},
@@ -1137,7 +1730,7 @@ ParseRule rules[] = {
         [TOKEN_BANG]           = {unary,    NULL,   PREC_NONE},
         [TOKEN_BANG_EQUAL]     = {NULL,     binary, PREC_EQUALITY},
         [TOKEN_EQUAL]          = {NULL,     NULL,   PREC_NONE},
-        [TOKEN_EQUAL_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
+        [TOKEN_EQUAL_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
         [TOKEN_GREATER]        = {NULL,     binary, PREC_COMPARISON},
         [TOKEN_GREATER_EQUAL]  = {NULL,     binary, PREC_COMPARISON},
         [TOKEN_LESS]           = {NULL,     binary, PREC_COMPARISON},
@@ -1166,25 +1759,25 @@ ParseRule rules[] = {
 };
 
 /* Forward declared. */
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser *parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
@@ -1196,29 +1789,79 @@ static ParseRule *getRule(TokenType type) {
 
 /* ===== End static functions ===== */
 
-ObjFunction *compile(const char *source) {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-
+ObjFunction *compile(VM *vm, const char *source) {
+    Parser parser;
+    parser.vm = vm;
+    initScanner(&parser.scanner, source);
     parser.hadError = false;
     parser.panicMode = false;
+    parser.borrowSource = holdsSource(vm, source);
+    // A deferred body is compiled from the source later, so the VM must be holding it.
+    parser.lazyFunctions = vm->lazyFunctions && parser.borrowSource;
+    parser.compiler = NULL;
+    parser.currentClass = NULL;
+    vm->parser = &parser;
+
+    Compiler compiler;
+    initCompiler(&parser, &compiler, TYPE_SCRIPT, NULL);
 
-    advance();
+    advance(&parser);
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    ObjFunction *function = endCompiler();
+    ObjFunction *function = endCompiler(&parser);
+    vm->parser = NULL;
 
     return parser.hadError ? NULL : function;
 }
 
-void markCompilerRoots() {
-    Compiler *compiler = current;
+bool compileFunction(VM *vm, ObjFunction *function) {
+    LazyBody *lazy = function->lazy;
+
+    Parser parser;
+    parser.vm = vm;
+    initScannerAt(&parser.scanner, lazy->start, lazy->end, lazy->line);
+    parser.hadError = false;
+    parser.panicMode = false;
+    parser.borrowSource = true;
+    parser.lazyFunctions = true;
+    parser.compiler = NULL;
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperClass = lazy->hasSuperClass;
+    parser.currentClass = lazy->inClass ? &classCompiler : NULL;
+
+    struct Parser *enclosingParser = vm->parser;
+    vm->parser = &parser;
+
+    // The parameters are counted again as they are compiled.
+    Compiler compiler;
+    initCompiler(&parser, &compiler, (FunctionType)lazy->type, function);
+    function->arity = 0;
+
+    advance(&parser);
+    functionBody(&parser);
+    endCompiler(&parser);
+    vm->parser = enclosingParser;
+
+    if (parser.hadError) {
+        freeChunk(vm, &function->chunk);
+        return false;
+    }
+
+    freeLazyBody(vm, function);
+    return true;
+}
+
+void markCompilerRoots(VM *vm) {
+    if (vm->parser == NULL) return;
+
+    Compiler *compiler = vm->parser->compiler;
     while (compiler != NULL) {
-        markObject((Obj*)compiler->function);
+        markObject(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
 }
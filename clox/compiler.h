@@ -5,13 +5,24 @@
 
 /**
  * Compiles the given source to bytecode and writes it to a chunk.
+ * @param vm the virtual machine.
  * @param source the Lox source code.
  */
-ObjFunction *compile(const char *source);
+ObjFunction *compile(VM *vm, const char *source);
+
+/**
+ * Compiles the body of a function that was deferred to its first call.
+ * Errors are reported as compile errors, and the body stays deferred.
+ * @param vm the virtual machine.
+ * @param function the function, whose lazy body must not be NULL.
+ * @return whether the body was compiled.
+ */
+bool compileFunction(VM *vm, ObjFunction *function);
 
 /**
  * Marks any unreferenced compiler values.
+ * @param vm the virtual machine.
  */
-void markCompilerRoots();
+void markCompilerRoots(VM *vm);
 
 #endif //CLOX_COMPILER_H
@@ -3,33 +3,240 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
+
+/** The name of each opcode. */
+static const char *opcodeNames[OPCODE_COUNT] = {
+    [OP_CONSTANT]             = "OP_CONSTANT",
+    [OP_CONSTANT_LONG]        = "OP_CONSTANT_LONG",
+    [OP_NIL]                  = "OP_NIL",
+    [OP_TRUE]                 = "OP_TRUE",
+    [OP_FALSE]                = "OP_FALSE",
+    [OP_POP]                  = "OP_POP",
+    [OP_GET_LOCAL]            = "OP_GET_LOCAL",
+    [OP_GET_GLOBAL]           = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL]        = "OP_DEFINE_GLOBAL",
+    [OP_SET_LOCAL]            = "OP_SET_LOCAL",
+    [OP_SET_GLOBAL]           = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE]          = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE]          = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY]         = "OP_GET_PROPERTY",
+    [OP_GET_PROPERTY_LONG]    = "OP_GET_PROPERTY_LONG",
+    [OP_SET_PROPERTY]         = "OP_SET_PROPERTY",
+    [OP_SET_PROPERTY_LONG]    = "OP_SET_PROPERTY_LONG",
+    [OP_GET_SUPER]            = "OP_GET_SUPER",
+    [OP_GET_SUPER_LONG]       = "OP_GET_SUPER_LONG",
+    [OP_SUPER_INVOKE]         = "OP_SUPER_INVOKE",
+    [OP_SUPER_INVOKE_LONG]    = "OP_SUPER_INVOKE_LONG",
+    [OP_EQUAL]                = "OP_EQUAL",
+    [OP_GREATER]              = "OP_GREATER",
+    [OP_LESS]                 = "OP_LESS",
+    [OP_ADD]                  = "OP_ADD",
+    [OP_SUBTRACT]             = "OP_SUBTRACT",
+    [OP_MULTIPLY]             = "OP_MULTIPLY",
+    [OP_DIVIDE]               = "OP_DIVIDE",
+    [OP_NOT]                  = "OP_NOT",
+    [OP_NEGATE]               = "OP_NEGATE",
+    [OP_PRINT]                = "OP_PRINT",
+    [OP_JUMP]                 = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]        = "OP_JUMP_IF_FALSE",
+    [OP_LOOP]                 = "OP_LOOP",
+    [OP_CALL]                 = "OP_CALL",
+    [OP_TAIL_CALL]            = "OP_TAIL_CALL",
+    [OP_INVOKE]               = "OP_INVOKE",
+    [OP_INVOKE_LONG]          = "OP_INVOKE_LONG",
+    [OP_CLOSURE]              = "OP_CLOSURE",
+    [OP_CLOSURE_LONG]         = "OP_CLOSURE_LONG",
+    [OP_CLOSE_UPVALUE]        = "OP_CLOSE_UPVALUE",
+    [OP_RETURN]               = "OP_RETURN",
+    [OP_CLASS]                = "OP_CLASS",
+    [OP_CLASS_LONG]           = "OP_CLASS_LONG",
+    [OP_INHERIT]              = "OP_INHERIT",
+    [OP_METHOD]               = "OP_METHOD",
+    [OP_METHOD_LONG]          = "OP_METHOD_LONG",
+    [OP_BUILD_LIST]           = "OP_BUILD_LIST",
+    [OP_GET_INDEX]            = "OP_GET_INDEX",
+    [OP_SET_INDEX]            = "OP_SET_INDEX",
+    [OP_ADD_LOCAL_CONSTANT]   = "OP_ADD_LOCAL_CONSTANT",
+    [OP_JUMP_IF_NOT_LESS]     = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_GREATER]  = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_NOT_EQUAL]    = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_GET_LOCAL_PROPERTY]   = "OP_GET_LOCAL_PROPERTY",
+    [OP_ADD_REGISTERS]        = "OP_ADD_REGISTERS",
+    [OP_SUBTRACT_REGISTERS]   = "OP_SUBTRACT_REGISTERS",
+    [OP_MULTIPLY_REGISTERS]   = "OP_MULTIPLY_REGISTERS",
+    [OP_DIVIDE_REGISTERS]     = "OP_DIVIDE_REGISTERS",
+    [OP_ADD_LOCALS]           = "OP_ADD_LOCALS",
+    [OP_SUBTRACT_LOCALS]      = "OP_SUBTRACT_LOCALS",
+    [OP_MULTIPLY_LOCALS]      = "OP_MULTIPLY_LOCALS",
+    [OP_DIVIDE_LOCALS]        = "OP_DIVIDE_LOCALS"
+};
 
 /* ===== Static functions ===== */
 
+/**
+ * Reads the constant index operand of an instruction.
+ * @param chunk the chunk that contains the instruction.
+ * @param offset the offset of the operand within the chunk.
+ * @param isLong whether the operand is the 24-bit form used by long instructions.
+ * @return the constant index.
+ */
+static int readConstant(Chunk *chunk, int offset, bool isLong) {
+    if (!isLong) return chunk->code[offset];
+
+    return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
 /**
  * Prints information about a constant.
  * @param name the name of the instruction.
  * @param chunk the chunk that contains this instruction.
  * @param offset the offset of the instruction within the chunk.
+ * @param isLong whether the instruction has a long constant operand.
  * @return the offset of the next instruction.
  */
-static int constantInstruction(const char *name, Chunk *chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+static int constantInstruction(const char *name, Chunk *chunk, int offset, bool isLong) {
+    int constant = readConstant(chunk, offset + 1, isLong);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
+    return offset + (isLong ? 4 : 2);
+}
+
+/**
+ * Prints information about an instruction that operates on a global variable slot.
+ * @param vm the virtual machine.
+ * @param name the name of the instruction.
+ * @param chunk the chunk that contains this instruction.
+ * @param offset the offset of the instruction within the chunk.
+ * @return the offset of the next instruction.
+ */
+static int globalInstruction(VM *vm, const char *name, Chunk *chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+/**
+ * Prints information about a property instruction that has an inline cache.
+ * @param name the name of the instruction.
+ * @param chunk the chunk that contains this instruction.
+ * @param offset the offset of the instruction within the chunk.
+ * @param isLong whether the instruction has a long constant operand.
+ * @return the offset of the next instruction.
+ */
+static int propertyInstruction(const char *name, Chunk *chunk, int offset, bool isLong) {
+    int constant = readConstant(chunk, offset + 1, isLong);
+    offset += isLong ? 4 : 2;
+    int cache = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
     return offset + 2;
 }
 
-static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
-    printf("%-16d (%d args) %4d '", name, argCount, constant);
+/**
+ * Prints information about an instruction that takes a local slot and a constant.
+ * @param name the name of the instruction.
+ * @param chunk the chunk that contains this instruction.
+ * @param offset the offset of the instruction within the chunk.
+ * @return the offset of the next instruction.
+ */
+static int localConstantInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
 }
 
+/**
+ * Prints information about a property instruction on a local slot that has an inline cache.
+ * @param name the name of the instruction.
+ * @param chunk the chunk that contains this instruction.
+ * @param offset the offset of the instruction within the chunk.
+ * @return the offset of the next instruction.
+ */
+static int localPropertyInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    int cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 5;
+}
+
+/**
+ * Prints information about a register instruction, whose operands are local slots.
+ * @param name the name of the instruction.
+ * @param operands the number of operands.
+ * @param chunk the chunk that contains this instruction.
+ * @param offset the offset of the instruction within the chunk.
+ * @return the offset of the next instruction.
+ */
+static int registerInstruction(const char *name, int operands, Chunk *chunk, int offset) {
+    printf("%-16s", name);
+    for (int i = 1; i <= operands; i++) {
+        printf(" %4d", chunk->code[offset + i]);
+    }
+    printf("\n");
+    return offset + 1 + operands;
+}
+
+/**
+ * Prints information about an invoke instruction.
+ * @param name the name of the instruction.
+ * @param chunk the chunk that contains this instruction.
+ * @param offset the offset of the instruction within the chunk.
+ * @param isLong whether the instruction has a long constant operand.
+ * @param hasCache whether the instruction is followed by an inline cache operand.
+ * @return the offset of the next instruction.
+ */
+static int invokeInstruction(const char *name, Chunk *chunk, int offset, bool isLong, bool hasCache) {
+    int constant = readConstant(chunk, offset + 1, isLong);
+    offset += isLong ? 4 : 2;
+    uint8_t argCount = chunk->code[offset++];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    if (!hasCache) {
+        printf("'\n");
+        return offset;
+    }
+
+    printf("' (cache %d)\n", (chunk->code[offset] << 8) | chunk->code[offset + 1]);
+    return offset + 2;
+}
+
+/**
+ * Prints information about a closure instruction and its upvalue operands.
+ * @param name the name of the instruction.
+ * @param chunk the chunk that contains this instruction.
+ * @param offset the offset of the instruction within the chunk.
+ * @param isLong whether the instruction has a long constant operand.
+ * @return the offset of the next instruction.
+ */
+static int closureInstruction(const char *name, Chunk *chunk, int offset, bool isLong) {
+    int constant = readConstant(chunk, offset + 1, isLong);
+    offset += isLong ? 4 : 2;
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = chunk->code[offset++];
+        int index = chunk->code[offset++];
+        printf("%04d      |              %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+    }
+
+    return offset;
+}
+
 /**
  * Prints information about a simple instruction with no operands.
  * @param name the name of the instruction.
@@ -73,25 +280,32 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
 /* ===== End static functions ===== */
 
 
-void disassembleChunk(Chunk *chunk, const char *name) {
-    printf("== %s ==\n", name);
+void disassembleChunk(VM *vm, Chunk *chunk, ObjString *name) {
+    if (name == NULL) {
+        printf("== <script> ==\n");
+    } else {
+        printf("== %.*s ==\n", name->length, name->chars);
+    }
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 }
 
-int disassembleInstruction(Chunk *chunk, int offset) {
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction("OP_CONSTANT", chunk, offset, false);
+        case OP_CONSTANT_LONG:
+            return constantInstruction("OP_CONSTANT_LONG", chunk, offset, true);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -101,29 +315,37 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL:
-            return constantInstruction("OP_GET_LOCAL", chunk, offset);
+            return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return byteInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset, false);
+        case OP_GET_PROPERTY_LONG:
+            return propertyInstruction("OP_GET_PROPERTY_LONG", chunk, offset, true);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset, false);
+        case OP_SET_PROPERTY_LONG:
+            return propertyInstruction("OP_SET_PROPERTY_LONG", chunk, offset, true);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return constantInstruction("OP_GET_SUPER", chunk, offset, false);
+        case OP_GET_SUPER_LONG:
+            return constantInstruction("OP_GET_SUPER_LONG", chunk, offset, true);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, false, false);
+        case OP_SUPER_INVOKE_LONG:
+            return invokeInstruction("OP_SUPER_INVOKE_LONG", chunk, offset, true, false);
         case OP_EQUAL:
-            simpleInstruction("OP_EQUAL", offset);
+            return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:
@@ -150,38 +372,69 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |              %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-
-            return offset;
-        }
+            return invokeInstruction("OP_INVOKE", chunk, offset, false, true);
+        case OP_INVOKE_LONG:
+            return invokeInstruction("OP_INVOKE_LONG", chunk, offset, true, true);
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, offset, false);
+        case OP_CLOSURE_LONG:
+            return closureInstruction("OP_CLOSURE_LONG", chunk, offset, true);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
         case OP_CLASS:
-            return constantInstruction("OP_CLASS", chunk, offset);
+            return constantInstruction("OP_CLASS", chunk, offset, false);
+        case OP_CLASS_LONG:
+            return constantInstruction("OP_CLASS_LONG", chunk, offset, true);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return constantInstruction("OP_METHOD", chunk, offset, false);
+        case OP_METHOD_LONG:
+            return constantInstruction("OP_METHOD_LONG", chunk, offset, true);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_ADD_REGISTERS:
+            return registerInstruction("OP_ADD_REGISTERS", 3, chunk, offset);
+        case OP_SUBTRACT_REGISTERS:
+            return registerInstruction("OP_SUBTRACT_REGISTERS", 3, chunk, offset);
+        case OP_MULTIPLY_REGISTERS:
+            return registerInstruction("OP_MULTIPLY_REGISTERS", 3, chunk, offset);
+        case OP_DIVIDE_REGISTERS:
+            return registerInstruction("OP_DIVIDE_REGISTERS", 3, chunk, offset);
+        case OP_ADD_LOCALS:
+            return registerInstruction("OP_ADD_LOCALS", 2, chunk, offset);
+        case OP_SUBTRACT_LOCALS:
+            return registerInstruction("OP_SUBTRACT_LOCALS", 2, chunk, offset);
+        case OP_MULTIPLY_LOCALS:
+            return registerInstruction("OP_MULTIPLY_LOCALS", 2, chunk, offset);
+        case OP_DIVIDE_LOCALS:
+            return registerInstruction("OP_DIVIDE_LOCALS", 2, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
 
-
+const char *opcodeName(uint8_t instruction) {
+    if (instruction >= OPCODE_COUNT) return "OP_UNKNOWN";
+    return opcodeNames[instruction];
+}
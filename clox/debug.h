@@ -5,10 +5,11 @@
 
 /**
  * Disassembles a chunk and writes the result to stdout.
+ * @param vm the virtual machine.
  * @param chunk the chunk to disassemble.
- * @param name the name of the chunk.
+ * @param name the name of the function the chunk belongs to, or NULL for the script.
  */
-void disassembleChunk(Chunk *chunk, const char *name);
+void disassembleChunk(VM *vm, Chunk *chunk, ObjString *name);
 
 /**
  * Displays information about a simple instruction, and returns the new offset.
@@ -20,10 +21,18 @@ static int simpleInstruction(const char *name, int offset);
 
 /**
  * Disassembles an instruction and writes the result to stdout.
+ * @param vm the virtual machine.
  * @param chunk the chunk containing the instruction.
  * @param offset the instruction offset within the chunk.
  * @return the offset of the next instruction.
  */
-int disassembleInstruction(Chunk *chunk, int offset);
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset);
+
+/**
+ * Gets the name of an opcode, as printed by the disassembler.
+ * @param instruction the opcode.
+ * @return the name.
+ */
+const char *opcodeName(uint8_t instruction);
 
 #endif //CLOX_DEBUG_H
@@ -0,0 +1,732 @@
+// MAP_ANONYMOUS is not part of POSIX.1-2008, so it is hidden by a strict -std=c99.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+#include <stddef.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * The native code keeps the interpreter's state in callee-saved registers:
+ *   rbx  the slots of the frame
+ *   r12  the top of the value stack
+ *   r13  the constants of the function
+ *   r14  the VM
+ *   r15  QNAN, used by the type guards and to build nil and booleans
+ * Values are moved through rax and rcx, numbers through xmm0 and xmm1, and rdx
+ * and rsi are scratch. The value stack stays in memory, exactly as the
+ * interpreter would leave it, so any instruction can hand back to the interpreter.
+ */
+
+/** The register numbers used in the encodings below. */
+#define RAX 0
+#define RCX 1
+
+/** x86-64 condition codes. */
+#define CC_P  0x0a
+#define CC_NP 0x0b
+#define CC_E  0x04
+#define CC_NE 0x05
+#define CC_BE 0x06
+#define CC_A  0x07
+
+/**
+ * A rel32 operand of a jump, filled in once the code of the loop is complete.
+ */
+typedef struct {
+    /** The offset of the operand in the native code. */
+    int position;
+
+    /** The offset of the bytecode instruction the jump lands on. */
+    int target;
+
+    /** Whether the jump leaves the native code even if the target is inside the loop. */
+    bool exits;
+} Fixup;
+
+/**
+ * The state of the native code being written for the loops of a function.
+ */
+typedef struct {
+    Chunk *chunk;
+
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    /** The native offset of each bytecode offset in the span being compiled, or -1. */
+    int *labels;
+    /** The bytecode offset of the first instruction of the span being compiled. */
+    int start;
+    /** The native offset of the epilogue of the span being compiled. */
+    int epilogue;
+
+    Fixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+} Assembler;
+
+/* ===== Static functions ===== */
+
+/**
+ * Appends bytes to the native code.
+ * @param as the assembler.
+ * @param bytes the bytes.
+ * @param length the number of bytes.
+ */
+static void emit(Assembler *as, const uint8_t *bytes, int length) {
+    if (as->count + length > as->capacity) {
+        while (as->count + length > as->capacity) {
+            as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        }
+        as->code = (uint8_t*)realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+    memcpy(as->code + as->count, bytes, length);
+    as->count += length;
+}
+
+#define EMIT(as, ...)                                      \
+    do {                                                   \
+        const uint8_t bytes[] = {__VA_ARGS__};             \
+        emit(as, bytes, sizeof(bytes));                    \
+    } while (false)
+
+/**
+ * Appends a 32-bit little-endian immediate.
+ * @param as the assembler.
+ * @param value the immediate.
+ */
+static void emit32(Assembler *as, int32_t value) {
+    uint32_t bits = (uint32_t)value;
+    EMIT(as, bits & 0xff, (bits >> 8) & 0xff, (bits >> 16) & 0xff, (bits >> 24) & 0xff);
+}
+
+/**
+ * Appends a 64-bit little-endian immediate.
+ * @param as the assembler.
+ * @param value the immediate.
+ */
+static void emit64(Assembler *as, uint64_t value) {
+    emit32(as, (int32_t)(uint32_t)value);
+    emit32(as, (int32_t)(uint32_t)(value >> 32));
+}
+
+/**
+ * Appends a jump whose rel32 operand is filled in later.
+ * @param as the assembler.
+ * @param cc the condition code, or -1 for an unconditional jump.
+ * @param target the offset of the bytecode instruction the jump lands on.
+ * @param exits whether the jump always leaves the native code.
+ */
+static void emitJump(Assembler *as, int cc, int target, bool exits) {
+    if (cc < 0) {
+        EMIT(as, 0xe9);
+    } else {
+        EMIT(as, 0x0f, 0x80 | cc);
+    }
+
+    if (as->fixupCount == as->fixupCapacity) {
+        as->fixupCapacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+        as->fixups = (Fixup*)realloc(as->fixups, sizeof(Fixup) * as->fixupCapacity);
+        if (as->fixups == NULL) exit(1);
+    }
+    Fixup *fixup = &as->fixups[as->fixupCount++];
+    fixup->position = as->count;
+    fixup->target = target;
+    fixup->exits = exits;
+    emit32(as, 0);
+}
+
+/**
+ * Loads a local slot: mov reg, [rbx + slot * 8].
+ * @param as the assembler.
+ * @param reg RAX or RCX.
+ * @param slot the slot.
+ */
+static void loadSlot(Assembler *as, int reg, int slot) {
+    EMIT(as, 0x48, 0x8b, 0x83 | (reg << 3));
+    emit32(as, slot * (int)sizeof(Value));
+}
+
+/**
+ * Stores a local slot: mov [rbx + slot * 8], reg.
+ * @param as the assembler.
+ * @param reg RAX or RCX.
+ * @param slot the slot.
+ */
+static void storeSlot(Assembler *as, int reg, int slot) {
+    EMIT(as, 0x48, 0x89, 0x83 | (reg << 3));
+    emit32(as, slot * (int)sizeof(Value));
+}
+
+/**
+ * Loads a value relative to the top of the stack: mov reg, [r12 + index * 8].
+ * @param as the assembler.
+ * @param reg RAX or RCX.
+ * @param index the index of the value, -1 being the top.
+ */
+static void loadStack(Assembler *as, int reg, int index) {
+    EMIT(as, 0x49, 0x8b, 0x44 | (reg << 3), 0x24, (uint8_t)(index * (int)sizeof(Value)));
+}
+
+/**
+ * Stores a value relative to the top of the stack: mov [r12 + index * 8], reg.
+ * @param as the assembler.
+ * @param reg RAX or RCX.
+ * @param index the index of the value, -1 being the top.
+ */
+static void storeStack(Assembler *as, int reg, int index) {
+    EMIT(as, 0x49, 0x89, 0x44 | (reg << 3), 0x24, (uint8_t)(index * (int)sizeof(Value)));
+}
+
+/**
+ * Moves the top of the stack: add r12, count * 8.
+ * @param as the assembler.
+ * @param count the number of values pushed, or popped if negative.
+ */
+static void moveStackTop(Assembler *as, int count) {
+    EMIT(as, 0x49, 0x83, 0xc4, (uint8_t)(count * (int)sizeof(Value)));
+}
+
+/**
+ * Pushes rax onto the stack.
+ * @param as the assembler.
+ */
+static void pushValue(Assembler *as) {
+    storeStack(as, RAX, 0);
+    moveStackTop(as, 1);
+}
+
+/**
+ * Loads a constant: mov reg, [r13 + index * 8].
+ * @param as the assembler.
+ * @param reg RAX or RCX.
+ * @param index the index of the constant.
+ */
+static void loadConstant(Assembler *as, int reg, int index) {
+    EMIT(as, 0x49, 0x8b, 0x85 | (reg << 3));
+    emit32(as, index * (int)sizeof(Value));
+}
+
+/**
+ * Loads QNAN with a singleton tag into rax: lea rax, [r15 + tag].
+ * @param as the assembler.
+ * @param tag TAG_NIL, TAG_FALSE or TAG_TRUE.
+ */
+static void loadTagged(Assembler *as, int tag) {
+    EMIT(as, 0x49, 0x8d, 0x47, (uint8_t)tag);
+}
+
+/**
+ * Leaves the native code at the current instruction unless a register holds a number.
+ * @param as the assembler.
+ * @param reg RAX or RCX.
+ * @param offset the offset of the current instruction.
+ */
+static void guardNumber(Assembler *as, int reg, int offset) {
+    EMIT(as, 0x48, 0x89, 0xc2 | (reg << 3));    // mov rdx, reg
+    EMIT(as, 0x4c, 0x21, 0xfa);                 // and rdx, r15
+    EMIT(as, 0x4c, 0x39, 0xfa);                 // cmp rdx, r15
+    emitJump(as, CC_E, offset, true);
+}
+
+/**
+ * Unboxes rax and rcx into xmm0 and xmm1 once both are known to be numbers.
+ * @param as the assembler.
+ * @param offset the offset of the current instruction.
+ */
+static void unboxNumbers(Assembler *as, int offset) {
+    guardNumber(as, RAX, offset);
+    guardNumber(as, RCX, offset);
+    EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0);     // movq xmm0, rax
+    EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc9);     // movq xmm1, rcx
+}
+
+/**
+ * Applies an arithmetic instruction to xmm0 and xmm1, boxing the result in rax.
+ * @param as the assembler.
+ * @param instruction OP_ADD, OP_SUBTRACT, OP_MULTIPLY or OP_DIVIDE.
+ */
+static void arithmetic(Assembler *as, uint8_t instruction) {
+    uint8_t opcode;
+    switch (instruction) {
+        case OP_ADD: opcode = 0x58; break;
+        case OP_SUBTRACT: opcode = 0x5c; break;
+        case OP_MULTIPLY: opcode = 0x59; break;
+        default: opcode = 0x5e; break;
+    }
+    EMIT(as, 0xf2, 0x0f, opcode, 0xc1);         // addsd/subsd/mulsd/divsd xmm0, xmm1
+    EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);     // movq rax, xmm0
+}
+
+/**
+ * Compares xmm0 and xmm1 so that the given condition holds when the comparison is true.
+ * @param as the assembler.
+ * @param instruction OP_LESS, OP_GREATER or OP_EQUAL.
+ * @return CC_A for the ordered comparisons, CC_E for equality, which also needs CC_NP.
+ */
+static int compare(Assembler *as, uint8_t instruction) {
+    if (instruction == OP_LESS) {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);       // ucomisd xmm1, xmm0
+        return CC_A;
+    }
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);           // ucomisd xmm0, xmm1
+    return instruction == OP_GREATER ? CC_A : CC_E;
+}
+
+/**
+ * Boxes the condition code of the last comparison as a Lox boolean in rax.
+ * @param as the assembler.
+ * @param cc the condition code.
+ * @param ordered whether the result must also be false for NaN operands.
+ */
+static void boxCondition(Assembler *as, int cc, bool ordered) {
+    EMIT(as, 0x0f, 0x90 | cc, 0xc0);            // setcc al
+    if (ordered) {
+        EMIT(as, 0x0f, 0x9b, 0xc1);             // setnp cl
+        EMIT(as, 0x20, 0xc8);                   // and al, cl
+    }
+    EMIT(as, 0x0f, 0xb6, 0xc0);                 // movzx eax, al
+    EMIT(as, 0x49, 0x8d, 0x44, 0x07, TAG_FALSE); // lea rax, [r15 + rax + TAG_FALSE]
+}
+
+/**
+ * Sets the flags so that CC_BE holds when rax is nil or false.
+ * @param as the assembler.
+ */
+static void testFalsey(Assembler *as) {
+    EMIT(as, 0x4c, 0x29, 0xf8);                 // sub rax, r15
+    EMIT(as, 0x48, 0x83, 0xe8, TAG_NIL);        // sub rax, TAG_NIL
+    EMIT(as, 0x48, 0x83, 0xf8, TAG_FALSE - TAG_NIL); // cmp rax, TAG_FALSE - TAG_NIL
+}
+
+/**
+ * Loads the array of global variable values into rcx.
+ * @param as the assembler.
+ */
+static void loadGlobals(Assembler *as) {
+    EMIT(as, 0x49, 0x8b, 0x8e);                 // mov rcx, [r14 + offset]
+    emit32(as, (int32_t)(offsetof(VM, globalValues) + offsetof(ValueArray, values)));
+}
+
+/**
+ * Leaves the native code at the current instruction if a register holds UNDEFINED_VAL.
+ * @param as the assembler.
+ * @param modRm the ModRM byte comparing rsi with the register.
+ * @param offset the offset of the current instruction.
+ */
+static void guardDefined(Assembler *as, uint8_t modRm, int offset) {
+    EMIT(as, 0x49, 0x8d, 0x77, TAG_UNDEFINED);  // lea rsi, [r15 + TAG_UNDEFINED]
+    EMIT(as, 0x48, 0x39, modRm);                // cmp reg, rsi
+    emitJump(as, CC_E, offset, true);
+}
+
+/**
+ * Reads the 16-bit operand of an instruction.
+ * @param chunk the chunk.
+ * @param offset the offset of the operand.
+ * @return the operand.
+ */
+static int readShort(Chunk *chunk, int offset) {
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+/**
+ * Compiles one instruction of a loop.
+ * @param as the assembler.
+ * @param offset the offset of the instruction.
+ */
+static void compileInstruction(Assembler *as, int offset) {
+    uint8_t *code = as->chunk->code;
+    uint8_t instruction = code[offset];
+    int next = offset + instructionLength(as->chunk, offset);
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            loadConstant(as, RAX, code[offset + 1]);
+            pushValue(as);
+            break;
+        case OP_CONSTANT_LONG:
+            loadConstant(as, RAX, (code[offset + 1] << 16) | readShort(as->chunk, offset + 2));
+            pushValue(as);
+            break;
+        case OP_NIL:
+            loadTagged(as, TAG_NIL);
+            pushValue(as);
+            break;
+        case OP_TRUE:
+            loadTagged(as, TAG_TRUE);
+            pushValue(as);
+            break;
+        case OP_FALSE:
+            loadTagged(as, TAG_FALSE);
+            pushValue(as);
+            break;
+        case OP_POP:
+            moveStackTop(as, -1);
+            break;
+        case OP_GET_LOCAL:
+            loadSlot(as, RAX, code[offset + 1]);
+            pushValue(as);
+            break;
+        case OP_SET_LOCAL:
+            loadStack(as, RAX, -1);
+            storeSlot(as, RAX, code[offset + 1]);
+            break;
+        case OP_GET_GLOBAL: {
+            int slot = readShort(as->chunk, offset + 1);
+            loadGlobals(as);
+            EMIT(as, 0x48, 0x8b, 0x81);         // mov rax, [rcx + slot * 8]
+            emit32(as, slot * (int)sizeof(Value));
+            guardDefined(as, 0xf0, offset);
+            pushValue(as);
+            break;
+        }
+        case OP_SET_GLOBAL: {
+            int slot = readShort(as->chunk, offset + 1);
+            loadGlobals(as);
+            EMIT(as, 0x48, 0x8b, 0x91);         // mov rdx, [rcx + slot * 8]
+            emit32(as, slot * (int)sizeof(Value));
+            guardDefined(as, 0xf2, offset);
+            loadStack(as, RAX, -1);
+            // Storing an object while marking needs GLOBAL_WRITE_BARRIER, which the interpreter applies.
+            EMIT(as, 0x48, 0x89, 0xc2);         // mov rdx, rax
+            EMIT(as, 0x4c, 0x21, 0xfa);         // and rdx, r15
+            EMIT(as, 0x4c, 0x39, 0xfa);         // cmp rdx, r15
+            EMIT(as, 0x75, 19);                 // jne store (a number)
+            EMIT(as, 0x48, 0x85, 0xc0);         // test rax, rax
+            EMIT(as, 0x79, 14);                 // jns store (nil, a boolean)
+            EMIT(as, 0x41, 0x83, 0xbe);         // cmp dword [r14 + offset], GC_MARKING
+            emit32(as, (int32_t)offsetof(VM, gcPhase));
+            EMIT(as, GC_MARKING);
+            emitJump(as, CC_E, offset, true);
+            // store:
+            EMIT(as, 0x48, 0x89, 0x81);         // mov [rcx + slot * 8], rax
+            emit32(as, slot * (int)sizeof(Value));
+            break;
+        }
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS: {
+            loadStack(as, RAX, -2);
+            loadStack(as, RCX, -1);
+            unboxNumbers(as, offset);
+            int cc = compare(as, instruction);
+            boxCondition(as, cc, instruction == OP_EQUAL);
+            storeStack(as, RAX, -2);
+            moveStackTop(as, -1);
+            break;
+        }
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            loadStack(as, RAX, -2);
+            loadStack(as, RCX, -1);
+            unboxNumbers(as, offset);
+            arithmetic(as, instruction);
+            storeStack(as, RAX, -2);
+            moveStackTop(as, -1);
+            break;
+        case OP_NOT:
+            loadStack(as, RAX, -1);
+            testFalsey(as);
+            boxCondition(as, CC_BE, false);
+            storeStack(as, RAX, -1);
+            break;
+        case OP_NEGATE:
+            loadStack(as, RAX, -1);
+            guardNumber(as, RAX, offset);
+            EMIT(as, 0x48, 0xba);               // mov rdx, SIGN_BIT
+            emit64(as, SIGN_BIT);
+            EMIT(as, 0x48, 0x31, 0xd0);         // xor rax, rdx
+            storeStack(as, RAX, -1);
+            break;
+        case OP_JUMP:
+            emitJump(as, -1, next + readShort(as->chunk, offset + 1), false);
+            break;
+        case OP_JUMP_IF_FALSE:
+            loadStack(as, RAX, -1);
+            testFalsey(as);
+            emitJump(as, CC_BE, next + readShort(as->chunk, offset + 1), false);
+            break;
+        case OP_LOOP:
+            emitJump(as, -1, next - readShort(as->chunk, offset + 1), false);
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+            loadSlot(as, RAX, code[offset + 1]);
+            loadConstant(as, RCX, code[offset + 2]);
+            unboxNumbers(as, offset);
+            arithmetic(as, OP_ADD);
+            storeSlot(as, RAX, code[offset + 1]);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL: {
+            int target = next + readShort(as->chunk, offset + 1);
+            loadStack(as, RAX, -2);
+            loadStack(as, RCX, -1);
+            unboxNumbers(as, offset);
+            moveStackTop(as, -2);
+            if (instruction == OP_JUMP_IF_NOT_EQUAL) {
+                compare(as, OP_EQUAL);
+                emitJump(as, CC_P, target, false);
+                emitJump(as, CC_NE, target, false);
+            } else {
+                compare(as, instruction == OP_JUMP_IF_NOT_LESS ? OP_LESS : OP_GREATER);
+                emitJump(as, CC_BE, target, false);
+            }
+            break;
+        }
+        case OP_ADD_REGISTERS:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY_REGISTERS:
+        case OP_DIVIDE_REGISTERS:
+            loadSlot(as, RAX, code[offset + 2]);
+            loadSlot(as, RCX, code[offset + 3]);
+            unboxNumbers(as, offset);
+            arithmetic(as, OP_ADD + (instruction - OP_ADD_REGISTERS));
+            storeSlot(as, RAX, code[offset + 1]);
+            break;
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT_LOCALS:
+        case OP_MULTIPLY_LOCALS:
+        case OP_DIVIDE_LOCALS:
+            loadSlot(as, RAX, code[offset + 1]);
+            loadSlot(as, RCX, code[offset + 2]);
+            unboxNumbers(as, offset);
+            arithmetic(as, OP_ADD + (instruction - OP_ADD_LOCALS));
+            pushValue(as);
+            break;
+        default:
+            // Everything else, including calls and anything that allocates, is left to the interpreter.
+            emitJump(as, -1, offset, true);
+            break;
+    }
+}
+
+/**
+ * Finds the span of bytecode compiled together with a loop: the loop itself, from
+ * the instruction its OP_LOOP jumps back to through the OP_LOOP, joined with every
+ * loop that overlaps it. A for loop has two back edges, from the body to the
+ * increment and from the increment to the condition, and each jumps outside the
+ * other's span; compiled apart, every iteration would leave the native code twice.
+ * @param chunk the chunk.
+ * @param loop the offset of the OP_LOOP instruction.
+ * @param start set to the offset of the first instruction of the span.
+ * @param end set to the offset just past the last OP_LOOP of the span.
+ */
+static void loopSpan(Chunk *chunk, int loop, int *start, int *end) {
+    *end = loop + 3;
+    *start = *end - readShort(chunk, loop + 1);
+
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+            if (chunk->code[offset] != OP_LOOP) continue;
+
+            int loopEnd = offset + 3;
+            int loopStart = loopEnd - readShort(chunk, offset + 1);
+            if (loopStart >= *end || loopEnd <= *start) continue;
+            if (loopStart < *start || loopEnd > *end) {
+                if (loopStart < *start) *start = loopStart;
+                if (loopEnd > *end) *end = loopEnd;
+                grew = true;
+            }
+        }
+    }
+}
+
+/**
+ * Writes the entry of a loop: saves the callee-saved registers, loads the
+ * interpreter's state into them and jumps to the instruction the OP_LOOP jumps back to.
+ * @param as the assembler.
+ * @param loop the loop.
+ * @return the native offset of the entry.
+ */
+static int compileEntry(Assembler *as, JitLoop *loop) {
+    int entry = as->count;
+    EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, r12-r15
+    EMIT(as, 0x49, 0x89, 0xfe);                 // mov r14, rdi
+    EMIT(as, 0x48, 0x89, 0xf3);                 // mov rbx, rsi
+    EMIT(as, 0x49, 0x89, 0xd5);                 // mov r13, rdx
+    EMIT(as, 0x4d, 0x8b, 0xa6);                 // mov r12, [r14 + offset]
+    emit32(as, (int32_t)offsetof(VM, stackTop));
+    EMIT(as, 0x49, 0xbf);                       // mov r15, QNAN
+    emit64(as, QNAN);
+    emitJump(as, -1, loop->loop + 3 - readShort(as->chunk, loop->loop + 1), false);
+    return entry;
+}
+
+/**
+ * Compiles a span of loops found by loopSpan(), with an entry for each of its OP_LOOP instructions.
+ * @param as the assembler.
+ * @param start the offset of the first instruction of the span.
+ * @param end the offset just past the last OP_LOOP of the span.
+ * @param loops the loops of the span, whose loop fields are set.
+ * @param entries set to the native offset of the entry of each loop.
+ * @param count the number of loops.
+ */
+static void compileSpan(Assembler *as, int start, int end, JitLoop *loops, int *entries, int count) {
+    Chunk *chunk = as->chunk;
+    as->start = start;
+    as->fixupCount = 0;
+    for (int i = 0; i < end - as->start; i++) as->labels[i] = -1;
+
+    for (int i = 0; i < count; i++) {
+        entries[i] = compileEntry(as, &loops[i]);
+    }
+
+    // Every instruction pushes at most one value, so the loop can never be deeper than its length.
+    int stackNeeded = 0;
+    for (int offset = as->start; offset < end; offset += instructionLength(chunk, offset)) {
+        as->labels[offset - as->start] = as->count;
+        compileInstruction(as, offset);
+        stackNeeded++;
+    }
+    for (int i = 0; i < count; i++) {
+        loops[i].stackNeeded = stackNeeded;
+    }
+
+    as->epilogue = as->count;
+    EMIT(as, 0x4d, 0x89, 0xa6);                 // mov [r14 + offset], r12
+    emit32(as, (int32_t)offsetof(VM, stackTop));
+    EMIT(as, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b); // pop r15-r12, rbx
+    EMIT(as, 0xc3);                             // ret
+
+    for (int i = 0; i < as->fixupCount; i++) {
+        Fixup *fixup = &as->fixups[i];
+        int target;
+        if (!fixup->exits && fixup->target >= as->start && fixup->target < end &&
+            as->labels[fixup->target - as->start] >= 0) {
+            target = as->labels[fixup->target - as->start];
+        } else {
+            target = as->count;
+            EMIT(as, 0xb8);                     // mov eax, target
+            emit32(as, fixup->target);
+            EMIT(as, 0xe9);                     // jmp epilogue
+            emit32(as, as->epilogue - (as->count + 4));
+        }
+
+        int32_t distance = target - (fixup->position + 4);
+        memcpy(as->code + fixup->position, &distance, sizeof(distance));
+    }
+}
+
+/* ===== End static functions ===== */
+
+JitCode *compileLoops(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    JitCode *jit = (JitCode*)malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->loops = NULL;
+    jit->loopCount = 0;
+    jit->memory = NULL;
+    jit->size = 0;
+
+    Assembler as;
+    as.chunk = chunk;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.labels = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    as.fixups = NULL;
+    as.fixupCount = 0;
+    as.fixupCapacity = 0;
+    if (as.labels == NULL) exit(1);
+
+    int loopCapacity = 0;
+    int *entries = NULL;
+    int spanEnd = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        // The OP_LOOP instructions of a span are compiled with the first of them.
+        if (chunk->code[offset] != OP_LOOP || offset < spanEnd) continue;
+
+        int spanStart;
+        loopSpan(chunk, offset, &spanStart, &spanEnd);
+        int first = jit->loopCount;
+        for (int loop = offset; loop < spanEnd; loop += instructionLength(chunk, loop)) {
+            if (chunk->code[loop] != OP_LOOP) continue;
+
+            if (jit->loopCount == loopCapacity) {
+                loopCapacity = loopCapacity < 4 ? 4 : loopCapacity * 2;
+                jit->loops = (JitLoop*)realloc(jit->loops, sizeof(JitLoop) * loopCapacity);
+                entries = (int*)realloc(entries, sizeof(int) * loopCapacity);
+                if (jit->loops == NULL || entries == NULL) exit(1);
+            }
+            jit->loops[jit->loopCount++].loop = loop;
+        }
+
+        compileSpan(&as, spanStart, spanEnd, &jit->loops[first], &entries[first], jit->loopCount - first);
+    }
+
+    if (as.count > 0) {
+        void *memory = mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            jit->loopCount = 0;
+        } else {
+            memcpy(memory, as.code, as.count);
+            if (mprotect(memory, as.count, PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, as.count);
+                jit->loopCount = 0;
+            } else {
+                jit->memory = memory;
+                jit->size = as.count;
+                for (int i = 0; i < jit->loopCount; i++) {
+                    // Converting an object pointer to a function pointer is the one non-C99 step.
+                    uint8_t *start = (uint8_t*)memory + entries[i];
+                    memcpy(&jit->loops[i].entry, &start, sizeof(start));
+                }
+            }
+        }
+    }
+
+    free(entries);
+    free(as.code);
+    free(as.labels);
+    free(as.fixups);
+    return jit;
+}
+
+JitLoop *findJitLoop(JitCode *code, int loop) {
+    for (int i = 0; i < code->loopCount; i++) {
+        if (code->loops[i].loop == loop) return &code->loops[i];
+    }
+    return NULL;
+}
+
+void freeJitCode(JitCode *code) {
+    if (code == NULL) return;
+    if (code->memory != NULL) munmap(code->memory, code->size);
+    free(code->loops);
+    free(code);
+}
+
+#else
+
+JitCode *compileLoops(ObjFunction *function) {
+    (void)function;
+    return NULL;
+}
+
+JitLoop *findJitLoop(JitCode *code, int loop) {
+    (void)code;
+    (void)loop;
+    return NULL;
+}
+
+void freeJitCode(JitCode *code) {
+    (void)code;
+}
+
+#endif
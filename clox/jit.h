@@ -0,0 +1,73 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "object.h"
+#include "vm.h"
+
+#if defined(CLOX_JIT) && defined(NAN_BOXING) && defined(__x86_64__) && \
+    (defined(__unix__) || defined(__APPLE__))
+#define JIT
+#endif
+
+/** The number of loop back edges a function takes before its loops are compiled. */
+#define JIT_THRESHOLD 1000
+
+/**
+ * Runs a compiled loop from its first instruction until it leaves the loop or
+ * reaches an instruction it cannot run, leaving the stack as the interpreter expects.
+ * @param vm the virtual machine.
+ * @param slots the slots of the current frame.
+ * @param constants the constants of the function.
+ * @return the offset of the instruction the interpreter resumes at.
+ */
+typedef int (*JitEntry)(VM *vm, Value *slots, Value *constants);
+
+/**
+ * A loop compiled to native code.
+ */
+typedef struct {
+    /** The offset of the OP_LOOP instruction that closes the loop. */
+    int loop;
+
+    /** The number of free stack slots the native code may push onto. */
+    int stackNeeded;
+
+    JitEntry entry;
+} JitLoop;
+
+/**
+ * The native code of every loop in a function.
+ */
+typedef struct JitCode {
+    JitLoop *loops;
+    int loopCount;
+
+    /** The executable mapping holding the code of every loop. */
+    void *memory;
+    size_t size;
+} JitCode;
+
+/**
+ * Compiles the loops of a function to native code. Numbers are unboxed behind
+ * type guards; when a guard fails or an instruction is not supported, the native
+ * code hands the frame back to the interpreter at that instruction.
+ * @param function the function.
+ * @return the compiled code, which holds no loops if native code cannot be mapped.
+ */
+JitCode *compileLoops(ObjFunction *function);
+
+/**
+ * Finds the compiled code of a loop.
+ * @param code the compiled code of the function.
+ * @param loop the offset of the OP_LOOP instruction that closes the loop.
+ * @return the loop, or NULL if it was not compiled.
+ */
+JitLoop *findJitLoop(JitCode *code, int loop);
+
+/**
+ * Frees compiled code.
+ * @param code the code, or NULL.
+ */
+void freeJitCode(JitCode *code);
+
+#endif //CLOX_JIT_H
@@ -1,71 +1,148 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "profiler.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM *vm) {
     char line[1024];
     for (;;) {
         printf("> ");
+        fflush(stdout);
 
         if (!fgets(line, sizeof(line), stdin)) {
             printf("\n");
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
-static char *readFile(const char *path) {
-    FILE *file = fopen(path, "rb");
-    if (file == NULL) {
+static const char *readFile(VM *vm, const char *path) {
+    Source *source = openSource(path);
+    if (source == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+    holdSource(vm, source);
+    return source->chars;
+}
+
+static void runFile(VM *vm, const char *path) {
+    const char *source = readFile(vm, path);
+    InterpretResult result = interpret(vm, source);
 
-    char *buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+static void runCachedFile(VM *vm, const char *path) {
+    const char *source = readFile(vm, path);
+
+    char *cachePath = (char*)malloc(strlen(path) + sizeof(BYTECODE_SUFFIX));
+    if (cachePath == NULL) {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
         exit(74);
     }
+    strcpy(cachePath, path);
+    strcat(cachePath, BYTECODE_SUFFIX);
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    buffer[bytesRead] = '\0';
+    ObjFunction *function = loadBytecode(vm, source, cachePath);
+    if (function == NULL) {
+        function = compile(vm, source);
+        if (function == NULL) exit(65);
+        saveBytecode(vm, function, source, cachePath);
+    }
 
-    fclose(file);
-    return buffer;
+    free(cachePath);
+
+    InterpretResult result = interpretFunction(vm, function);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
-static void runFile(const char *path) {
-    char *source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+/**
+ * Compiles a script without running it and reports the source-to-bytecode throughput.
+ * @param vm the virtual machine.
+ * @param path the path of the script.
+ */
+static void compileFile(VM *vm, const char *path) {
+    const char *source = readFile(vm, path);
+    clock_t start = clock();
+    ObjFunction *function = compile(vm, source);
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (function == NULL) exit(65);
+
+    double megabytes = (double)strlen(source) / 1e6;
+    printf("Compiled %.2f MB in %.3f s (%.1f MB/s).\n", megabytes, seconds,
+           seconds > 0 ? megabytes / seconds : 0.0);
+}
+
+/**
+ * Writes a profile file named after the script.
+ * @param vm the virtual machine.
+ * @param path the path of the script.
+ * @param suffix the suffix of the profile file.
+ * @param write writes the profile.
+ */
+static void writeProfile(VM *vm, const char *path, const char *suffix, void (*write)(VM*, FILE*)) {
+    char *profilePath = (char*)malloc(strlen(path) + strlen(suffix) + 1);
+    if (profilePath == NULL) return;
+    strcpy(profilePath, path);
+    strcat(profilePath, suffix);
+
+    FILE *file = fopen(profilePath, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write \"%s\".\n", profilePath);
+    } else {
+        write(vm, file);
+        fclose(file);
+    }
+    free(profilePath);
+}
+
+static void runProfiledFile(VM *vm, const char *path) {
+    const char *source = readFile(vm, path);
+    startProfiler(vm);
+    InterpretResult result = interpret(vm, source);
+
+    writeProfile(vm, path, PROFILE_OPCODES_SUFFIX, writeOpcodeProfile);
+    writeProfile(vm, path, PROFILE_STACKS_SUFFIX, writeFoldedStacks);
+    stopProfiler(vm);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
 int main(int argc, const char *argv[]) {
-    initVM();
+    VM *vm = newVM();
 
     if (argc == 1) {
-        repl();
-    }     else if (argc == 2) {
-        runFile(argv[1]);
+        repl(vm);
+    } else if (argc == 2) {
+        runFile(vm, argv[1]);
+    } else if (argc == 3 && strcmp(argv[1], "--cache") == 0) {
+        runCachedFile(vm, argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "--profile") == 0) {
+        runProfiledFile(vm, argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "--compile") == 0) {
+        compileFile(vm, argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "--lazy") == 0) {
+        vm->lazyFunctions = true;
+        runFile(vm, argv[2]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--cache | --profile | --compile | --lazy] [path]\n");
         exit(64);
     }
 
-    freeVM();
+    freeVM(vm);
 
     return 0;
 }
@@ -1,6 +1,10 @@
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 #include "object.h"
@@ -12,34 +16,69 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+static void collectIfNeeded(VM *vm);
+
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
-#endif
+        vm->nurseryBytes += newSize - oldSize;
+        vm->gcStats.bytesAllocated += newSize - oldSize;
+        collectIfNeeded(vm);
+    } else {
+        vm->gcStats.bytesFreed += oldSize - newSize;
+    }
 
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
-        }
+    if (oldSize > SMALL_BLOCK_MAX && newSize > SMALL_BLOCK_MAX) {
+        void *result = realloc(pointer, newSize);
+        if (result == NULL) exit(1);
+        return result;
     }
 
-    if (newSize == 0) {
-        free(pointer);
-        return NULL;
+    // At least one side is small, so the block moves between allocators or size classes.
+    void *result = NULL;
+    if (newSize > SMALL_BLOCK_MAX) {
+        result = malloc(newSize);
+        if (result == NULL) exit(1);
+    } else if (newSize > 0) {
+        result = allocateBlock(&vm->allocator, newSize);
     }
 
-    void *result = realloc(pointer, newSize);
+    if (pointer != NULL) {
+        if (result != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
 
-    if (result == NULL) {
-        exit(1);
+        if (oldSize > SMALL_BLOCK_MAX) {
+            free(pointer);
+        } else {
+            freeBlock(&vm->allocator, pointer, oldSize);
+        }
     }
 
     return result;
 }
 
-void markObject(Obj *object) {
+/**
+ * Pushes an object onto the gray stack to have its references traced.
+ * @param vm the virtual machine.
+ * @param object the object.
+ */
+static void grayObject(VM *vm, Obj *object) {
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+
+        if (vm->grayStack == NULL) exit(1);
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markObject(VM *vm, Obj *object) {
     if (object == NULL) return;
     if (object->isMarked) return;
+    if (vm->isMinorGC && object->isOld) return;
+
+    // Young objects reach incremental marking when minor collections promote them.
+    if (!vm->isMinorGC && vm->gcPhase == GC_MARKING && !object->isOld) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -48,36 +87,64 @@ void markObject(Obj *object) {
 #endif
 
     object->isMarked = true;
+    grayObject(vm, object);
+}
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+void markValue(VM *vm, Value value) {
+    if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
+}
 
-        if (vm.grayStack == NULL) exit(1);
+void writeBarrier(VM *vm, Obj *owner, Obj *value) {
+    if (!value->isOld) {
+        rememberObject(vm, owner);
+    } else if (vm->gcPhase == GC_MARKING && owner->isMarked) {
+        markObject(vm, value);
     }
+}
+
+void barrierObject(VM *vm, Obj *owner) {
+    if (!owner->isOld) return;
 
-    vm.grayStack[vm.grayCount++] = object;
+    rememberObject(vm, owner);
+    if (vm->gcPhase == GC_MARKING && owner->isMarked) grayObject(vm, owner);
 }
 
-void markValue(Value value) {
-    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+void rememberObject(VM *vm, Obj *object) {
+    if (!object->isOld || object->isRemembered) return;
+
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered = (Obj**)realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+
+        if (vm->remembered == NULL) exit(1);
+    }
+
+    object->isRemembered = true;
+    vm->remembered[vm->rememberedCount++] = object;
+}
+
+bool isWhite(VM *vm, Obj *object) {
+    if (object->isMarked) return false;
+    return !(vm->isMinorGC && object->isOld);
 }
 
 /**
  * Marks an array if it is no longer referenced.
+ * @param vm the virtual machine.
  * @param array the array.
  */
-void static markArray(ValueArray *array) {
+void static markArray(VM *vm, ValueArray *array) {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
     }
 }
 
 /**
  * Blackens an object (identifying it as still referenced).
+ * @param vm the virtual machine.
  * @param object the object.
  */
-static void blackenObject(Obj *object) {
+static void blackenObject(VM *vm, Obj *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -87,39 +154,96 @@ static void blackenObject(Obj *object) {
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = (ObjBoundMethod*)object;
-            markValue(bound->receiver);
-            markObject((Obj*)bound->method);
+            markValue(vm, bound->receiver);
+            markObject(vm, (Obj*)bound->method);
             break;
         }
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass*)object;
-            markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            markObject(vm, (Obj*)klass->name);
+            markTable(vm, &klass->methods);
+            markObject(vm, (Obj*)klass->shape);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure*)object;
-            markObject((Obj*)closure->function);
+            markObject(vm, (Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*)closure->upvalues[i]);
+                markObject(vm, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber *fiber = (ObjFiber*)object;
+            markObject(vm, (Obj*)fiber->caller);
+            markValue(vm, fiber->value);
+            // The running fiber's stack is the VM's, marked with the roots.
+            if (fiber == vm->fiber) break;
+
+            for (Value *slot = fiber->stack; slot < fiber->stackTop; slot++) {
+                markValue(vm, *slot);
+            }
+            for (int i = 0; i < fiber->frameCount; i++) {
+                markObject(vm, (Obj*)fiber->frames[i].closure);
+            }
+            for (ObjUpvalue *upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+                markObject(vm, (Obj*)upvalue);
             }
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
-            markObject((Obj *) function->name);
-            markArray(&function->chunk.constants);
+            markObject(vm, (Obj *) function->name);
+            markObject(vm, (Obj *) function->closure);
+            if (function->lazy != NULL && function->lazy->upvalueNames != NULL) {
+                for (int i = 0; i < function->upvalueCount; i++) {
+                    markObject(vm, (Obj*)function->lazy->upvalueNames[i]);
+                }
+            }
+            markArray(vm, &function->chunk.constants);
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache *cache = &function->chunk.caches[i];
+                for (int j = 0; j < INLINE_CACHE_SIZE; j++) {
+                    markObject(vm, (Obj*)cache->entries[j].shape);
+                    markObject(vm, (Obj*)cache->entries[j].transition);
+                    markObject(vm, (Obj*)cache->entries[j].method);
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance*)object;
-            markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject(vm, (Obj*)instance->klass);
+            markObject(vm, (Obj*)instance->shape);
+            if (instance->shape != NULL) {
+                for (int i = 0; i < instance->shape->slotCount; i++) {
+                    markValue(vm, instance->fields[i]);
+                }
+            }
+            markTable(vm, &instance->dictionary);
             break;
         }
-        case OBJ_NATIVE:
-            markValue(((ObjUpvalue*)object)->closed);
+        case OBJ_LIST:
+            markArray(vm, &((ObjList*)object)->items);
             break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape*)object;
+            markObject(vm, (Obj*)shape->parent);
+            markObject(vm, (Obj*)shape->name);
+            markTable(vm, &shape->transitions);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue *upvalue = (ObjUpvalue*)object;
+            markValue(vm, upvalue->closed);
+            // An open upvalue can point into a suspended fiber's stack, which minor collections do not
+            // scan when the fiber is old, so a value written through it is marked here once remembered.
+            if (upvalue->location != &upvalue->closed) markValue(vm, *upvalue->location);
+            break;
+        }
+        case OBJ_BUILDER:
+        case OBJ_FLOAT64_ARRAY:
+        case OBJ_NATIVE:
         case OBJ_STRING:
             break;
     }
@@ -127,140 +251,372 @@ static void blackenObject(Obj *object) {
 
 /**
  * Frees an object.
+ * @param vm the virtual machine.
  * @param object the object to free.
  */
-static void freeObject(Obj *object) {
+static void freeObject(VM *vm, Obj *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
+    vm->gcStats.objectCounts[object->type]--;
+
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+            FREE(vm, ObjBoundMethod, object);
+            break;
+        }
+        case OBJ_BUILDER: {
+            StringBuffer *buffer = ((ObjBuilder*)object)->buffer;
+            if (--buffer->builderCount == 0) {
+                FREE_ARRAY(vm, char, buffer->chars, buffer->capacity);
+                FREE(vm, StringBuffer, buffer);
+            }
+            FREE(vm, ObjBuilder, object);
             break;
         }
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeTable(vm, &klass->methods);
+            FREE(vm, ObjClass, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+            FREE(vm, ObjClosure, object);
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber *fiber = (ObjFiber*)object;
+            free(fiber->frames);
+            free(fiber->stack);
+            FREE(vm, ObjFiber, object);
+            break;
+        }
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array *array = (ObjFloat64Array*)object;
+            FREE_ARRAY(vm, double, array->values, array->count);
+            FREE(vm, ObjFloat64Array, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*)object;
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            freeChunk(vm, &function->chunk);
+            freeJitCode(function->jit);
+            freeLazyBody(vm, function);
+            FREE(vm, ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+            freeTable(vm, &instance->dictionary);
+            FREE(vm, ObjInstance, object);
+            break;
+        }
+        case OBJ_LIST:
+            freeValueArray(vm, &((ObjList*)object)->items);
+            FREE(vm, ObjList, object);
+            break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape*)object;
+            freeTable(vm, &shape->transitions);
+            FREE(vm, ObjShape, object);
             break;
         }
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
+            FREE(vm, ObjNative, object);
             break;
         case OBJ_STRING: {
             ObjString *string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            if (string->ownsChars) {
+                FREE_ARRAY(vm, char, string->chars, string->length + 1);
+            }
+            FREE(vm, ObjString, object);
+            break;
         }
         case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+            FREE(vm, ObjUpvalue, object);
             break;
         }
     }
 }
 
-void freeObjects() {
-    Obj *object = vm.objects;
+/**
+ * Frees every object in a list.
+ * @param vm the virtual machine.
+ * @param object the head of the list.
+ */
+static void freeList(VM *vm, Obj *object) {
     while (object != NULL) {
         Obj *next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
+}
 
-    free(vm.grayStack);
+void freeObjects(VM *vm) {
+    freeList(vm, vm->objects);
+    freeList(vm, vm->oldObjects);
+    freeList(vm, vm->sweepObjects);
+
+    free(vm->grayStack);
+    free(vm->remembered);
 }
 
 /**
- * Marks the roots of the vm.
+ * Marks the roots of the vm that are written without a barrier: the stack,
+ * the fibers, and everything the running code and compiler hold on to.
+ * @param vm the virtual machine.
  */
-static void markRoots() {
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+static void markStackRoots(VM *vm) {
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
+    }
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm, (Obj*)vm->frames[i].closure);
     }
 
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        markObject(vm, (Obj*)upvalue);
     }
 
-    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+    markObject(vm, (Obj*)vm->fiber);
+    markObject(vm, (Obj*)vm->rootFiber);
+    for (ObjFiber *fiber = vm->scheduler.readyHead; fiber != NULL; fiber = fiber->next) {
+        markObject(vm, (Obj*)fiber);
+    }
+    for (ObjFiber *fiber = vm->scheduler.waitingHead; fiber != NULL; fiber = fiber->next) {
+        markObject(vm, (Obj*)fiber);
     }
 
-    markTable(&vm.globals);
-    markCompilerRoots();
-    markObject((Obj*)vm.initString);
+    markCompilerRoots(vm);
+    markObject(vm, (Obj*)vm->initString);
+}
+
+/**
+ * Marks the roots of the vm->
+ * @param vm the virtual machine.
+ */
+static void markRoots(VM *vm) {
+    markStackRoots(vm);
+    markTable(vm, &vm->globalSlots);
+    markArray(vm, &vm->globalNames);
+    markArray(vm, &vm->globalValues);
+}
+
+/**
+ * Traces the old objects that may refer to young ones.
+ * Only needed by minor collections, which otherwise never look at the old generation.
+ * @param vm the virtual machine.
+ */
+static void markRemembered(VM *vm) {
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        blackenObject(vm, vm->remembered[i]);
+    }
+}
+
+/**
+ * Forgets the remembered set. Every survivor of a collection is promoted,
+ * so afterwards no old object can refer to a young one.
+ * @param vm the virtual machine.
+ */
+static void clearRemembered(VM *vm) {
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        vm->remembered[i]->isRemembered = false;
+    }
+    vm->rememberedCount = 0;
 }
 
 /**
  * Traces the vm's references.
+ * @param vm the virtual machine.
+ * @param base the number of gray objects to leave on the stack. Minor collections
+ * leave the objects an incremental major collection has yet to trace.
  */
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj *object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+static void traceReferences(VM *vm, int base) {
+    while (vm->grayCount > base) {
+        Obj *object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
     }
 }
 
 /**
- * Sweeps the marked objects.
+ * Sweeps the young generation, promoting every marked object to the old generation.
+ * @param vm the virtual machine.
  */
-static void sweep() {
-    Obj *previous = NULL;
-    Obj *object = vm.objects;
+static void sweepYoung(VM *vm) {
+    Obj *object = vm->objects;
     while (object != NULL) {
+        Obj *next = object->next;
         if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            Obj *unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
+            object->isOld = true;
+            object->next = vm->oldObjects;
+            vm->oldObjects = object;
+
+            // A major collection that is marking has yet to trace what the survivor refers to.
+            if (vm->gcPhase == GC_MARKING) {
+                grayObject(vm, object);
             } else {
-                vm.objects = object;
+                object->isMarked = false;
             }
-
-            freeObject(unreached);
+        } else {
+            freeObject(vm, object);
         }
+        object = next;
     }
+
+    vm->objects = NULL;
+    vm->nurseryBytes = 0;
 }
 
-void collectGarbage() {
+/**
+ * Begins an incremental major collection by marking the roots.
+ * @param vm the virtual machine.
+ */
+static void startCollection(VM *vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    vm->gcPhase = GC_MARKING;
+    markRoots(vm);
+}
+
+/**
+ * Finishes marking. Surviving young objects are promoted so that every live
+ * object is old, then the roots written without a barrier are marked again.
+ * @param vm the virtual machine.
+ */
+static void finishMarking(VM *vm) {
+    collectYoungGarbage(vm);
+    markStackRoots(vm);
+    traceReferences(vm, 0);
+    tableRemoveWhite(vm, &vm->strings);
+
+    vm->sweepObjects = vm->oldObjects;
+    vm->oldObjects = NULL;
+    vm->gcPhase = GC_SWEEPING;
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+/**
+ * Sweeps part of the old generation, moving marked objects back to it and freeing the rest.
+ * @param vm the virtual machine.
+ * @param budget the number of objects to sweep.
+ */
+static void sweepOld(VM *vm, int budget) {
+    for (int work = 0; work < budget && vm->sweepObjects != NULL; work++) {
+        Obj *object = vm->sweepObjects;
+        vm->sweepObjects = object->next;
+
+        if (object->isMarked) {
+            object->isMarked = false;
+            object->next = vm->oldObjects;
+            vm->oldObjects = object;
+        } else {
+            freeObject(vm, object);
+        }
+    }
+
+    if (vm->sweepObjects != NULL) return;
+
+    vm->gcPhase = GC_IDLE;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->gcStats.collections++;
+    vm->gcStats.liveBytes = vm->bytesAllocated;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+    printf("   %zu bytes allocated, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+/**
+ * Performs one bounded step of the major collection in progress.
+ * @param vm the virtual machine.
+ */
+static void gcStep(VM *vm) {
+    if (vm->gcPhase == GC_MARKING) {
+        for (int work = 0; work < vm->gcStepBudget && vm->grayCount > 0; work++) {
+            blackenObject(vm, vm->grayStack[--vm->grayCount]);
+        }
+
+        if (vm->grayCount == 0) finishMarking(vm);
+    } else {
+        sweepOld(vm, vm->gcStepBudget);
+    }
+}
+
+/**
+ * Runs the collection work that allocation has made due, and records how long it paused for.
+ * @param vm the virtual machine.
+ */
+static void collectIfNeeded(VM *vm) {
+#ifndef DEBUG_STRESS_GC
+    if (vm->gcPhase == GC_IDLE && vm->bytesAllocated <= vm->nextGC &&
+            vm->nurseryBytes <= vm->nurserySize) {
+        return;
+    }
+#endif
+
+    clock_t start = clock();
+
+#ifdef DEBUG_STRESS_GC
+    collectYoungGarbage(vm);
+#endif
+
+    if (vm->gcPhase != GC_IDLE) {
+        gcStep(vm);
+    } else if (vm->bytesAllocated > vm->nextGC) {
+        if (vm->gcStepBudget > 0) {
+            startCollection(vm);
+        } else {
+            collectGarbage(vm);
+        }
+    }
+
+    if (vm->nurseryBytes > vm->nurserySize) {
+        collectYoungGarbage(vm);
+    }
+
+    double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+    vm->gcStats.totalPause += pause;
+    if (pause > vm->gcStats.maxPause) vm->gcStats.maxPause = pause;
+}
+
+void collectGarbage(VM *vm) {
+    if (vm->gcPhase == GC_IDLE) startCollection(vm);
+    if (vm->gcPhase == GC_MARKING) {
+        traceReferences(vm, 0);
+        finishMarking(vm);
+    }
+    sweepOld(vm, INT_MAX);
+}
+
+void collectYoungGarbage(VM *vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    int base = vm->grayCount;
+    vm->isMinorGC = true;
+    markRoots(vm);
+    markRemembered(vm);
+    traceReferences(vm, base);
+    tableRemoveWhite(vm, &vm->strings);
+    sweepYoung(vm);
+    clearRemembered(vm);
+    vm->isMinorGC = false;
+
+    vm->gcStats.minorCollections++;
+    vm->gcStats.liveBytes = vm->bytesAllocated;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm->bytesAllocated, before, vm->bytesAllocated);
 #endif
-}
\ No newline at end of file
+}
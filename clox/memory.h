@@ -6,19 +6,21 @@
 
 /**
  * Allocates a number of values on the heap.
+ * @param vm the virtual machine.
  * @param type the value type.
  * @param count the number of values to allocate.
  */
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 /**
  * Frees a value.
+ * @param vm the virtual machine.
  * @param type the value type.
  * @param pointer the pointer to the value to free.
  */
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) \
+    reallocate(vm, pointer, sizeof(type), 0)
 
 /**
  * If the capacity is zero, the new capacity will be 8.
@@ -31,23 +33,50 @@
 
 /**
  * Grows an array to the specified size.
+ * @param vm the virtual machine.
  * @param type the datatype of the array.
  * @param pointer the pointer to the array.
  * @param oldCount the previous number of elements in the array.
  * @param newCount the new number of elements in the array.
  */
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+    (type*)reallocate(vm, pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
 
 /**
  * Free's an array.
+ * @param vm the virtual machine.
  * @param type the datatype of the array.
  * @param pointer the pointer to the array.
  * @param oldCount the number of elements in the array.
  */
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
+
+/**
+ * Records a store into an object. Only stores into old objects need recording:
+ * see writeBarrier().
+ * @param vm the virtual machine.
+ * @param owner the object being written to.
+ * @param value the value being stored.
+ */
+#define WRITE_BARRIER(vm, owner, value) \
+    do { \
+        if (((Obj*)(owner))->isOld && IS_OBJ(value)) { \
+            writeBarrier(vm, (Obj*)(owner), AS_OBJ(value)); \
+        } \
+    } while (false)
+
+/**
+ * Records a store into a global variable. Globals are only scanned when a major
+ * collection starts, so values stored while it is marking must be marked here.
+ * @param vm the virtual machine.
+ * @param value the value being stored.
+ */
+#define GLOBAL_WRITE_BARRIER(vm, value) \
+    do { \
+        if ((vm)->gcPhase == GC_MARKING) markValue(vm, value); \
+    } while (false)
 
 /**
  * Reallocates or frees a allocation of memory.
@@ -59,33 +88,85 @@
  * | non-zero | < oldSize | Shrink allocation.  |
  * | non-zero | > oldSize | Grow allocation.    |
  *
+ * Blocks of at most SMALL_BLOCK_MAX bytes are served by the VM's size-class
+ * allocator, so oldSize must be the size the block was allocated with.
+ *
+ * @param vm the virtual machine.
  * @param pointer pointer to the memory.
  * @param oldSize the old memory size.
  * @param newSize the new memory size.
  * @return pointer to the new memory.
  */
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize);
 
 /**
  * Marks the object if it is not referenced.
+ * @param vm the virtual machine.
  * @param object the object
  */
-void markObject(Obj *object);
+void markObject(VM *vm, Obj *object);
 
 /**
  * Marks a value if it is no longer referenced.
+ * @param vm the virtual machine.
  * @param value the value.
  */
-void markValue(Value value);
+void markValue(VM *vm, Value value);
+
+/**
+ * Records that an old object was given a reference to another object.
+ * A young value gets the owner remembered for minor collections, and while a
+ * major collection is marking, an unmarked value stored into a marked owner is marked.
+ * @param vm the virtual machine.
+ * @param owner the object written to.
+ * @param value the object stored.
+ */
+void writeBarrier(VM *vm, Obj *owner, Obj *value);
+
+/**
+ * Records a store of any number of references into an object, for stores that
+ * cannot go through WRITE_BARRIER one value at a time. A marked owner is traced again.
+ * @param vm the virtual machine.
+ * @param owner the object written to.
+ */
+void barrierObject(VM *vm, Obj *owner);
+
+/**
+ * Adds an old object to the remembered set traced by minor collections.
+ * Young objects and objects that are already remembered are ignored.
+ * @param vm the virtual machine.
+ * @param object the object.
+ */
+void rememberObject(VM *vm, Obj *object);
+
+/**
+ * Determines whether an object was not reached by the current collection.
+ * Old objects are never white during a minor collection.
+ * @param vm the virtual machine.
+ * @param object the object.
+ * @return if the object is unreachable.
+ */
+bool isWhite(VM *vm, Obj *object);
 
 /**
  * Collects unreferenced objects on the heap.
+ * This is a major collection that traces both generations. Any incremental
+ * collection in progress is run to completion.
+ * @param vm the virtual machine.
+ */
+void collectGarbage(VM *vm);
+
+/**
+ * Collects unreferenced objects in the young generation only,
+ * promoting the survivors to the old generation.
+ * @param vm the virtual machine.
  */
-void collectGarbage();
+void collectYoungGarbage(VM *vm);
 
 /**
  * Frees the objects stored on the heap in the VM.
+ * @param vm the virtual machine.
  */
-void freeObjects();
+void freeObjects(VM *vm);
 
 #endif //CLOX_MEMORY_H
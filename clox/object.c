@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -7,22 +8,26 @@
 #include "object.h"
 
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
 /**
  * Allocates an object on the heap.
+ * @param vm the virtual machine.
  * @param size the size of the object.
  * @param type the object type.
  * @return the newly allocated object.
  */
-static Obj *allocateObject(size_t size, ObjType type) {
-    Obj *object = (Obj*) reallocate(NULL, 0, size);
+static Obj *allocateObject(VM *vm, size_t size, ObjType type) {
+    Obj *object = (Obj*) reallocate(vm, NULL, 0, size);
     object->type = type;
     object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
+    vm->gcStats.objectCounts[type]++;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -32,80 +37,294 @@ static Obj *allocateObject(size_t size, ObjType type) {
 }
 
 
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
-    ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method) {
+    ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
 }
 
-ObjClass *newClass(ObjString *name) {
-    ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+/**
+ * Creates a new shape.
+ * @param vm the virtual machine.
+ * @param parent the shape being extended, or NULL for a root shape.
+ * @param name the name of the added field, or NULL for a root shape.
+ * @return the shape.
+ */
+static ObjShape *newShape(VM *vm, ObjShape *parent, ObjString *name) {
+    ObjShape *shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+ObjClass *newClass(VM *vm, ObjString *name) {
+    ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->version = 0;
+    klass->shape = NULL;
+    klass->expectedFields = 0;
+
+    push(vm, OBJ_VAL(klass));
+    klass->shape = newShape(vm, NULL, NULL);
+    WRITE_BARRIER(vm, klass, OBJ_VAL(klass->shape));
+    pop(vm);
     return klass;
 }
 
-ObjFunction *newFunction() {
-    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction *newFunction(VM *vm) {
+    ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->backEdges = 0;
+    function->jit = NULL;
+    function->closure = NULL;
+    function->lazy = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjInstance *newInstance(ObjClass *klass) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+void freeLazyBody(VM *vm, ObjFunction *function) {
+    LazyBody *lazy = function->lazy;
+    if (lazy == NULL) return;
+
+    if (lazy->upvalueNames != NULL) FREE_ARRAY(vm, ObjString*, lazy->upvalueNames, function->upvalueCount);
+    FREE(vm, LazyBody, lazy);
+    function->lazy = NULL;
+}
+
+ObjInstance *newInstance(VM *vm, ObjClass *klass) {
+    Value *fields = NULL;
+    if (klass->expectedFields > 0) {
+        fields = ALLOCATE(vm, Value, klass->expectedFields);
+    }
+
+    ObjInstance *instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->shape;
+    instance->fields = fields;
+    instance->fieldCapacity = klass->expectedFields;
+    initTable(&instance->dictionary);
     return instance;
 }
 
-ObjNative *newNative(NativeFn function) {
-    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+int shapeFind(ObjShape *shape, ObjString *name) {
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->slotCount - 1;
+    }
+
+    return -1;
+}
+
+/**
+ * Gets the child of a shape that adds a field, creating it if needed.
+ * @param vm the virtual machine.
+ * @param shape the shape.
+ * @param name the name of the added field.
+ * @return the child shape.
+ */
+static ObjShape *shapeTransition(VM *vm, ObjShape *shape, ObjString *name) {
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) {
+        return AS_SHAPE(child);
+    }
+
+    ObjShape *next = newShape(vm, shape, name);
+    push(vm, OBJ_VAL(next));
+    tableSet(vm, &shape->transitions, name, OBJ_VAL(next));
+    WRITE_BARRIER(vm, shape, OBJ_VAL(next));
+    pop(vm);
+    return next;
+}
+
+/**
+ * Moves an instance's fields into its dictionary table.
+ * @param vm the virtual machine.
+ * @param instance the instance.
+ */
+static void makeDictionary(VM *vm, ObjInstance *instance) {
+    for (ObjShape *shape = instance->shape; shape->name != NULL; shape = shape->parent) {
+        tableSet(vm, &instance->dictionary, shape->name, instance->fields[shape->slotCount - 1]);
+    }
+
+    FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+    instance->shape = NULL;
+}
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->dictionary, name, value);
+    }
+
+    int slot = shapeFind(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+void instanceSetField(VM *vm, ObjInstance *instance, ObjString *name, Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeFind(instance->shape, name);
+        if (slot != -1) {
+            instance->fields[slot] = value;
+            WRITE_BARRIER(vm, instance, value);
+            return;
+        }
+
+        if (instance->shape->slotCount < SHAPE_MAX_FIELDS) {
+            instanceAddField(vm, instance, shapeTransition(vm, instance->shape, name), value);
+            return;
+        }
+
+        makeDictionary(vm, instance);
+    }
+
+    tableSet(vm, &instance->dictionary, name, value);
+    WRITE_BARRIER(vm, instance, value);
+}
+
+void instanceAddField(VM *vm, ObjInstance *instance, ObjShape *shape, Value value) {
+    if (instance->fieldCapacity < shape->slotCount) {
+        int oldCapacity = instance->fieldCapacity;
+        int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+        instance->fields = GROW_ARRAY(vm, Value, instance->fields, oldCapacity, capacity);
+        instance->fieldCapacity = capacity;
+    }
+
+    instance->fields[shape->slotCount - 1] = value;
+    instance->shape = shape;
+    WRITE_BARRIER(vm, instance, value);
+    WRITE_BARRIER(vm, instance, OBJ_VAL(shape));
+
+    if (instance->klass->expectedFields < shape->slotCount) {
+        instance->klass->expectedFields = shape->slotCount;
+    }
+}
+
+ObjList *newList(VM *vm, int count) {
+    ObjList *list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    if (count == 0) return list;
+
+    push(vm, OBJ_VAL(list));
+    Value *items = ALLOCATE(vm, Value, count);
+    for (int i = 0; i < count; i++) {
+        items[i] = NIL_VAL;
+    }
+    list->items.values = items;
+    list->items.capacity = count;
+    list->items.count = count;
+    pop(vm);
+    return list;
+}
+
+void listAppend(VM *vm, ObjList *list, Value value) {
+    writeValueArray(vm, &list->items, value);
+    WRITE_BARRIER(vm, list, value);
+}
+
+ObjFloat64Array *newFloat64Array(VM *vm, int count) {
+    ObjFloat64Array *array = ALLOCATE_OBJ(vm, ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+    array->count = 0;
+    array->values = NULL;
+    if (count == 0) return array;
+
+    push(vm, OBJ_VAL(array));
+    double *values = ALLOCATE(vm, double, count);
+    memset(values, 0, sizeof(double) * count);
+    array->values = values;
+    array->count = count;
+    pop(vm);
+    return array;
+}
+
+ObjNative *newNative(VM *vm, NativeFn function) {
+    ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-ObjClosure *newClosure(ObjFunction *function) {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+ObjClosure *newClosure(VM *vm, ObjFunction *function) {
+    ObjUpvalue **upvalues = NULL;
+    if (function->upvalueCount > 0) upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++) {
         upvalues[i] = NULL;
     }
 
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
+ObjFiber *newFiber(VM *vm, ObjClosure *closure) {
+    CallFrame *frames = NULL;
+    Value *stack = NULL;
+    if (closure != NULL) {
+        // Like the VM's own stack, these are grown with realloc() and not counted by the collector.
+        frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+        stack = (Value*)malloc(sizeof(Value) * FIBER_STACK_INITIAL);
+        if (frames == NULL || stack == NULL) exit(1);
+    }
+
+    ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = closure == NULL ? 0 : FRAMES_INITIAL;
+    fiber->stack = stack;
+    fiber->stackTop = stack;
+    fiber->stackCapacity = closure == NULL ? 0 : FIBER_STACK_INITIAL;
+    fiber->openUpvalues = NULL;
+    fiber->caller = NULL;
+    fiber->callSlots = 0;
+    fiber->value = NIL_VAL;
+    fiber->wakeTime = 0;
+    fiber->waitsForInput = false;
+    fiber->next = NULL;
+    if (closure == NULL) return fiber;
+
+    // The call to the closure is set up ahead of time, with its parameter, if any, nil until the first resume().
+    *fiber->stackTop++ = OBJ_VAL(closure);
+    for (int i = 0; i < closure->function->arity; i++) {
+        *fiber->stackTop++ = NIL_VAL;
+    }
+    CallFrame *frame = &fiber->frames[fiber->frameCount++];
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->slots = fiber->stack;
+    return fiber;
+}
+
 /**
  * Allocates a string on the heap.
+ * @param vm the virtual machine.
  * @param chars the string.
  * @param length the length of the string.
  * @return the newly allocated string.
  */
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString *allocateString(VM *vm, char *chars, int length, uint32_t hash) {
+    ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->ownsChars = true;
 
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
     return string;
 }
 
-/**
- * Calculates the hash for a given key.
- * @param key the key.
- * @param length the length of the key.
- * @return the hash string.
- */
-static uint32_t hashString(const char *key, int length) {
+uint32_t hashString(const char *key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= (uint8_t)key[i];
@@ -114,32 +333,129 @@ static uint32_t hashString(const char *key, int length) {
     return hash;
 }
 
-ObjString *takeString(char *chars, int length) {
+ObjString *takeString(VM *vm, char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
 
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    return allocateString(vm, chars, length, hash);
 }
 
-ObjString *copyString(const char *chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString *copyString(VM *vm, const char *chars, int length) {
+    return copyStringHashed(vm, chars, length, hashString(chars, length));
+}
+
+ObjString *copyStringHashed(VM *vm, const char *chars, int length, uint32_t hash) {
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
 
     if (interned != NULL) return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
+    char *heapChars = ALLOCATE(vm, char, length + 1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(vm, heapChars, length, hash);
+}
+
+ObjString *referenceString(VM *vm, const char *chars, int length) {
+    return referenceStringHashed(vm, chars, length, hashString(chars, length));
+}
+
+ObjString *referenceStringHashed(VM *vm, const char *chars, int length, uint32_t hash) {
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+
+    if (interned != NULL) return interned;
+
+    ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+    string->length = length;
+    string->chars = (char*)chars;
+    string->hash = hash;
+    string->ownsChars = false;
+
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
+    return string;
+}
+
+/**
+ * Creates a new string buffer with no builders.
+ * @param vm the virtual machine.
+ * @param capacity the capacity of the buffer.
+ * @return the buffer.
+ */
+static StringBuffer *newStringBuffer(VM *vm, int capacity) {
+    char *chars = ALLOCATE(vm, char, capacity);
+    StringBuffer *buffer = ALLOCATE(vm, StringBuffer, 1);
+    buffer->chars = chars;
+    buffer->length = 0;
+    buffer->capacity = capacity;
+    buffer->builderCount = 0;
+    return buffer;
+}
+
+/**
+ * Creates a new builder that sees a prefix of a buffer.
+ * @param vm the virtual machine.
+ * @param buffer the buffer.
+ * @param length the length of the prefix.
+ * @return the builder.
+ */
+static ObjBuilder *newBuilder(VM *vm, StringBuffer *buffer, int length) {
+    ObjBuilder *builder = ALLOCATE_OBJ(vm, ObjBuilder, OBJ_BUILDER);
+    builder->length = length;
+    builder->buffer = buffer;
+    buffer->builderCount++;
+    return builder;
+}
+
+Value concatenateStrings(VM *vm, Value a, Value b) {
+    int aLength = stringLength(a);
+    int bLength = stringLength(b);
+    int length = aLength + bLength;
+
+    if (IS_BUILDER(a) && AS_BUILDER(a)->length == AS_BUILDER(a)->buffer->length) {
+        StringBuffer *buffer = AS_BUILDER(a)->buffer;
+        if (length > buffer->capacity) {
+            int capacity = buffer->capacity;
+            while (capacity < length) capacity *= 2;
+            buffer->chars = GROW_ARRAY(vm, char, buffer->chars, buffer->capacity, capacity);
+            buffer->capacity = capacity;
+        }
+
+        // The right string may be a builder on the same buffer, so its characters are read after growing.
+        memmove(buffer->chars + aLength, stringChars(b), bLength);
+        buffer->length = length;
+        return OBJ_VAL(newBuilder(vm, buffer, length));
+    }
+
+    if (length < BUILDER_MIN_LENGTH) {
+        char *chars = ALLOCATE(vm, char, length + 1);
+        memcpy(chars, stringChars(a), aLength);
+        memcpy(chars + aLength, stringChars(b), bLength);
+        chars[length] = '\0';
+        return OBJ_VAL(takeString(vm, chars, length));
+    }
+
+    StringBuffer *buffer = newStringBuffer(vm, length * 2);
+    memcpy(buffer->chars, stringChars(a), aLength);
+    memcpy(buffer->chars + aLength, stringChars(b), bLength);
+    buffer->length = length;
+    return OBJ_VAL(newBuilder(vm, buffer, length));
 }
 
-ObjUpvalue *newUpvalue(Value *slot) {
-    ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+bool stringsEqual(Value a, Value b) {
+    if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) return false;
+
+    int length = stringLength(a);
+    return length == stringLength(b) && memcmp(stringChars(a), stringChars(b), length) == 0;
+}
+
+ObjUpvalue *newUpvalue(VM *vm, Value *slot) {
+    ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
@@ -147,42 +463,93 @@ ObjUpvalue *newUpvalue(Value *slot) {
 }
 
 /**
- * Prints information about a function to stdout.
- * @param function the function to print.
+ * Writes the elements of a list to an output.
+ * @param output the output.
+ * @param list the list.
  */
-static void printFunction(ObjFunction *function) {
+static void writeList(Output *output, ObjList *list) {
+    writeOutput(output, "[", 1);
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) writeOutput(output, ", ", 2);
+        Value item = list->items.values[i];
+        // Only a list that holds itself directly is caught; deeper cycles recurse.
+        if (IS_LIST(item) && AS_LIST(item) == list) {
+            writeOutput(output, "[...]", 5);
+        } else {
+            writeValue(output, item);
+        }
+    }
+    writeOutput(output, "]", 1);
+}
+
+/**
+ * Writes the elements of an array to an output.
+ * @param output the output.
+ * @param array the array.
+ */
+static void writeFloat64Array(Output *output, ObjFloat64Array *array) {
+    writeOutput(output, "[", 1);
+    for (int i = 0; i < array->count; i++) {
+        if (i > 0) writeOutput(output, ", ", 2);
+        writeNumber(output, array->values[i]);
+    }
+    writeOutput(output, "]", 1);
+}
+
+/**
+ * Writes information about a function to an output.
+ * @param output the output.
+ * @param function the function to write.
+ */
+static void writeFunction(Output *output, ObjFunction *function) {
     if (function->name == NULL) {
-        printf("<script>");
+        writeOutput(output, "<script>", 8);
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    writeFormatted(output, "<fn %.*s>", function->name->length, function->name->chars);
 }
 
-void printObject(Value value) {
+void writeObject(Output *output, Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function);
+            writeFunction(output, AS_BOUND_METHOD(value)->method->function);
+            break;
+        case OBJ_BUILDER:
+            writeOutput(output, AS_BUILDER(value)->buffer->chars, AS_BUILDER(value)->length);
             break;
         case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
+            writeOutput(output, AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
             break;
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value)->function);
+            writeFunction(output, AS_CLOSURE(value)->function);
+            break;
+        case OBJ_FIBER:
+            writeOutput(output, "<fiber>", 7);
+            break;
+        case OBJ_FLOAT64_ARRAY:
+            writeFloat64Array(output, AS_FLOAT64_ARRAY(value));
             break;
         case OBJ_FUNCTION:
-            printFunction(AS_FUNCTION(value));
+            writeFunction(output, AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+            writeOutput(output, AS_INSTANCE(value)->klass->name->chars, AS_INSTANCE(value)->klass->name->length);
+            writeOutput(output, " instance", 9);
+            break;
+        case OBJ_LIST:
+            writeList(output, AS_LIST(value));
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            writeOutput(output, "<native fn>", 11);
+            break;
+        case OBJ_SHAPE:
+            writeOutput(output, "shape", 5);
             break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            writeOutput(output, AS_CSTRING(value), AS_STRING(value)->length);
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            writeOutput(output, "upvalue", 7);
             break;
     }
 }
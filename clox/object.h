@@ -9,19 +9,30 @@
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_BUILDER(value)      isObjType(value, OBJ_BUILDER)
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value)        isObjType(value, OBJ_FIBER)
+#define IS_FLOAT64_ARRAY(value) isObjType(value, OBJ_FLOAT64_ARRAY)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_ANY_STRING(value)   (IS_STRING(value) || IS_BUILDER(value))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_BUILDER(value)      ((ObjBuilder*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
@@ -30,24 +41,61 @@
  */
 typedef enum {
     OBJ_BOUND_METHOD,
+    OBJ_BUILDER,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
+    OBJ_FLOAT64_ARRAY,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
 
+/** The number of object types. */
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 /**
  * Lox object.
  */
 struct Obj {
     ObjType type;
     bool isMarked;
+
+    /** Whether the object has survived a collection and been promoted. */
+    bool isOld;
+
+    /** Whether the object is in the remembered set. */
+    bool isRemembered;
+
     struct Obj *next;
 };
 
+/**
+ * The body of a function that is compiled on its first call. It was checked for
+ * errors, and its upvalues resolved, when the enclosing function was compiled.
+ */
+typedef struct {
+    /** The '(' that starts the parameter list, in a source held by the VM. */
+    const char *start;
+    /** The NUL terminator of that source. */
+    const char *end;
+    int line;
+
+    /** The kind of function, as the compiler's FunctionType. */
+    uint8_t type;
+    /** Whether the function is declared inside a class, so it may use 'this'. */
+    bool inClass;
+    /** Whether that class has a superclass, so the function may use 'super'. */
+    bool hasSuperClass;
+
+    /** The names of the upvalues, in order, which the free variables of the body resolve to. */
+    ObjString **upvalueNames;
+} LazyBody;
+
 /**
  * Lox function.
  */
@@ -57,9 +105,22 @@ typedef struct {
     int upvalueCount;
     Chunk chunk;
     ObjString *name;
+
+    /** The number of loop back edges taken, counted up to JIT_THRESHOLD. */
+    int backEdges;
+    /** The native code of the function's loops, or NULL until they are compiled. */
+    struct JitCode *jit;
+    /** The closure shared by every definition of a function without upvalues, or NULL until one is made. */
+    ObjClosure *closure;
+    /** The body still to be compiled, or NULL once the chunk holds the function's code. */
+    LazyBody *lazy;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+/**
+ * A native function. It reports an error by calling a runtime error and
+ * returning UNDEFINED_VAL, which is never a Lox value.
+ */
+typedef Value (*NativeFn)(VM *vm, int argCount, Value *args);
 
 /**
  * Lox native function.
@@ -75,10 +136,57 @@ typedef struct {
 struct ObjString {
     Obj obj;
     int length;
+    /** The characters, NUL-terminated unless the string was made by referenceString(). */
     char *chars;
     uint32_t hash;
+    /** Whether chars was allocated for this string and is freed with it. */
+    bool ownsChars;
 };
 
+/**
+ * List: a growable array of values.
+ */
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+/**
+ * A fixed-length array of numbers, stored unboxed.
+ */
+typedef struct {
+    Obj obj;
+    int count;
+    double *values;
+} ObjFloat64Array;
+
+/** Concatenations shorter than this make interned strings rather than builders. */
+#define BUILDER_MIN_LENGTH 64
+
+/**
+ * The characters of a run of concatenations, shared by the builders made along the way.
+ * The buffer is only ever appended to, and each builder sees a prefix of it.
+ */
+typedef struct {
+    char *chars;
+    /** The number of characters written, which is the length of the longest builder. */
+    int length;
+    int capacity;
+    /** The number of builders that refer to the buffer. */
+    int builderCount;
+} StringBuffer;
+
+/**
+ * A string made by concatenation. Builders are not interned, so two equal builders
+ * may be different objects. Concatenating onto the longest builder of a buffer
+ * appends in place, so building a string piece by piece takes linear time.
+ */
+typedef struct {
+    Obj obj;
+    int length;
+    StringBuffer *buffer;
+} ObjBuilder;
+
 /**
  * Upvalue.
  */
@@ -92,21 +200,116 @@ typedef struct ObjUpvalue {
 /**
  * Closure.
  */
-typedef struct {
+struct ObjClosure {
     Obj obj;
     ObjFunction *function;
     ObjUpvalue **upvalues;
     int upvalueCount;
-} ObjClosure;
+};
+
+typedef struct {
+    ObjClosure *closure;
+    uint8_t *ip;
+    Value *slots;
+} CallFrame;
+
+/**
+ * States of a fiber.
+ */
+typedef enum {
+    /** Created, and not yet resumed. */
+    FIBER_NEW,
+    /** Yielded to the fiber that resumed it, and waiting to be resumed again. */
+    FIBER_SUSPENDED,
+    /** Running, or waiting for a fiber it resumed to yield. */
+    FIBER_RUNNING,
+    /** In the scheduler's queue, ready to continue. */
+    FIBER_READY,
+    /** Parked until a timer expires or input arrives. */
+    FIBER_WAITING,
+    /** Returned from its function, or stopped by a runtime error. */
+    FIBER_DONE
+} FiberState;
+
+/**
+ * Fiber: a function running on its own value stack and call frames, which can
+ * be suspended and continued. While a fiber runs, the VM works on its stack,
+ * frames and open upvalues directly, and the copies here are stale.
+ */
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+
+    CallFrame *frames;
+    int frameCount;
+    int frameCapacity;
+
+    Value *stack;
+    Value *stackTop;
+    int stackCapacity;
+
+    ObjUpvalue *openUpvalues;
+
+    /** The fiber that resumed this one, and continues when it yields or returns, or NULL. */
+    struct ObjFiber *caller;
+    /**
+     * The stack slots of the native call the fiber is suspended in: the callee and its
+     * arguments, replaced by the call's result when the fiber continues. Zero until the
+     * fiber first runs.
+     */
+    int callSlots;
+    /** The value a ready fiber continues with. */
+    Value value;
+
+    /** The time a sleeping fiber wakes at, in seconds on the scheduler's clock. */
+    double wakeTime;
+    /** Whether the fiber is waiting for a line of input rather than a timer. */
+    bool waitsForInput;
+    /** The next fiber in the scheduler queue the fiber is in. */
+    struct ObjFiber *next;
+} ObjFiber;
+
+/** Instances with more fields than this switch to dictionary mode. */
+#define SHAPE_MAX_FIELDS 64
+
+/**
+ * Shape (hidden class).
+ * Describes the field layout shared by instances that added the same
+ * fields in the same order. Each shape extends its parent by one field.
+ */
+struct ObjShape {
+    Obj obj;
+
+    /** The shape without the last field, or NULL for a class's root shape. */
+    ObjShape *parent;
+
+    /** The field added by this shape, or NULL for a root shape. */
+    ObjString *name;
+
+    /** The number of fields; the added field lives in slot slotCount - 1. */
+    int slotCount;
+
+    /** Maps a field name to the child shape that adds it. */
+    Table transitions;
+};
 
 /**
  * Class.
  */
-typedef struct {
+struct ObjClass {
     Obj obj;
     ObjString *name;
     Table methods;
-} ObjClass;
+
+    /** Bumped whenever the method table changes, invalidating inline caches. */
+    uint32_t version;
+
+    /** The shape of a new instance with no fields. */
+    ObjShape *shape;
+
+    /** The most fields any instance has had, used to size new instances. */
+    int expectedFields;
+};
 
 /**
  * Instance
@@ -114,7 +317,16 @@ typedef struct {
 typedef struct {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+
+    /** The field layout, or NULL once the instance is in dictionary mode. */
+    ObjShape *shape;
+
+    /** The field values, indexed by shape slot. */
+    Value *fields;
+    int fieldCapacity;
+
+    /** The fields of an instance in dictionary mode. */
+    Table dictionary;
 } ObjInstance;
 
 typedef struct {
@@ -123,70 +335,213 @@ typedef struct {
     ObjClosure *method;
 } ObjBoundMethod;
 
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method);
 
 /**
  * Creates a new class.
+ * @param vm the virtual machine.
  * @param name the name of the class.
  * @return the class.
  */
-ObjClass *newClass(ObjString *name);
+ObjClass *newClass(VM *vm, ObjString *name);
 
 /**
  * Creates a new function.
+ * @param vm the virtual machine.
  * @return the function.
  */
-ObjFunction *newFunction();
+ObjFunction *newFunction(VM *vm);
+
+/**
+ * Frees the deferred body of a function, once it is compiled or the function is freed.
+ * @param vm the virtual machine.
+ * @param function the function.
+ */
+void freeLazyBody(VM *vm, ObjFunction *function);
 
 /**
  * Creates a new instance of a class.
+ * @param vm the virtual machine.
  * @param klass the class.
  * @return the instance.
  */
-ObjInstance *newInstance(ObjClass *klass);
+ObjInstance *newInstance(VM *vm, ObjClass *klass);
+
+/**
+ * Finds the slot of a field in a shape.
+ * @param shape the shape.
+ * @param name the name of the field.
+ * @return the slot of the field, or -1 if the shape has no such field.
+ */
+int shapeFind(ObjShape *shape, ObjString *name);
+
+/**
+ * Gets a field of an instance.
+ * @param instance the instance.
+ * @param name the name of the field.
+ * @param value set to the field's value if it exists.
+ * @return whether the instance has the field.
+ */
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+
+/**
+ * Sets a field of an instance, adding it if it does not exist.
+ * @param vm the virtual machine.
+ * @param instance the instance.
+ * @param name the name of the field.
+ * @param value the new value.
+ */
+void instanceSetField(VM *vm, ObjInstance *instance, ObjString *name, Value value);
+
+/**
+ * Appends a field to an instance that is in shape mode.
+ * @param vm the virtual machine.
+ * @param instance the instance.
+ * @param shape the child of the instance's shape that adds the field.
+ * @param value the value of the new field.
+ */
+void instanceAddField(VM *vm, ObjInstance *instance, ObjShape *shape, Value value);
+
+/**
+ * Creates a new list of nil values.
+ * @param vm the virtual machine.
+ * @param count the number of values.
+ * @return the list.
+ */
+ObjList *newList(VM *vm, int count);
+
+/**
+ * Appends a value to a list.
+ * Both must be reachable by the garbage collector.
+ * @param vm the virtual machine.
+ * @param list the list.
+ * @param value the value.
+ */
+void listAppend(VM *vm, ObjList *list, Value value);
+
+/**
+ * Creates a new array of zeros.
+ * @param vm the virtual machine.
+ * @param count the number of elements.
+ * @return the array.
+ */
+ObjFloat64Array *newFloat64Array(VM *vm, int count);
 
 /**
  * Creates a new native function in the Lox interpreter..
+ * @param vm the virtual machine.
  * @param function the native function.
  * @return the native function.
  */
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(VM *vm, NativeFn function);
 
 /**
  * Creates a new closure.
+ * @param vm the virtual machine.
  * @param function the function for the closure.
  * @return the closure.
  */
-ObjClosure *newClosure(ObjFunction *function);
+ObjClosure *newClosure(VM *vm, ObjFunction *function);
+
+/**
+ * Creates a new fiber that calls a closure when first resumed. A function of one
+ * parameter receives the value the fiber is first resumed with.
+ * The closure must take at most one argument and have its body compiled.
+ * @param vm the virtual machine.
+ * @param closure the closure, or NULL for the fiber a VM starts on, which runs on the VM's own stack.
+ * @return the fiber.
+ */
+ObjFiber *newFiber(VM *vm, ObjClosure *closure);
+
+/**
+ * Calculates the hash of a string using 32-bit FNV-1a.
+ * @param key the characters of the string.
+ * @param length the length of the string.
+ * @return the hash.
+ */
+uint32_t hashString(const char *key, int length);
 
 /**
  * Allocates a string.
+ * @param vm the virtual machine.
  * @param chars the string.
  * @param length the length of the string.
  * @return the newly allocated string.
  */
-ObjString *takeString(char *chars, int length);
+ObjString *takeString(VM *vm, char *chars, int length);
 
 /**
  * Copies a string onto the heap.
+ * @param vm the virtual machine.
+ * @param chars the string.
+ * @param length the length of the string.
+ * @return the newly allocated string.
+ */
+ObjString *copyString(VM *vm, const char *chars, int length);
+
+/**
+ * Copies a string onto the heap, given the hash of its characters.
+ * @param vm the virtual machine.
  * @param chars the string.
  * @param length the length of the string.
+ * @param hash the hash of the string, as computed by hashString().
  * @return the newly allocated string.
  */
-ObjString *copyString(const char *chars, int length);
+ObjString *copyStringHashed(VM *vm, const char *chars, int length, uint32_t hash);
+
+/**
+ * Makes a string that refers to the given characters instead of copying them,
+ * so they must outlive it. The characters need not be NUL-terminated.
+ * @param vm the virtual machine.
+ * @param chars the string.
+ * @param length the length of the string.
+ * @return the string.
+ */
+ObjString *referenceString(VM *vm, const char *chars, int length);
+
+/**
+ * Makes a string that refers to the given characters, given the hash of the characters.
+ * @param vm the virtual machine.
+ * @param chars the string.
+ * @param length the length of the string.
+ * @param hash the hash of the string, as computed by hashString().
+ * @return the string.
+ */
+ObjString *referenceStringHashed(VM *vm, const char *chars, int length, uint32_t hash);
+
+/**
+ * Concatenates two strings of either kind. Short results are interned strings
+ * and longer ones are builders.
+ * Both strings must be reachable by the garbage collector.
+ * @param vm the virtual machine.
+ * @param a the left string.
+ * @param b the right string.
+ * @return the concatenation.
+ */
+Value concatenateStrings(VM *vm, Value a, Value b);
+
+/**
+ * Compares the characters of two strings of either kind.
+ * @param a the first string.
+ * @param b the second string.
+ * @return whether the strings are equal.
+ */
+bool stringsEqual(Value a, Value b);
 
 /**
  * Creates a new upvalue.
+ * @param vm the virtual machine.
  * @param slot the upvalue's slot.
  * @return the upvalue.
  */
-ObjUpvalue *newUpvalue(Value *slot);
+ObjUpvalue *newUpvalue(VM *vm, Value *slot);
 
 /**
- * Prints an object to stdout.
+ * Writes an object to an output.
+ * @param output the output.
  * @param value the object.
  */
-void printObject(Value value);
+void writeObject(Output *output, Value value);
 
 /**
  * Determines whether the value is of the specified type.
@@ -198,4 +553,22 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/**
+ * Gets the characters of a string of either kind, which need not be NUL-terminated.
+ * @param value the string.
+ * @return the characters.
+ */
+static inline const char *stringChars(Value value) {
+    return IS_BUILDER(value) ? AS_BUILDER(value)->buffer->chars : AS_STRING(value)->chars;
+}
+
+/**
+ * Gets the length of a string of either kind.
+ * @param value the string.
+ * @return the length.
+ */
+static inline int stringLength(Value value) {
+    return IS_BUILDER(value) ? AS_BUILDER(value)->length : AS_STRING(value)->length;
+}
+
 #endif //CLOX_OBJECT_H
@@ -0,0 +1,404 @@
+#include <stdlib.h>
+
+#include "optimizer.h"
+
+/**
+ * A jump written to the optimized code, fixed up once every instruction has moved.
+ */
+typedef struct {
+    /** The offset of the jump instruction in the optimized code. */
+    int offset;
+
+    /** The offset the jump lands on in the original code. */
+    int target;
+} Jump;
+
+/**
+ * The state of a chunk being optimized.
+ */
+typedef struct {
+    Chunk *chunk;
+
+    /** The offset of each instruction's first byte, and chunk->count at the end. */
+    int *starts;
+    int instructionCount;
+
+    /** The number of jumps that land on each offset. */
+    int *jumpsTo;
+
+    /** For each instruction start, the original offset of the instruction before it, or -1. */
+    int *previous;
+
+    /** Instructions removed without being fused into another. */
+    bool *removed;
+
+    /** The optimized code. */
+    uint8_t *code;
+    int count;
+
+    /** The optimized offset of each original offset. */
+    int *moved;
+
+    /** The source line of each optimized byte. */
+    int *lines;
+
+    Jump *jumps;
+    int jumpCount;
+} Optimizer;
+
+/* ===== Static functions ===== */
+
+/**
+ * Reads the 16-bit operand of a jump instruction.
+ * @param code the code.
+ * @param offset the offset of the jump instruction.
+ * @return the operand.
+ */
+static int readJump(uint8_t *code, int offset) {
+    return (code[offset + 1] << 8) | code[offset + 2];
+}
+
+/**
+ * Gets the offset a jump instruction lands on.
+ * @param chunk the chunk.
+ * @param offset the offset of the jump instruction.
+ * @return the offset, or -1 if the instruction does not jump.
+ */
+static int jumpTarget(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return offset + 3 + readJump(chunk->code, offset);
+        case OP_LOOP:
+            return offset + 3 - readJump(chunk->code, offset);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Decodes the instruction boundaries of the chunk and counts the jumps landing on each offset.
+ * @param optimizer the optimizer.
+ */
+static void findInstructions(Optimizer *optimizer) {
+    Chunk *chunk = optimizer->chunk;
+    int previous = -1;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        optimizer->starts[optimizer->instructionCount++] = offset;
+        optimizer->previous[offset] = previous;
+        previous = offset;
+
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0) optimizer->jumpsTo[target]++;
+    }
+    optimizer->starts[optimizer->instructionCount] = chunk->count;
+}
+
+/**
+ * Determines whether the instructions after the first of a sequence can be fused into it.
+ * No jump may land inside the sequence.
+ * @param optimizer the optimizer.
+ * @param index the index of the first instruction.
+ * @param length the number of instructions.
+ * @return whether the sequence can be fused.
+ */
+static bool canFuse(Optimizer *optimizer, int index, int length) {
+    if (index + length > optimizer->instructionCount) return false;
+    for (int i = index + 1; i < index + length; i++) {
+        if (optimizer->jumpsTo[optimizer->starts[i]] > 0) return false;
+    }
+    return true;
+}
+
+/**
+ * Gets the opcode of an instruction.
+ * @param optimizer the optimizer.
+ * @param index the index of the instruction.
+ * @return the opcode.
+ */
+static uint8_t opcodeAt(Optimizer *optimizer, int index) {
+    return optimizer->chunk->code[optimizer->starts[index]];
+}
+
+/**
+ * Gets an operand byte of an instruction.
+ * @param optimizer the optimizer.
+ * @param index the index of the instruction.
+ * @param operand the operand byte, counting from 1.
+ * @return the byte.
+ */
+static uint8_t operandAt(Optimizer *optimizer, int index, int operand) {
+    return optimizer->chunk->code[optimizer->starts[index] + operand];
+}
+
+/**
+ * Appends a byte to the optimized code.
+ * @param optimizer the optimizer.
+ * @param byte the byte.
+ * @param line the source line of the byte.
+ */
+static void emitByte(Optimizer *optimizer, uint8_t byte, int line) {
+    optimizer->lines[optimizer->count] = line;
+    optimizer->code[optimizer->count++] = byte;
+}
+
+/**
+ * Appends a jump instruction to the optimized code, to be fixed up later.
+ * @param optimizer the optimizer.
+ * @param instruction the jump instruction.
+ * @param target the offset the jump lands on in the original code.
+ * @param line the source line of the jump.
+ */
+static void emitJump(Optimizer *optimizer, uint8_t instruction, int target, int line) {
+    Jump *jump = &optimizer->jumps[optimizer->jumpCount++];
+    jump->offset = optimizer->count;
+    jump->target = target;
+
+    emitByte(optimizer, instruction, line);
+    emitByte(optimizer, 0xff, line);
+    emitByte(optimizer, 0xff, line);
+}
+
+/**
+ * Fuses a local variable update like i = i + 1; into OP_ADD_LOCAL_CONSTANT.
+ * @param optimizer the optimizer.
+ * @param index the index of the first instruction.
+ * @param line the source line of the first instruction.
+ * @return the number of instructions fused, or zero if the sequence does not match.
+ */
+static int fuseAddLocalConstant(Optimizer *optimizer, int index, int line) {
+    if (!canFuse(optimizer, index, 5) ||
+        opcodeAt(optimizer, index + 1) != OP_CONSTANT ||
+        opcodeAt(optimizer, index + 2) != OP_ADD ||
+        opcodeAt(optimizer, index + 3) != OP_SET_LOCAL ||
+        opcodeAt(optimizer, index + 4) != OP_POP ||
+        operandAt(optimizer, index, 1) != operandAt(optimizer, index + 3, 1)) {
+        return 0;
+    }
+
+    emitByte(optimizer, OP_ADD_LOCAL_CONSTANT, line);
+    emitByte(optimizer, operandAt(optimizer, index, 1), line);
+    emitByte(optimizer, operandAt(optimizer, index + 1, 1), line);
+    return 5;
+}
+
+/**
+ * Gets the register instruction that computes an arithmetic instruction from two locals.
+ * @param instruction the arithmetic instruction.
+ * @param storesResult whether the result is stored in a local rather than pushed.
+ * @return the register instruction, or OP_RETURN if the instruction has none.
+ */
+static uint8_t registerInstruction(uint8_t instruction, bool storesResult) {
+    switch (instruction) {
+        case OP_ADD: return storesResult ? OP_ADD_REGISTERS : OP_ADD_LOCALS;
+        case OP_SUBTRACT: return storesResult ? OP_SUBTRACT_REGISTERS : OP_SUBTRACT_LOCALS;
+        case OP_MULTIPLY: return storesResult ? OP_MULTIPLY_REGISTERS : OP_MULTIPLY_LOCALS;
+        case OP_DIVIDE: return storesResult ? OP_DIVIDE_REGISTERS : OP_DIVIDE_LOCALS;
+        default: return OP_RETURN;
+    }
+}
+
+/**
+ * Fuses arithmetic on two local variables into a register instruction that reads
+ * their slots directly. An assignment like c = a + b; becomes a single three-address
+ * instruction that never touches the stack; otherwise the result is pushed.
+ * @param optimizer the optimizer.
+ * @param index the index of the first instruction.
+ * @param line the source line of the first instruction.
+ * @return the number of instructions fused, or zero if the sequence does not match.
+ */
+static int fuseRegisters(Optimizer *optimizer, int index, int line) {
+    if (!canFuse(optimizer, index, 3) || opcodeAt(optimizer, index + 1) != OP_GET_LOCAL) return 0;
+
+    bool storesResult = canFuse(optimizer, index, 5) &&
+                        opcodeAt(optimizer, index + 3) == OP_SET_LOCAL &&
+                        opcodeAt(optimizer, index + 4) == OP_POP;
+    uint8_t instruction = registerInstruction(opcodeAt(optimizer, index + 2), storesResult);
+    if (instruction == OP_RETURN) return 0;
+
+    emitByte(optimizer, instruction, line);
+    if (storesResult) emitByte(optimizer, operandAt(optimizer, index + 3, 1), line);
+    emitByte(optimizer, operandAt(optimizer, index, 1), line);
+    emitByte(optimizer, operandAt(optimizer, index + 1, 1), line);
+    return storesResult ? 5 : 3;
+}
+
+/**
+ * Fuses a local variable and a property access like this.x into OP_GET_LOCAL_PROPERTY.
+ * @param optimizer the optimizer.
+ * @param index the index of the first instruction.
+ * @param line the source line of the first instruction.
+ * @return the number of instructions fused, or zero if the sequence does not match.
+ */
+static int fuseGetLocalProperty(Optimizer *optimizer, int index, int line) {
+    if (!canFuse(optimizer, index, 2) || opcodeAt(optimizer, index + 1) != OP_GET_PROPERTY) return 0;
+
+    emitByte(optimizer, OP_GET_LOCAL_PROPERTY, line);
+    emitByte(optimizer, operandAt(optimizer, index, 1), line);
+    for (int operand = 1; operand <= 3; operand++) {
+        emitByte(optimizer, operandAt(optimizer, index + 1, operand), line);
+    }
+    return 2;
+}
+
+/**
+ * Fuses a comparison used as a condition into a compare-and-jump instruction.
+ *
+ * The condition of an if, while or for statement is left on the stack by
+ * OP_JUMP_IF_FALSE and popped on both paths. The fused instruction pops it
+ * itself, so the OP_POP the jump lands on is removed too. That is only possible
+ * when nothing else reaches that OP_POP: no other jump lands on it and it
+ * cannot be fallen into from the instruction before it.
+ *
+ * @param optimizer the optimizer.
+ * @param index the index of the comparison.
+ * @param line the source line of the comparison.
+ * @return the number of instructions fused, or zero if the sequence does not match.
+ */
+static int fuseCompareJump(Optimizer *optimizer, int index, int line) {
+    uint8_t instruction;
+    switch (opcodeAt(optimizer, index)) {
+        case OP_LESS: instruction = OP_JUMP_IF_NOT_LESS; break;
+        case OP_GREATER: instruction = OP_JUMP_IF_NOT_GREATER; break;
+        case OP_EQUAL: instruction = OP_JUMP_IF_NOT_EQUAL; break;
+        default: return 0;
+    }
+
+    if (!canFuse(optimizer, index, 3) ||
+        opcodeAt(optimizer, index + 1) != OP_JUMP_IF_FALSE ||
+        opcodeAt(optimizer, index + 2) != OP_POP) {
+        return 0;
+    }
+
+    Chunk *chunk = optimizer->chunk;
+    int target = jumpTarget(chunk, optimizer->starts[index + 1]);
+    if (target >= chunk->count || chunk->code[target] != OP_POP || optimizer->jumpsTo[target] != 1) return 0;
+
+    int before = optimizer->previous[target];
+    if (before < 0 || (chunk->code[before] != OP_JUMP && chunk->code[before] != OP_LOOP)) return 0;
+
+    optimizer->removed[target] = true;
+    emitJump(optimizer, instruction, target + 1, line);
+    return 3;
+}
+
+/**
+ * Rewrites the line table from the line of each optimized byte.
+ * @param optimizer the optimizer.
+ */
+static void rewriteLines(Optimizer *optimizer) {
+    Chunk *chunk = optimizer->chunk;
+    chunk->lineCount = 0;
+    for (int offset = 0; offset < optimizer->count; offset++) {
+        int line = optimizer->lines[offset];
+        if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) continue;
+
+        LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+        lineStart->offset = offset;
+        lineStart->line = line;
+    }
+}
+
+/**
+ * Points every jump in the optimized code at the new offset of its target.
+ * @param optimizer the optimizer.
+ */
+static void patchJumps(Optimizer *optimizer) {
+    for (int i = 0; i < optimizer->jumpCount; i++) {
+        Jump *jump = &optimizer->jumps[i];
+        int from = jump->offset + 3;
+        int to = optimizer->moved[jump->target];
+        int distance = optimizer->code[jump->offset] == OP_LOOP ? from - to : to - from;
+
+        optimizer->code[jump->offset + 1] = (distance >> 8) & 0xff;
+        optimizer->code[jump->offset + 2] = distance & 0xff;
+    }
+}
+
+/* ===== End static functions ===== */
+
+void optimizeChunk(Chunk *chunk) {
+    if (chunk->count == 0) return;
+
+    Optimizer optimizer;
+    optimizer.chunk = chunk;
+    optimizer.starts = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    optimizer.instructionCount = 0;
+    optimizer.jumpsTo = (int*)calloc(chunk->count + 1, sizeof(int));
+    optimizer.previous = (int*)malloc(sizeof(int) * chunk->count);
+    optimizer.removed = (bool*)calloc(chunk->count, sizeof(bool));
+    optimizer.code = (uint8_t*)malloc(chunk->count);
+    optimizer.count = 0;
+    optimizer.moved = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    optimizer.lines = (int*)malloc(sizeof(int) * chunk->count);
+    optimizer.jumps = (Jump*)malloc(sizeof(Jump) * chunk->count);
+    optimizer.jumpCount = 0;
+    if (optimizer.starts == NULL || optimizer.jumpsTo == NULL || optimizer.previous == NULL ||
+        optimizer.removed == NULL || optimizer.code == NULL || optimizer.moved == NULL ||
+        optimizer.lines == NULL || optimizer.jumps == NULL) {
+        exit(1);
+    }
+
+    findInstructions(&optimizer);
+
+    // Jumps only ever land on instruction starts, so moved[] is only read there.
+    for (int index = 0; index < optimizer.instructionCount;) {
+        int offset = optimizer.starts[index];
+        int line = getLine(chunk, offset);
+        optimizer.moved[offset] = optimizer.count;
+
+        if (optimizer.removed[offset]) {
+            index++;
+            continue;
+        }
+
+        int fused = 0;
+        switch (chunk->code[offset]) {
+            case OP_GET_LOCAL:
+                fused = fuseAddLocalConstant(&optimizer, index, line);
+                if (fused == 0) fused = fuseRegisters(&optimizer, index, line);
+                if (fused == 0) fused = fuseGetLocalProperty(&optimizer, index, line);
+                break;
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_EQUAL:
+                fused = fuseCompareJump(&optimizer, index, line);
+                break;
+            default:
+                break;
+        }
+
+        if (fused > 0) {
+            index += fused;
+            continue;
+        }
+
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0) {
+            emitJump(&optimizer, chunk->code[offset], target, line);
+        } else {
+            int length = instructionLength(chunk, offset);
+            for (int i = 0; i < length; i++) {
+                emitByte(&optimizer, chunk->code[offset + i], getLine(chunk, offset + i));
+            }
+        }
+        index++;
+    }
+    optimizer.moved[chunk->count] = optimizer.count;
+
+    patchJumps(&optimizer);
+    rewriteLines(&optimizer);
+    for (int i = 0; i < optimizer.count; i++) {
+        chunk->code[i] = optimizer.code[i];
+    }
+    chunk->count = optimizer.count;
+
+    free(optimizer.starts);
+    free(optimizer.jumpsTo);
+    free(optimizer.previous);
+    free(optimizer.removed);
+    free(optimizer.code);
+    free(optimizer.moved);
+    free(optimizer.lines);
+    free(optimizer.jumps);
+}
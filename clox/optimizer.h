@@ -0,0 +1,13 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+
+/**
+ * Rewrites a finished chunk in place, fusing common instruction sequences into
+ * superinstructions. Jump offsets and the line table are adjusted to match.
+ * @param chunk the chunk.
+ */
+void optimizeChunk(Chunk *chunk);
+
+#endif //CLOX_OPTIMIZER_H
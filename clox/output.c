@@ -0,0 +1,109 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+void initOutput(Output *output, WriteFn write, void *context, size_t capacity) {
+    output->write = write;
+    output->context = context;
+    output->buffer = NULL;
+    output->length = 0;
+    output->capacity = capacity;
+
+    if (capacity > 0) {
+        output->buffer = (char*)malloc(capacity);
+        if (output->buffer == NULL) exit(1);
+    }
+}
+
+void freeOutput(Output *output) {
+    flushOutput(output);
+    free(output->buffer);
+    output->buffer = NULL;
+    output->capacity = 0;
+}
+
+void flushOutput(Output *output) {
+    if (output->length == 0) return;
+    output->write(output->context, output->buffer, output->length);
+    output->length = 0;
+}
+
+void writeOutput(Output *output, const char *chars, size_t length) {
+    if (length == 0) return;
+    if (output->length + length > output->capacity) {
+        flushOutput(output);
+
+        // Text that would not fit in an empty buffer skips it.
+        if (length > output->capacity) {
+            output->write(output->context, chars, length);
+            return;
+        }
+    }
+
+    memcpy(output->buffer + output->length, chars, length);
+    output->length += length;
+}
+
+void writeFormatted(Output *output, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    writeFormattedList(output, format, args);
+    va_end(args);
+}
+
+void writeFormattedList(Output *output, const char *format, va_list args) {
+    char small[256];
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(small, sizeof(small), format, copy);
+    va_end(copy);
+    if (length < 0) return;
+
+    if ((size_t)length < sizeof(small)) {
+        writeOutput(output, small, (size_t)length);
+        return;
+    }
+
+    char *large = (char*)malloc((size_t)length + 1);
+    if (large == NULL) exit(1);
+    vsnprintf(large, (size_t)length + 1, format, args);
+    writeOutput(output, large, (size_t)length);
+    free(large);
+}
+
+void writeNumber(Output *output, double number) {
+    char text[NUMBER_BUFFER_SIZE];
+    int length = formatNumber(number, text);
+    writeOutput(output, text, (size_t)length);
+}
+
+int formatNumber(double number, char *buffer) {
+    // %g prints integers of up to six digits exactly, and they are most of what scripts print.
+    if (number > -1e6 && number < 1e6 && number == (double)(int)number && !(number == 0 && signbit(number))) {
+        char digits[8];
+        int value = (int)number;
+        unsigned magnitude = value < 0 ? (unsigned)-value : (unsigned)value;
+        int count = 0;
+        do {
+            digits[count++] = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+
+        int length = 0;
+        if (value < 0) buffer[length++] = '-';
+        while (count > 0) buffer[length++] = digits[--count];
+        buffer[length] = '\0';
+        return length;
+    }
+
+    return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+}
+
+void writeFile(void *context, const char *chars, size_t length) {
+    // The text is already buffered, and flushing keeps stdout and stderr in order.
+    fwrite(chars, 1, length, (FILE*)context);
+    fflush((FILE*)context);
+}
@@ -0,0 +1,104 @@
+#ifndef CLOX_OUTPUT_H
+#define CLOX_OUTPUT_H
+
+#include <stdarg.h>
+
+#include "common.h"
+
+/** The size of the buffer of a VM's output, in bytes. */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/** The longest text formatNumber() produces, including the terminator. */
+#define NUMBER_BUFFER_SIZE 32
+
+/**
+ * Receives text written to an output.
+ * @param context the context the output was set up with.
+ * @param chars the text, which is not terminated.
+ * @param length the length of the text.
+ */
+typedef void (*WriteFn)(void *context, const char *chars, size_t length);
+
+/**
+ * A sink for text, such as what a script prints. Text is gathered in a buffer
+ * and handed to the write function when the buffer fills or is flushed.
+ */
+typedef struct {
+    WriteFn write;
+    void *context;
+
+    /** Text not yet handed to the write function, or NULL if the output is unbuffered. */
+    char *buffer;
+    size_t length;
+    size_t capacity;
+} Output;
+
+/**
+ * Sets up an output.
+ * @param output the output.
+ * @param write the write function.
+ * @param context the context passed to the write function.
+ * @param capacity the size of the buffer, or 0 to hand every write straight to the write function.
+ */
+void initOutput(Output *output, WriteFn write, void *context, size_t capacity);
+
+/**
+ * Flushes an output and frees its buffer.
+ * @param output the output.
+ */
+void freeOutput(Output *output);
+
+/**
+ * Hands the buffered text of an output to its write function.
+ * @param output the output.
+ */
+void flushOutput(Output *output);
+
+/**
+ * Writes text to an output.
+ * @param output the output.
+ * @param chars the text.
+ * @param length the length of the text.
+ */
+void writeOutput(Output *output, const char *chars, size_t length);
+
+/**
+ * Writes text to an output as printf() would.
+ * @param output the output.
+ * @param format the format.
+ * @param ... the values to format.
+ */
+void writeFormatted(Output *output, const char *format, ...);
+
+/**
+ * Writes text to an output as vprintf() would.
+ * @param output the output.
+ * @param format the format.
+ * @param args the values to format.
+ */
+void writeFormattedList(Output *output, const char *format, va_list args);
+
+/**
+ * Writes a number to an output as printf("%g") would.
+ * @param output the output.
+ * @param number the number.
+ */
+void writeNumber(Output *output, double number);
+
+/**
+ * Formats a number as printf("%g") would, without calling it for small integers.
+ * @param number the number.
+ * @param buffer set to the text, at least NUMBER_BUFFER_SIZE bytes.
+ * @return the length of the text.
+ */
+int formatNumber(double number, char *buffer);
+
+/**
+ * A write function that writes to a file and flushes it.
+ * @param context the FILE* to write to.
+ * @param chars the text.
+ * @param length the length of the text.
+ */
+void writeFile(void *context, const char *chars, size_t length);
+
+#endif //CLOX_OUTPUT_H
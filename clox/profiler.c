@@ -0,0 +1,263 @@
+// clock_gettime() is hidden by a strict -std=c99.
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "object.h"
+#include "profiler.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PROFILE_TSC
+/** About a millisecond of cycles. */
+#define PROFILE_SAMPLE_INTERVAL 2000000
+#else
+#include <time.h>
+/** A millisecond of nanoseconds. */
+#define PROFILE_SAMPLE_INTERVAL 1000000
+#endif
+
+/** The maximum load factor of the sample table. */
+#define SAMPLES_MAX_LOAD 0.75
+
+/* ===== Static functions ===== */
+
+/**
+ * Reads the current tick.
+ * @return the tick.
+ */
+static uint64_t readTicks() {
+#if defined(PROFILE_TSC)
+    return __rdtsc();
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#else
+    return (uint64_t)((double)clock() * (1000000000.0 / CLOCKS_PER_SEC));
+#endif
+}
+
+/**
+ * Hashes a folded stack using 32-bit FNV-1a.
+ * @param stack the folded stack.
+ * @param length the length of the folded stack.
+ * @return the hash.
+ */
+static uint32_t hashStack(const char *stack, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)stack[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/**
+ * Finds the entry of a folded stack in the sample table, or the empty entry it would occupy.
+ * @param samples the entries.
+ * @param capacity the number of entries, a power of two.
+ * @param stack the folded stack.
+ * @param length the length of the folded stack.
+ * @return the entry.
+ */
+static ProfileSample *findSample(ProfileSample *samples, int capacity, const char *stack, size_t length) {
+    uint32_t index = hashStack(stack, length) & (capacity - 1);
+    for (;;) {
+        ProfileSample *sample = &samples[index];
+        if (sample->stack == NULL ||
+            (strncmp(sample->stack, stack, length) == 0 && sample->stack[length] == '\0')) {
+            return sample;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+/**
+ * Doubles the capacity of the sample table.
+ * @param profiler the profiler.
+ */
+static void growSamples(Profiler *profiler) {
+    int capacity = profiler->sampleCapacity < 64 ? 64 : profiler->sampleCapacity * 2;
+    ProfileSample *samples = (ProfileSample*)calloc(capacity, sizeof(ProfileSample));
+    if (samples == NULL) exit(1);
+
+    for (int i = 0; i < profiler->sampleCapacity; i++) {
+        ProfileSample *sample = &profiler->samples[i];
+        if (sample->stack == NULL) continue;
+        *findSample(samples, capacity, sample->stack, strlen(sample->stack)) = *sample;
+    }
+
+    free(profiler->samples);
+    profiler->samples = samples;
+    profiler->sampleCapacity = capacity;
+}
+
+/**
+ * Appends text to a growing buffer.
+ * @param buffer the buffer, reallocated as needed.
+ * @param length the length of the text in the buffer.
+ * @param capacity the capacity of the buffer.
+ * @param text the text.
+ * @param textLength the length of the text.
+ */
+static void append(char **buffer, size_t *length, size_t *capacity, const char *text, size_t textLength) {
+    if (*length + textLength + 1 > *capacity) {
+        while (*length + textLength + 1 > *capacity) {
+            *capacity = *capacity < 256 ? 256 : *capacity * 2;
+        }
+        *buffer = (char*)realloc(*buffer, *capacity);
+        if (*buffer == NULL) exit(1);
+    }
+    memcpy(*buffer + *length, text, textLength);
+    *length += textLength;
+    (*buffer)[*length] = '\0';
+}
+
+/**
+ * Records the current call stack of the VM as one sample.
+ * @param vm the virtual machine.
+ */
+static void sampleStack(VM *vm) {
+    Profiler *profiler = vm->profiler;
+    char *stack = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame *frame = &vm->frames[i];
+        ObjFunction *function = frame->closure->function;
+        int line = getLine(&function->chunk, (int)(frame->ip - function->chunk.code - 1));
+
+        char frameText[32];
+        if (i > 0) append(&stack, &length, &capacity, ";", 1);
+        if (function->name == NULL) {
+            append(&stack, &length, &capacity, "script", 6);
+        } else {
+            append(&stack, &length, &capacity, function->name->chars, function->name->length);
+        }
+        int frameLength = snprintf(frameText, sizeof(frameText), ":%d", line);
+        append(&stack, &length, &capacity, frameText, frameLength);
+    }
+    if (stack == NULL) return;
+
+    if (profiler->sampleCount + 1 > profiler->sampleCapacity * SAMPLES_MAX_LOAD) {
+        growSamples(profiler);
+    }
+
+    ProfileSample *sample = findSample(profiler->samples, profiler->sampleCapacity, stack, length);
+    if (sample->stack == NULL) {
+        sample->stack = stack;
+        profiler->sampleCount++;
+    } else {
+        free(stack);
+    }
+    sample->count++;
+}
+
+/**
+ * Orders opcodes by the ticks spent in them, most first.
+ * @param profiler the profiler whose ticks are compared.
+ * @param a the first opcode.
+ * @param b the second opcode.
+ * @return a negative number if the first opcode comes first, positive if it comes second.
+ */
+static int compareTicks(const Profiler *profiler, int a, int b) {
+    if (profiler->ticks[a] != profiler->ticks[b]) return profiler->ticks[a] > profiler->ticks[b] ? -1 : 1;
+    return a - b;
+}
+
+/* ===== End static functions ===== */
+
+void startProfiler(VM *vm) {
+    stopProfiler(vm);
+
+    Profiler *profiler = (Profiler*)malloc(sizeof(Profiler));
+    if (profiler == NULL) exit(1);
+
+    memset(profiler->counts, 0, sizeof(profiler->counts));
+    memset(profiler->ticks, 0, sizeof(profiler->ticks));
+    profiler->instruction = -1;
+    profiler->dispatchTick = 0;
+    profiler->sampleInterval = PROFILE_SAMPLE_INTERVAL;
+    profiler->nextSample = readTicks() + profiler->sampleInterval;
+    profiler->samples = NULL;
+    profiler->sampleCount = 0;
+    profiler->sampleCapacity = 0;
+    vm->profiler = profiler;
+}
+
+void stopProfiler(VM *vm) {
+    Profiler *profiler = vm->profiler;
+    if (profiler == NULL) return;
+
+    for (int i = 0; i < profiler->sampleCapacity; i++) {
+        free(profiler->samples[i].stack);
+    }
+    free(profiler->samples);
+    free(profiler);
+    vm->profiler = NULL;
+}
+
+void profileInstruction(VM *vm, uint8_t instruction) {
+    Profiler *profiler = vm->profiler;
+    uint64_t now = readTicks();
+
+    if (profiler->instruction >= 0) {
+        profiler->ticks[profiler->instruction] += now - profiler->dispatchTick;
+    }
+    profiler->counts[instruction]++;
+    profiler->instruction = instruction;
+
+    if (now >= profiler->nextSample) {
+        sampleStack(vm);
+        profiler->nextSample = now + profiler->sampleInterval;
+        now = readTicks();
+    }
+
+    // Starting the clock after sampling keeps the sampler's own cost out of the opcode totals.
+    profiler->dispatchTick = now;
+}
+
+void writeOpcodeProfile(VM *vm, FILE *file) {
+    Profiler *profiler = vm->profiler;
+    if (profiler == NULL) return;
+
+    int order[OPCODE_COUNT];
+    int count = 0;
+    uint64_t totalTicks = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        if (profiler->counts[i] == 0) continue;
+        totalTicks += profiler->ticks[i];
+
+        // Insertion sort: there are only a few dozen opcodes.
+        int j = count++;
+        while (j > 0 && compareTicks(profiler, i, order[j - 1]) < 0) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    fprintf(file, "%-24s %14s %16s %10s %7s\n", "opcode", "count", "ticks", "ticks/op", "%");
+    for (int i = 0; i < count; i++) {
+        int op = order[i];
+        fprintf(file, "%-24s %14llu %16llu %10.1f %6.2f%%\n", opcodeName((uint8_t)op),
+                (unsigned long long)profiler->counts[op], (unsigned long long)profiler->ticks[op],
+                (double)profiler->ticks[op] / (double)profiler->counts[op],
+                totalTicks == 0 ? 0.0 : 100.0 * (double)profiler->ticks[op] / (double)totalTicks);
+    }
+}
+
+void writeFoldedStacks(VM *vm, FILE *file) {
+    Profiler *profiler = vm->profiler;
+    if (profiler == NULL) return;
+
+    for (int i = 0; i < profiler->sampleCapacity; i++) {
+        ProfileSample *sample = &profiler->samples[i];
+        if (sample->stack == NULL) continue;
+        fprintf(file, "%s %llu\n", sample->stack, (unsigned long long)sample->count);
+    }
+}
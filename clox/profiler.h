@@ -0,0 +1,91 @@
+#ifndef CLOX_PROFILER_H
+#define CLOX_PROFILER_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+/** The file name suffix of the per-opcode profile written by the command line. */
+#define PROFILE_OPCODES_SUFFIX ".opcodes"
+
+/** The file name suffix of the folded stacks written by the command line. */
+#define PROFILE_STACKS_SUFFIX ".folded"
+
+/**
+ * The number of times a folded stack was sampled.
+ */
+typedef struct {
+    /** The frames from the script down, separated by semicolons, or NULL for an empty entry. */
+    char *stack;
+    uint64_t count;
+} ProfileSample;
+
+/**
+ * The state of a VM's profiler.
+ *
+ * Time is measured in ticks: CPU cycles where the time stamp counter can be read,
+ * nanoseconds elsewhere. The ticks of an instruction run from its dispatch to the
+ * next dispatch, so they include any native function it called and the cost of
+ * profiling itself.
+ */
+typedef struct Profiler {
+    /** The number of times each opcode was dispatched. */
+    uint64_t counts[OPCODE_COUNT];
+    /** The ticks spent in each opcode. */
+    uint64_t ticks[OPCODE_COUNT];
+
+    /** The opcode being timed, or -1 before the first dispatch. */
+    int instruction;
+    /** The tick the opcode being timed was dispatched at. */
+    uint64_t dispatchTick;
+
+    /** The ticks between stack samples. Hosts may tune this. */
+    uint64_t sampleInterval;
+    /** The tick at which the next stack is sampled. */
+    uint64_t nextSample;
+
+    /** A hash table from folded stack to sample count, with open addressing. */
+    ProfileSample *samples;
+    int sampleCount;
+    int sampleCapacity;
+} Profiler;
+
+/**
+ * Starts profiling a VM, discarding any earlier profile.
+ * Takes effect from the next call to interpret() or interpretFunction().
+ * @param vm the virtual machine.
+ */
+void startProfiler(VM *vm);
+
+/**
+ * Stops profiling a VM and frees its profile.
+ * @param vm the virtual machine.
+ */
+void stopProfiler(VM *vm);
+
+/**
+ * Records the dispatch of an instruction, sampling the call stack when the sample interval has passed.
+ * The instruction pointer of the current frame must be stored, pointing just past the opcode.
+ * @param vm the virtual machine.
+ * @param instruction the opcode being dispatched.
+ */
+void profileInstruction(VM *vm, uint8_t instruction);
+
+/**
+ * Writes the count and ticks of every opcode that ran, most expensive first.
+ * @param vm the virtual machine.
+ * @param file the file.
+ */
+void writeOpcodeProfile(VM *vm, FILE *file);
+
+/**
+ * Writes the sampled call stacks in the folded format read by flame graph tools:
+ * one line per distinct stack, its frames as function:line separated by semicolons,
+ * followed by a space and the number of samples.
+ * @param vm the virtual machine.
+ * @param file the file.
+ */
+void writeFoldedStacks(VM *vm, FILE *file);
+
+#endif //CLOX_PROFILER_H
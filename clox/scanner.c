@@ -4,121 +4,136 @@
 #include "common.h"
 #include "scanner.h"
 
-/**
- * The Lox scanner.
- */
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
-Scanner scanner;
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCANNER_SSE2
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCANNER_NEON
+#endif
+
+/** The number of characters a vector search compares at once. */
+#define BLOCK_SIZE 16
+
+/** The FNV-1a offset basis and prime, as used by hashString(). */
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619
+
+/** The character classes. */
+#define CHAR_BLANK 0x1
+#define CHAR_DIGIT 0x2
+#define CHAR_ALPHA 0x4
+
+/** The classes of each character: whitespace other than newlines, digits, and letters or underscores. */
+static const uint8_t charClass[UINT8_COUNT] = {
+    [' '] = CHAR_BLANK, ['\t'] = CHAR_BLANK, ['\r'] = CHAR_BLANK,
+    ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT, ['3'] = CHAR_DIGIT, ['4'] = CHAR_DIGIT,
+    ['5'] = CHAR_DIGIT, ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT, ['8'] = CHAR_DIGIT, ['9'] = CHAR_DIGIT,
+    ['a'] = CHAR_ALPHA, ['b'] = CHAR_ALPHA, ['c'] = CHAR_ALPHA, ['d'] = CHAR_ALPHA, ['e'] = CHAR_ALPHA, ['f'] = CHAR_ALPHA, ['g'] = CHAR_ALPHA,
+    ['h'] = CHAR_ALPHA, ['i'] = CHAR_ALPHA, ['j'] = CHAR_ALPHA, ['k'] = CHAR_ALPHA, ['l'] = CHAR_ALPHA, ['m'] = CHAR_ALPHA, ['n'] = CHAR_ALPHA,
+    ['o'] = CHAR_ALPHA, ['p'] = CHAR_ALPHA, ['q'] = CHAR_ALPHA, ['r'] = CHAR_ALPHA, ['s'] = CHAR_ALPHA, ['t'] = CHAR_ALPHA, ['u'] = CHAR_ALPHA,
+    ['v'] = CHAR_ALPHA, ['w'] = CHAR_ALPHA, ['x'] = CHAR_ALPHA, ['y'] = CHAR_ALPHA, ['z'] = CHAR_ALPHA,
+    ['A'] = CHAR_ALPHA, ['B'] = CHAR_ALPHA, ['C'] = CHAR_ALPHA, ['D'] = CHAR_ALPHA, ['E'] = CHAR_ALPHA, ['F'] = CHAR_ALPHA, ['G'] = CHAR_ALPHA,
+    ['H'] = CHAR_ALPHA, ['I'] = CHAR_ALPHA, ['J'] = CHAR_ALPHA, ['K'] = CHAR_ALPHA, ['L'] = CHAR_ALPHA, ['M'] = CHAR_ALPHA, ['N'] = CHAR_ALPHA,
+    ['O'] = CHAR_ALPHA, ['P'] = CHAR_ALPHA, ['Q'] = CHAR_ALPHA, ['R'] = CHAR_ALPHA, ['S'] = CHAR_ALPHA, ['T'] = CHAR_ALPHA, ['U'] = CHAR_ALPHA,
+    ['V'] = CHAR_ALPHA, ['W'] = CHAR_ALPHA, ['X'] = CHAR_ALPHA, ['Y'] = CHAR_ALPHA, ['Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA
+};
 
 /* ===== Static functions ===== */
 
 /**
  * Determines if the scanner has reached the end of the program.
+ * @param scanner the scanner.
  * @return if the scanner is at the end.
  */
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner *scanner) {
+    return *scanner->current == '\0';
 }
 
 /**
  * Consumes the next character and returns it.
+ * @param scanner the scanner.
  * @return the next character.
  */
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner *scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
 /**
  * Returns the next character without consuming it.
+ * @param scanner the scanner.
  * @return the next character.
  */
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner *scanner) {
+    return *scanner->current;
 }
 
 /**
  * Returns the character two positions ahead without consuming it.
+ * @param scanner the scanner.
  * @return the character two positions ahead.
  */
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner *scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
 }
 
 /**
  * Checks if the next character matches the expected character.
  * If it does, the character is consumed, and the function returns true.
+ * @param scanner the scanner.
  * @param expected the expected character.
  * @return if the next character matches the expected character.
  */
-static bool match(char expected) {
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner *scanner, char expected) {
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
 /**
  * Makes a new token from the specified token type.
+ * @param scanner the scanner.
  * @param type the new token type.
  * @return the token.
  */
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner *scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
+    token.hash = 0;
     return token;
 }
 
 /**
  * Creates a new error token with the given message.
+ * @param scanner the scanner.
  * @param message the error message.
  * @return the token.
  */
-static Token errorToken(const char *message) {
+static Token errorToken(Scanner *scanner, const char *message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
+    token.hash = 0;
     return token;
 }
 
 /**
- * Skips whitespace and comments.
+ * Determines whether the given character has any of the given classes.
+ * @param c the character.
+ * @param classes the classes.
+ * @return if the character has any of the classes.
  */
-static void skipWhitespace() {
-    for (;;) {
-        char c = peek();
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance();
-                break;
-            case '\n':
-                scanner.line++;
-                advance();
-                break;
-            case '/':
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd()) advance();
-                } else {
-                    return;
-                }
-                break;
-            default:
-                return;
-        }
-    }
+static bool hasClass(char c, uint8_t classes) {
+    return (charClass[(uint8_t)c] & classes) != 0;
 }
 
 /**
@@ -127,7 +142,7 @@ static void skipWhitespace() {
  * @return if the character is a digit.
  */
 static bool isDigit(char c) {
-    return c >= '0' & c <= '9';
+    return hasClass(c, CHAR_DIGIT);
 }
 
 /**
@@ -136,22 +151,134 @@ static bool isDigit(char c) {
  * @return if the character is alphanumeric.
  */
 static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-            c == '_';
+    return hasClass(c, CHAR_ALPHA);
+}
+
+#if defined(SCANNER_SSE2)
+
+/** The number of bits a block mask has for each character, and a mask with every character set. */
+#define MASK_BITS 1
+#define MASK_ALL 0xffffu
+
+/**
+ * Compares a block of characters with three characters.
+ * @param chars the block, which must be BLOCK_SIZE characters long.
+ * @param a the first character.
+ * @param b the second character.
+ * @param c the third character.
+ * @return a mask with the bits of every character equal to one of the three set, MASK_BITS bits per character.
+ */
+static uint64_t matchBlock(const char *chars, char a, char b, char c) {
+    __m128i block = _mm_loadu_si128((const __m128i*)chars);
+    __m128i matches = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(a)),
+                                                _mm_cmpeq_epi8(block, _mm_set1_epi8(b))),
+                                   _mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+    return (uint64_t)_mm_movemask_epi8(matches);
+}
+
+#elif defined(SCANNER_NEON)
+
+#define MASK_BITS 4
+#define MASK_ALL UINT64_MAX
+
+/**
+ * Compares a block of characters with three characters.
+ * @param chars the block, which must be BLOCK_SIZE characters long.
+ * @param a the first character.
+ * @param b the second character.
+ * @param c the third character.
+ * @return a mask with the bits of every character equal to one of the three set, MASK_BITS bits per character.
+ */
+static uint64_t matchBlock(const char *chars, char a, char b, char c) {
+    uint8x16_t block = vld1q_u8((const uint8_t*)chars);
+    uint8x16_t matches = vorrq_u8(vorrq_u8(vceqq_u8(block, vdupq_n_u8((uint8_t)a)),
+                                           vceqq_u8(block, vdupq_n_u8((uint8_t)b))),
+                                  vceqq_u8(block, vdupq_n_u8((uint8_t)c)));
+    // NEON has no movemask: narrowing each 16-bit lane by 4 leaves a nibble per character.
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+
+#endif
+
+/**
+ * Finds the first of two characters.
+ * @param chars the characters to search, which end at end.
+ * @param end the end of the source.
+ * @param a the first character.
+ * @param b the second character.
+ * @return the first occurrence of either character, or end.
+ */
+static const char *findEither(const char *chars, const char *end, char a, char b) {
+#ifdef MASK_BITS
+    for (; end - chars >= BLOCK_SIZE; chars += BLOCK_SIZE) {
+        uint64_t mask = matchBlock(chars, a, b, b);
+        if (mask != 0) return chars + __builtin_ctzll(mask) / MASK_BITS;
+    }
+#endif
+    while (chars < end && *chars != a && *chars != b) chars++;
+    return chars;
+}
+
+/**
+ * Skips spaces, tabs and carriage returns.
+ * @param chars the characters to skip, which end at end.
+ * @param end the end of the source.
+ * @return the first other character, or end.
+ */
+static const char *skipBlanks(const char *chars, const char *end) {
+    // Most runs are a single space, which is not worth a vector.
+    if (!hasClass(chars[0], CHAR_BLANK) || !hasClass(chars[1], CHAR_BLANK)) {
+        return hasClass(chars[0], CHAR_BLANK) ? chars + 1 : chars;
+    }
+
+#ifdef MASK_BITS
+    for (; end - chars >= BLOCK_SIZE; chars += BLOCK_SIZE) {
+        uint64_t mask = ~matchBlock(chars, ' ', '\t', '\r') & MASK_ALL;
+        if (mask != 0) return chars + __builtin_ctzll(mask) / MASK_BITS;
+    }
+#endif
+    while (hasClass(*chars, CHAR_BLANK)) chars++;
+    return chars;
+}
+
+/**
+ * Skips whitespace and comments.
+ * @param scanner the scanner.
+ */
+static void skipWhitespace(Scanner *scanner) {
+    for (;;) {
+        scanner->current = skipBlanks(scanner->current, scanner->end);
+        switch (peek(scanner)) {
+            case '\n':
+                scanner->line++;
+                advance(scanner);
+                break;
+            case '/':
+                if (peekNext(scanner) == '/') {
+                    scanner->current = findEither(scanner->current, scanner->end, '\n', '\n');
+                } else {
+                    return;
+                }
+                break;
+            default:
+                return;
+        }
+    }
 }
 
 /**
  * Checks whether a string matches the given keyword / token.
+ * @param scanner the scanner.
  * @param start the start index of the string.
  * @param length the length of the keyword.
  * @param rest the remainder of the keyword.
  * @param type the token type.
  * @return the token type of the keyword.
  */
-static TokenType checkKeyword(int start, int length, const char *rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-            memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType checkKeyword(Scanner *scanner, int start, int length, const char *rest, TokenType type) {
+    if (scanner->current - scanner->start == start + length &&
+            memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
 
@@ -160,121 +287,144 @@ static TokenType checkKeyword(int start, int length, const char *rest, TokenType
 
 /**
  * Returns the token type of the next keyword.
+ * @param scanner the scanner.
  * @return the token type.
  */
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+static TokenType identifierType(Scanner *scanner) {
+    switch (scanner->start[0]) {
+        case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
+        case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+        case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+                    case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
                 }
             }
             break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        case 'i': return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
+        case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+        case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+        case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+        case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+        case 's': return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+                    case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-        default:
-            return TOKEN_IDENTIFIER;
+        case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
+
+    return TOKEN_IDENTIFIER;
 }
 
 /**
  * Gets the next identifier.
+ * @param scanner the scanner.
  * @return the token of the identifier.
  */
-static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner *scanner) {
+    uint32_t hash = (FNV_OFFSET_BASIS ^ (uint8_t)scanner->start[0]) * FNV_PRIME;
+    while (hasClass(peek(scanner), CHAR_ALPHA | CHAR_DIGIT)) {
+        hash ^= (uint8_t)advance(scanner);
+        hash *= FNV_PRIME;
+    }
+
+    Token token = makeToken(scanner, identifierType(scanner));
+    token.hash = hash;
+    return token;
 }
 
 /**
  * Gets the next string.
+ * @param scanner the scanner.
  * @return the string token.
  */
-static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+static Token string(Scanner *scanner) {
+    for (;;) {
+        scanner->current = findEither(scanner->current, scanner->end, '"', '\n');
+        if (peek(scanner) != '\n') break;
+        scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 /**
  * Gets the next number token.
+ * @param scanner the scanner.
  * @return the number token.
  */
-static Token number() {
-    while (isDigit(peek())) advance();
+static Token number(Scanner *scanner) {
+    while (isDigit(peek(scanner))) advance(scanner);
 
-    if (peek() == '.' && isDigit(peekNext())) {
-        advance();
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
 
-        while (isDigit(peek())) advance();
+        while (isDigit(peek(scanner))) advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
 /* ===== End static functions ===== */
 
-void initScanner(const char *source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void initScanner(Scanner *scanner, const char *source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + strlen(source);
+    scanner->line = 1;
+}
+
+void initScannerAt(Scanner *scanner, const char *start, const char *end, int line) {
+    scanner->start = start;
+    scanner->current = start;
+    scanner->end = end;
+    scanner->line = line;
 }
 
-Token scanToken() {
-    skipWhitespace();
-    scanner.start = scanner.current;
+Token scanToken(Scanner *scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     switch (c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
-        case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-        case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-        case '>': return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-        case '"': return string();
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
+        case '!': return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        case '=': return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        case '<': return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        case '>': return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        case '"': return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #ifndef CLOX_SCANNER_H
 #define CLOX_SCANNER_H
 
+#include "common.h"
+
 /**
  * Lox token types.
  */
@@ -10,6 +12,7 @@ typedef enum {
     /* Single character tokens. */
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
@@ -39,18 +42,43 @@ typedef struct {
     const char *start;
     int length;
     int line;
+    /** The hash of an identifier or keyword's text, as computed by hashString(), or 0 for other tokens. */
+    uint32_t hash;
 } Token;
 
+/**
+ * The Lox scanner.
+ */
+typedef struct {
+    const char *start;
+    const char *current;
+    /** The NUL terminator of the source. */
+    const char *end;
+    int line;
+} Scanner;
+
 /**
  * Creates a scanner for the given source code.
+ * @param scanner the scanner.
  * @param source the source code to scan.
  */
-void initScanner(const char *source);
+void initScanner(Scanner *scanner, const char *source);
+
+/**
+ * Creates a scanner that starts partway through source code, such as at a function
+ * body that is compiled after the rest of the source.
+ * @param scanner the scanner.
+ * @param start where to start scanning.
+ * @param end the NUL terminator of the source.
+ * @param line the line that start is on.
+ */
+void initScannerAt(Scanner *scanner, const char *start, const char *end, int line);
 
 /**
  * Scans the next token.
+ * @param scanner the scanner.
  * @return the next token.
  */
-Token scanToken();
+Token scanToken(Scanner *scanner);
 
 #endif //CLOX_SCANNER_H
@@ -0,0 +1,258 @@
+// clock_gettime() and poll() are hidden by a strict -std=c99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "scheduler.h"
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SCHEDULER_POLL
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+/** The number of bytes of the standard input read at a time. */
+#define INPUT_CHUNK 4096
+
+/** The longest a single wait lasts, in milliseconds. Longer sleeps wait again. */
+#define WAIT_MAX_MS (60 * 60 * 1000)
+
+/* ===== Static functions ===== */
+
+/**
+ * Reads the scheduler's clock.
+ * @return the time in seconds.
+ */
+static double schedulerTime() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/**
+ * Appends a fiber to the waiting queue.
+ * @param vm the virtual machine.
+ * @param fiber the fiber.
+ */
+static void parkFiber(VM *vm, ObjFiber *fiber) {
+    Scheduler *scheduler = &vm->scheduler;
+    fiber->state = FIBER_WAITING;
+    fiber->next = NULL;
+    if (scheduler->waitingTail == NULL) {
+        scheduler->waitingHead = fiber;
+    } else {
+        scheduler->waitingTail->next = fiber;
+    }
+    scheduler->waitingTail = fiber;
+}
+
+/**
+ * Reads what is available of the standard input into the input buffer. Where poll()
+ * is available this is only called once the input is readable, so it does not block.
+ * @param scheduler the scheduler.
+ */
+static void readInput(Scheduler *scheduler) {
+    if (scheduler->inputLength + INPUT_CHUNK > scheduler->inputCapacity) {
+        scheduler->inputCapacity = scheduler->inputLength + INPUT_CHUNK;
+        scheduler->input = (char*)realloc(scheduler->input, scheduler->inputCapacity);
+        if (scheduler->input == NULL) exit(1);
+    }
+
+    char *end = scheduler->input + scheduler->inputLength;
+#ifdef SCHEDULER_POLL
+    ssize_t count = read(STDIN_FILENO, end, INPUT_CHUNK);
+    if (count < 0 && errno == EINTR) return;
+    if (count <= 0) {
+        scheduler->inputEnded = true;
+        return;
+    }
+    scheduler->inputLength += (size_t)count;
+#else
+    if (fgets(end, INPUT_CHUNK, stdin) == NULL) {
+        scheduler->inputEnded = true;
+        return;
+    }
+    scheduler->inputLength += strlen(end);
+#endif
+}
+
+/**
+ * Blocks until a parked fiber's timer expires or input arrives, and queues the fibers
+ * that were waiting for it.
+ * @param vm the virtual machine.
+ */
+static void waitForEvents(VM *vm) {
+    Scheduler *scheduler = &vm->scheduler;
+    bool wantsInput = false;
+    bool hasTimer = false;
+    double wakeTime = 0;
+    for (ObjFiber *fiber = scheduler->waitingHead; fiber != NULL; fiber = fiber->next) {
+        if (fiber->waitsForInput) {
+            wantsInput = true;
+        } else if (!hasTimer || fiber->wakeTime < wakeTime) {
+            hasTimer = true;
+            wakeTime = fiber->wakeTime;
+        }
+    }
+
+    // What the script printed so far comes first, such as a prompt for the input waited for.
+    flushOutput(&vm->output);
+
+    int timeout = -1;
+    if (hasTimer) {
+        double delay = wakeTime - schedulerTime();
+        // Rounded up, so the timer has expired when the wait ends.
+        timeout = delay <= 0 ? 0 : delay * 1000 >= WAIT_MAX_MS ? WAIT_MAX_MS : (int)(delay * 1000) + 1;
+    }
+
+    if (wantsInput && scheduler->inputEnded) {
+        timeout = 0;
+    } else if (wantsInput) {
+#ifdef SCHEDULER_POLL
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&input, 1, timeout) > 0 && input.revents != 0) readInput(scheduler);
+        timeout = 0;
+#else
+        // Without poll() the read blocks, and timers that expire meanwhile are late.
+        readInput(scheduler);
+        timeout = 0;
+#endif
+    }
+
+    if (timeout > 0) {
+#ifdef SCHEDULER_POLL
+        poll(NULL, 0, timeout);
+#else
+        while (schedulerTime() < wakeTime) {}
+#endif
+    }
+
+    double now = schedulerTime();
+    ObjFiber *previous = NULL;
+    ObjFiber *fiber = scheduler->waitingHead;
+    while (fiber != NULL) {
+        ObjFiber *next = fiber->next;
+        Value value = fiber->waitsForInput ? takeInputLine(vm) : now >= fiber->wakeTime ? NIL_VAL : UNDEFINED_VAL;
+        if (IS_UNDEFINED(value)) {
+            previous = fiber;
+            fiber = next;
+            continue;
+        }
+
+        if (previous == NULL) {
+            scheduler->waitingHead = next;
+        } else {
+            previous->next = next;
+        }
+        if (scheduler->waitingTail == fiber) scheduler->waitingTail = previous;
+        fiber->waitsForInput = false;
+        scheduleFiber(vm, fiber, value);
+        fiber = next;
+    }
+}
+
+/**
+ * Marks every fiber in a queue done.
+ * @param fiber the head of the queue.
+ */
+static void stopQueue(ObjFiber *fiber) {
+    while (fiber != NULL) {
+        ObjFiber *next = fiber->next;
+        fiber->state = FIBER_DONE;
+        fiber->waitsForInput = false;
+        fiber->next = NULL;
+        fiber = next;
+    }
+}
+
+/* ===== End static functions ===== */
+
+void initScheduler(Scheduler *scheduler) {
+    scheduler->readyHead = NULL;
+    scheduler->readyTail = NULL;
+    scheduler->waitingHead = NULL;
+    scheduler->waitingTail = NULL;
+    scheduler->input = NULL;
+    scheduler->inputLength = 0;
+    scheduler->inputCapacity = 0;
+    scheduler->inputEnded = false;
+}
+
+void freeScheduler(Scheduler *scheduler) {
+    free(scheduler->input);
+    initScheduler(scheduler);
+}
+
+void clearScheduler(Scheduler *scheduler) {
+    stopQueue(scheduler->readyHead);
+    stopQueue(scheduler->waitingHead);
+    scheduler->readyHead = NULL;
+    scheduler->readyTail = NULL;
+    scheduler->waitingHead = NULL;
+    scheduler->waitingTail = NULL;
+}
+
+void scheduleFiber(VM *vm, ObjFiber *fiber, Value value) {
+    Scheduler *scheduler = &vm->scheduler;
+    fiber->state = FIBER_READY;
+    fiber->value = value;
+    fiber->next = NULL;
+    barrierObject(vm, (Obj*)fiber);
+
+    if (scheduler->readyTail == NULL) {
+        scheduler->readyHead = fiber;
+    } else {
+        scheduler->readyTail->next = fiber;
+    }
+    scheduler->readyTail = fiber;
+}
+
+void sleepFiber(VM *vm, ObjFiber *fiber, double seconds) {
+    fiber->wakeTime = schedulerTime() + seconds;
+    fiber->waitsForInput = false;
+    parkFiber(vm, fiber);
+}
+
+void waitForInput(VM *vm, ObjFiber *fiber) {
+    fiber->waitsForInput = true;
+    parkFiber(vm, fiber);
+}
+
+Value takeInputLine(VM *vm) {
+    Scheduler *scheduler = &vm->scheduler;
+    char *newline = scheduler->inputLength == 0 ? NULL : (char*)memchr(scheduler->input, '\n', scheduler->inputLength);
+    if (newline == NULL && !scheduler->inputEnded) return UNDEFINED_VAL;
+    if (newline == NULL && scheduler->inputLength == 0) return NIL_VAL;
+
+    size_t length = newline == NULL ? scheduler->inputLength : (size_t)(newline - scheduler->input);
+    Value line = OBJ_VAL(copyString(vm, scheduler->input, (int)length));
+
+    size_t consumed = newline == NULL ? length : length + 1;
+    memmove(scheduler->input, scheduler->input + consumed, scheduler->inputLength - consumed);
+    scheduler->inputLength -= consumed;
+    return line;
+}
+
+ObjFiber *nextFiber(VM *vm) {
+    Scheduler *scheduler = &vm->scheduler;
+    while (scheduler->readyHead == NULL) {
+        if (scheduler->waitingHead == NULL) return NULL;
+        waitForEvents(vm);
+    }
+
+    ObjFiber *fiber = scheduler->readyHead;
+    scheduler->readyHead = fiber->next;
+    if (scheduler->readyHead == NULL) scheduler->readyTail = NULL;
+    fiber->next = NULL;
+    return fiber;
+}
@@ -0,0 +1,88 @@
+#ifndef CLOX_SCHEDULER_H
+#define CLOX_SCHEDULER_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/**
+ * The fibers of a VM that are neither running nor suspended in a resume(), and the
+ * event loop that wakes them. Fibers run one at a time and switch only when the running
+ * one yields, parks or returns, so the queues are never touched concurrently.
+ */
+typedef struct {
+    /** Fibers ready to continue, in the order they became ready, linked through their next fields. */
+    ObjFiber *readyHead;
+    ObjFiber *readyTail;
+
+    /** Fibers parked on a timer or on input, in the order they parked. */
+    ObjFiber *waitingHead;
+    ObjFiber *waitingTail;
+
+    /** Bytes read from the standard input that have not been handed out as lines yet. */
+    char *input;
+    size_t inputLength;
+    size_t inputCapacity;
+    /** Whether the standard input reached its end. */
+    bool inputEnded;
+} Scheduler;
+
+/**
+ * Sets up an empty scheduler.
+ * @param scheduler the scheduler.
+ */
+void initScheduler(Scheduler *scheduler);
+
+/**
+ * Frees a scheduler's input buffer. The fibers are objects, freed with the heap.
+ * @param scheduler the scheduler.
+ */
+void freeScheduler(Scheduler *scheduler);
+
+/**
+ * Empties the queues, marking every fiber in them done.
+ * @param scheduler the scheduler.
+ */
+void clearScheduler(Scheduler *scheduler);
+
+/**
+ * Queues a fiber to continue once the fibers ahead of it have had their turn.
+ * @param vm the virtual machine.
+ * @param fiber the fiber.
+ * @param value the value the fiber continues with.
+ */
+void scheduleFiber(VM *vm, ObjFiber *fiber, Value value);
+
+/**
+ * Parks a fiber until a number of seconds have passed. It then continues with nil.
+ * @param vm the virtual machine.
+ * @param fiber the fiber.
+ * @param seconds the number of seconds.
+ */
+void sleepFiber(VM *vm, ObjFiber *fiber, double seconds);
+
+/**
+ * Parks a fiber until a line of the standard input has been read. It then continues
+ * with the line, or with nil at the end of the input.
+ * @param vm the virtual machine.
+ * @param fiber the fiber.
+ */
+void waitForInput(VM *vm, ObjFiber *fiber);
+
+/**
+ * Takes the next line of the standard input from what was already read, without waiting.
+ * @param vm the virtual machine.
+ * @return the line without its newline, nil at the end of the input, or UNDEFINED_VAL if no whole line has been read yet.
+ */
+Value takeInputLine(VM *vm);
+
+/**
+ * Takes the next fiber from the ready queue. If it is empty but fibers are parked, what
+ * the scripts printed is flushed and the VM blocks in poll() until a timer expires or
+ * input arrives, and the fibers that were waiting for it are queued.
+ * @param vm the virtual machine.
+ * @return the fiber, or NULL if no fiber is ready or parked.
+ */
+ObjFiber *nextFiber(VM *vm);
+
+#endif //CLOX_SCHEDULER_H
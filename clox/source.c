@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "source.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SOURCE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* ===== Static functions ===== */
+
+/**
+ * Allocates a source.
+ * @param path the path of the script, for error messages.
+ * @return the source.
+ */
+static Source *newSource(const char *path) {
+    Source *source = (Source*)malloc(sizeof(Source));
+    if (source == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+
+    source->chars = NULL;
+    source->length = 0;
+    source->isMapped = false;
+    source->next = NULL;
+    return source;
+}
+
+#ifdef SOURCE_MMAP
+/**
+ * Memory-maps the source code of a script. The mapping must end partway through
+ * a page, since the zero-filled rest of that page is what terminates the source.
+ * @param path the path of the script.
+ * @return the source, or NULL if the file cannot be mapped.
+ */
+static Source *mapSource(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t length = (size_t)status.st_size;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (length == 0 || pageSize <= 0 || length % (size_t)pageSize == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *chars = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (chars == MAP_FAILED) return NULL;
+
+    Source *source = newSource(path);
+    source->chars = (const char*)chars;
+    source->length = length;
+    source->isMapped = true;
+    return source;
+}
+#endif
+
+/**
+ * Reads the source code of a script into a heap buffer.
+ * @param path the path of the script.
+ * @return the source, or NULL if the file cannot be opened.
+ */
+static Source *readSource(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char *buffer = (char*)malloc(fileSize + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    buffer[bytesRead] = '\0';
+    fclose(file);
+
+    Source *source = newSource(path);
+    source->chars = buffer;
+    source->length = bytesRead;
+    return source;
+}
+
+/* ===== End static functions ===== */
+
+Source *openSource(const char *path) {
+#ifdef SOURCE_MMAP
+    Source *source = mapSource(path);
+    if (source != NULL) return source;
+#endif
+    return readSource(path);
+}
+
+void closeSource(Source *source) {
+#ifdef SOURCE_MMAP
+    if (source->isMapped) {
+        munmap((void*)source->chars, source->length);
+        free(source);
+        return;
+    }
+#endif
+    free((void*)source->chars);
+    free(source);
+}
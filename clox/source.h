@@ -0,0 +1,37 @@
+#ifndef CLOX_SOURCE_H
+#define CLOX_SOURCE_H
+
+#include "common.h"
+
+/**
+ * The source code of a script loaded from a file.
+ * Where the platform allows it the file is memory-mapped read-only rather than copied.
+ */
+typedef struct Source {
+    /** The source code, terminated by a NUL byte. */
+    const char *chars;
+
+    /** The length of the source code, excluding the terminator. */
+    size_t length;
+
+    /** Whether chars is a mapping of the file rather than a heap buffer. */
+    bool isMapped;
+
+    /** The next source held by the same VM. */
+    struct Source *next;
+} Source;
+
+/**
+ * Loads the source code of a script.
+ * @param path the path of the script.
+ * @return the source, or NULL if the file cannot be opened.
+ */
+Source *openSource(const char *path);
+
+/**
+ * Unmaps or frees a source.
+ * @param source the source.
+ */
+void closeSource(Source *source);
+
+#endif //CLOX_SOURCE_H
@@ -5,150 +5,317 @@
 #include "object.h"
 #include "value.h"
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TABLE_NEON
+#endif
+
 #define TABLE_MAX_LOAD 0.75
 
+/** The control bytes of slots that are empty, deleted, and past the capacity of a small table. */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_PADDING 0xff
+
+/** The control byte of a full slot whose key has the given hash. */
+#define CTRL_FULL(hash) ((uint8_t)((hash) >> 25))
+
+/** Whether a control byte is that of a full slot: only those have the top bit clear. */
+#define IS_FULL(control) (((control) & 0x80) == 0)
+
+/** The number of control bytes of a table. */
+#define CONTROL_SIZE(capacity) ((capacity) < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : (capacity))
+
+/* ===== Static functions ===== */
+
+#if defined(TABLE_SSE2)
+
+/** The position of a slot's bit in a group mask is its index shifted left by this. */
+#define MASK_SHIFT 0
+
+/**
+ * Finds the slots of a group whose control byte has the given value.
+ * @param control the control bytes of the group.
+ * @param byte the value.
+ * @return a mask with a bit set for every slot that matches, at its index shifted by MASK_SHIFT.
+ */
+static inline uint64_t matchGroup(const uint8_t *control, uint8_t byte) {
+    __m128i group = _mm_loadu_si128((const __m128i*)control);
+    return (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+#elif defined(TABLE_NEON)
+
+#define MASK_SHIFT 2
+
 /**
- * Finds an entry from a hash table.
- * @param entries the list of entries.
- * @param capacity the capacity of the hash table.
+ * Finds the slots of a group whose control byte has the given value.
+ * @param control the control bytes of the group.
+ * @param byte the value.
+ * @return a mask with a bit set for every slot that matches, at its index shifted by MASK_SHIFT.
+ */
+static inline uint64_t matchGroup(const uint8_t *control, uint8_t byte) {
+    uint8x16_t matches = vceqq_u8(vld1q_u8(control), vdupq_n_u8(byte));
+    // NEON has no movemask: narrowing each 16-bit lane by 4 leaves a nibble per slot, of which one bit is kept.
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888u;
+}
+
+#else
+
+#define MASK_SHIFT 0
+
+/**
+ * Finds the slots of a group whose control byte has the given value.
+ * @param control the control bytes of the group.
+ * @param byte the value.
+ * @return a mask with a bit set for every slot that matches, at its index shifted by MASK_SHIFT.
+ */
+static inline uint64_t matchGroup(const uint8_t *control, uint8_t byte) {
+    uint64_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (control[i] == byte) mask |= (uint64_t)1 << i;
+    }
+    return mask;
+}
+
+#endif
+
+/**
+ * Removes the lowest slot from a group mask and returns it.
+ * @param mask the mask, which must not be zero.
+ * @return the index of the slot within its group.
+ */
+static inline int nextMatch(uint64_t *mask) {
+    int bit;
+#ifdef __GNUC__
+    bit = __builtin_ctzll(*mask);
+#else
+    for (bit = 0; (*mask & ((uint64_t)1 << bit)) == 0; bit++);
+#endif
+    *mask &= *mask - 1;
+    return bit >> MASK_SHIFT;
+}
+
+/**
+ * Gets the number of groups of a table.
+ * @param capacity the capacity of the table.
+ * @return the number of groups.
+ */
+static inline int groupCount(int capacity) {
+    return capacity < TABLE_GROUP_SIZE ? 1 : capacity / TABLE_GROUP_SIZE;
+}
+
+/**
+ * Finds the slot that holds a key.
+ * @param table the hash table, which must have a capacity.
  * @param key the key to find.
- * @return the entry;
+ * @param hash the hash of the key.
+ * @return the index of the slot, or -1 if the key is not in the table.
  */
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry *tombstone = NULL;
-
-    for (;;) {
-        Entry *entry = &entries[index];
-
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key || entry->key == NULL) {
-            return entry;
+static inline int findSlot(Table *table, ObjString *key, uint32_t hash) {
+    int groupMask = groupCount(table->capacity) - 1;
+    int group = (int)(hash & (uint32_t)groupMask);
+
+    for (int step = 1;; step++) {
+        const uint8_t *control = &table->control[group * TABLE_GROUP_SIZE];
+        uint64_t matches = matchGroup(control, CTRL_FULL(hash));
+        while (matches != 0) {
+            int slot = group * TABLE_GROUP_SIZE + nextMatch(&matches);
+            if (table->entries[slot].key == key) return slot;
         }
 
-        index = (index + 1) & (capacity - 1);
+        // A probe for a key passes through full groups only.
+        if (matchGroup(control, CTRL_EMPTY) != 0) return -1;
+        group = (group + step) & groupMask;
     }
 }
 
 /**
- * Adjusts the capacity of the hash table.
+ * Finds the first slot on the probe sequence of a hash that is empty or deleted.
+ * @param table the hash table, which must have a capacity.
+ * @param hash the hash.
+ * @return the index of the slot.
+ */
+static int findFreeSlot(Table *table, uint32_t hash) {
+    int groupMask = groupCount(table->capacity) - 1;
+    int group = (int)(hash & (uint32_t)groupMask);
+
+    for (int step = 1;; step++) {
+        const uint8_t *control = &table->control[group * TABLE_GROUP_SIZE];
+        uint64_t available = matchGroup(control, CTRL_EMPTY) | matchGroup(control, CTRL_DELETED);
+        if (available != 0) return group * TABLE_GROUP_SIZE + nextMatch(&available);
+        group = (group + step) & groupMask;
+    }
+}
+
+/**
+ * Fills a slot.
  * @param table the hash table.
- * @param capacity the new capacity.
+ * @param slot the index of the slot, which must be empty or deleted.
+ * @param key the key.
+ * @param hash the hash of the key.
+ * @param value the value.
  */
-static void adjustCapacity(Table *table, int capacity) {
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+static void fillSlot(Table *table, int slot, ObjString *key, uint32_t hash, Value value) {
+    if (table->control[slot] == CTRL_DELETED) table->tombstones--;
+    table->control[slot] = CTRL_FULL(hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->entries[slot].hash = hash;
+    table->count++;
+}
+
+/**
+ * Empties a full slot.
+ * @param table the hash table.
+ * @param slot the index of the slot.
+ */
+static void clearSlot(Table *table, int slot) {
+    // A probe stops at a group with an empty slot, so deleting from one needs no tombstone.
+    const uint8_t *control = &table->control[slot / TABLE_GROUP_SIZE * TABLE_GROUP_SIZE];
+    if (matchGroup(control, CTRL_EMPTY) != 0) {
+        table->control[slot] = CTRL_EMPTY;
+    } else {
+        table->control[slot] = CTRL_DELETED;
+        table->tombstones++;
     }
 
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->count--;
+}
+
+/**
+ * Rebuilds the hash table with a new capacity, dropping its tombstones.
+ * @param vm the virtual machine.
+ * @param table the hash table.
+ * @param capacity the new capacity.
+ */
+static void adjustCapacity(VM *vm, Table *table, int capacity) {
+    int controlSize = CONTROL_SIZE(capacity);
+    uint8_t *control = ALLOCATE(vm, uint8_t, controlSize);
+    Entry *entries = ALLOCATE(vm, Entry, capacity);
+    memset(control, CTRL_EMPTY, capacity);
+    memset(control + capacity, CTRL_PADDING, controlSize - capacity);
+
+    Table old = *table;
     table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) continue;
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+    table->tombstones = 0;
+    table->capacity = capacity;
+    table->control = control;
+    table->entries = entries;
+
+    for (int i = 0; i < old.capacity; i++) {
+        if (!IS_FULL(old.control[i])) continue;
+        Entry *entry = &old.entries[i];
+        fillSlot(table, findFreeSlot(table, entry->hash), entry->key, entry->hash, entry->value);
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    if (old.capacity > 0) FREE_ARRAY(vm, uint8_t, old.control, CONTROL_SIZE(old.capacity));
+    FREE_ARRAY(vm, Entry, old.entries, old.capacity);
 }
 
+/* ===== End static functions ===== */
+
 void initTable(Table *table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
-void freeTable(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM *vm, Table *table) {
+    if (table->capacity > 0) FREE_ARRAY(vm, uint8_t, table->control, CONTROL_SIZE(table->capacity));
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
     if (table->count == 0) return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key, key->hash);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
-
 }
 
-bool tableSet(Table *table, ObjString *key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value) {
+    uint32_t hash = key->hash;
+    if (table->count > 0) {
+        int slot = findSlot(table, key, hash);
+        if (slot >= 0) {
+            table->entries[slot].value = value;
+            return false;
+        }
     }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // Mostly tombstones: rebuilding at the same size is enough.
+        int capacity = table->count + 1 > table->capacity * TABLE_MAX_LOAD / 2
+                       ? GROW_CAPACITY(table->capacity) : table->capacity;
+        adjustCapacity(vm, table, capacity);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    fillSlot(table, findFreeSlot(table, hash), key, hash, value);
+    return true;
 }
 
-void tableAddAll(Table *from, Table *to) {
+void tableAddAll(VM *vm, Table *from, Table *to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry  *entry = &from->entries[i];
-        if (entry->key != NULL) {}
-        tableSet(to, entry->key, entry->value);
+        if (!IS_FULL(from->control[i])) continue;
+        tableSet(vm, to, from->entries[i].key, from->entries[i].value);
     }
 }
 
 bool tableDelete(Table *table, ObjString *key) {
     if (table->count == 0) return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key, key->hash);
+    if (slot < 0) return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    clearSlot(table, slot);
     return true;
 }
 
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-            entry->key->hash == hash &&
-            memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+    int groupMask = groupCount(table->capacity) - 1;
+    int group = (int)(hash & (uint32_t)groupMask);
+
+    for (int step = 1;; step++) {
+        const uint8_t *control = &table->control[group * TABLE_GROUP_SIZE];
+        uint64_t matches = matchGroup(control, CTRL_FULL(hash));
+        while (matches != 0) {
+            Entry *entry = &table->entries[group * TABLE_GROUP_SIZE + nextMatch(&matches)];
+            if (entry->hash == hash && entry->key->length == length &&
+                memcmp(entry->key->chars, chars, length) == 0) {
+                return entry->key;
+            }
         }
 
-        index = (index + 1) % (table->capacity - 1);
+        if (matchGroup(control, CTRL_EMPTY) != 0) return NULL;
+        group = (group + step) & groupMask;
     }
 }
 
-void tableRemoveWhite(Table *table) {
+void tableRemoveWhite(VM *vm, Table *table) {
     for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
-        }
+        if (!IS_FULL(table->control[i])) continue;
+        if (isWhite(vm, (Obj*)table->entries[i].key)) clearSlot(table, i);
     }
 }
 
-void markTable(Table *table) {
+void markTable(VM *vm, Table *table) {
     for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        if (!IS_FULL(table->control[i])) continue;
+        markObject(vm, (Obj*)table->entries[i].key);
+        markValue(vm, table->entries[i].value);
     }
 }
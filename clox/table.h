@@ -10,17 +10,30 @@
 typedef struct {
     ObjString *key;
     Value value;
+    /** The hash of the key, kept here so probing and resizing need not load the key. */
+    uint32_t hash;
 } Entry;
 
 /**
- * Hash table.
+ * Hash table. The slots are probed in groups of TABLE_GROUP_SIZE through a
+ * control byte per slot, which says whether the slot is empty or deleted or
+ * otherwise holds the top seven bits of its key's hash.
  */
 typedef struct {
+    /** The number of keys. */
     int count;
+    /** The number of deleted slots, which are reused by inserts and dropped by resizes. */
+    int tombstones;
+    /** The number of slots, a power of two. */
     int capacity;
+    /** The control bytes, at least TABLE_GROUP_SIZE of them. Bytes past the capacity are never matched. */
+    uint8_t *control;
     Entry *entries;
 } Table;
 
+/** The number of slots probed at once. */
+#define TABLE_GROUP_SIZE 16
+
 /**
  * Initialises an empty hash table.
  * @param table the hash table.
@@ -29,9 +42,10 @@ void initTable(Table *table);
 
 /**
  * Frees a hash table.
+ * @param vm the virtual machine.
  * @param table the hash table.
  */
-void freeTable(Table *table);
+void freeTable(VM *vm, Table *table);
 
 /**
  * Gets a value from a hash table.
@@ -44,12 +58,13 @@ bool tableGet(Table *table, ObjString *key, Value *value);
 
 /**
  * Sets a key-value in the hash table.
+ * @param vm the virtual machine.
  * @param table the hash table.
  * @param key the key to add.
  * @param value the value to add.
  * @return if a new value was added.
  */
-bool tableSet(Table *table, ObjString *key, Value value);
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value);
 
 /**
  * Deletes an entry from a hash table.
@@ -61,10 +76,11 @@ bool tableDelete(Table *table, ObjString *key);
 
 /**
  * Copies entries from one hash table to another.
+ * @param vm the virtual machine.
  * @param from the origin hash table.
  * @param to the destination hash table.
  */
-void tableAddAll(Table *from, Table *to);
+void tableAddAll(VM *vm, Table *from, Table *to);
 
 /**
  * Finds a string stored within a hash table.
@@ -78,14 +94,16 @@ ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t
 
 /**
  * Removes white objects (no longer referenced) from the table.
+ * @param vm the virtual machine.
  * @param table the table.
  */
-void tableRemoveWhite(Table *table);
+void tableRemoveWhite(VM *vm, Table *table);
 
 /**
  * Marks the objects within the table.
+ * @param vm the virtual machine.
  * @param table the table.
  */
-void markTable(Table *table);
+void markTable(VM *vm, Table *table);
 
 #endif //CLOX_TABLE_H
@@ -10,50 +10,58 @@ void initValueArray(ValueArray *array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray *array, Value value) {
+void writeValueArray(VM *vm, ValueArray *array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
     array->count++;
 }
 
-void freeValueArray(ValueArray *array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM *vm, ValueArray *array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
-void printValue(Value value) {
+void writeValue(Output *output, Value value) {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
-        printf(AS_BOOL(value) ? "true" : "false");
+        if (AS_BOOL(value)) writeOutput(output, "true", 4); else writeOutput(output, "false", 5);
     } else if (IS_NIL(value)) {
-        printf("nil");
+        writeOutput(output, "nil", 3);
     } else if (IS_NUMBER(value)) {
-        printf("%g", AS_NUMBER(value));
+        writeNumber(output, AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
-        printObject(value);
+        writeObject(output, value);
     }
 #else
     switch (value.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            if (AS_BOOL(value)) writeOutput(output, "true", 4); else writeOutput(output, "false", 5);
             break;
-        case VAL_NIL:    printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-        case VAL_OBJ:    printObject(value); break;
+        case VAL_NIL:    writeOutput(output, "nil", 3); break;
+        case VAL_NUMBER: writeNumber(output, AS_NUMBER(value)); break;
+        case VAL_OBJ:    writeObject(output, value); break;
+        case VAL_UNDEFINED: break;
     }
 #endif
 }
 
+void printValue(Value value) {
+    Output output;
+    initOutput(&output, writeFile, stdout, 0);
+    writeValue(&output, value);
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
+    if (a != b && (IS_BUILDER(a) || IS_BUILDER(b))) return stringsEqual(a, b);
     return a == b;
 #else
     if (a.type != b.type) return false;
@@ -61,7 +69,9 @@ bool valuesEqual(Value a, Value b) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (IS_BUILDER(a) || IS_BUILDER(b)) return stringsEqual(a, b);
+            return AS_OBJ(a) == AS_OBJ(b);
         default:         return false;
     }
 #endif
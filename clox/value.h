@@ -4,10 +4,15 @@
 #include <string.h>
 
 #include "common.h"
+#include "output.h"
 #include "value.h"
 
+typedef struct VM VM;
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
 
 #ifdef NAN_BOXING
 
@@ -17,10 +22,12 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1
 #define TAG_FALSE 2
 #define TAG_TRUE  3
+#define TAG_UNDEFINED 4
 
 typedef uint64_t Value;
 
 #define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
@@ -36,6 +43,7 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
@@ -61,7 +69,8 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED
 } ValueType;
 
 /**
@@ -81,6 +90,7 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
@@ -90,6 +100,7 @@ typedef struct {
 #define NIL_VAL           ((Value){VAL_NIL,    {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ,    {.obj = (Obj*)object}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -124,19 +135,28 @@ void initValueArray(ValueArray *array);
 
 /**
  * Appends a new value to the given value array.
+ * @param vm the virtual machine.
  * @param array the value array.
  * @param value the new value.
  */
-void writeValueArray(ValueArray *array, Value value);
+void writeValueArray(VM *vm, ValueArray *array, Value value);
 
 /**
  * Frees the value array's memory.
+ * @param vm the virtual machine.
  * @param array the value array.
  */
-void freeValueArray(ValueArray *array);
+void freeValueArray(VM *vm, ValueArray *array);
 
 /**
- * Writes a value to stdout.
+ * Writes a value to an output.
+ * @param output the output.
+ * @param value the value.
+ */
+void writeValue(Output *output, Value value);
+
+/**
+ * Writes a value to stdout, unbuffered. Used by the debugging tools.
  * @param value the value.
  */
 void printValue(Value value);
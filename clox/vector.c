@@ -0,0 +1,100 @@
+#include "vector.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VECTOR_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define VECTOR_NEON
+#endif
+
+/*
+ * Both instruction sets have two-lane double vectors, so the same loops serve
+ * both through these wrappers.
+ */
+#if defined(VECTOR_SSE2)
+typedef __m128d Lanes;
+#define LOAD(p)       _mm_loadu_pd(p)
+#define STORE(p, v)   _mm_storeu_pd((p), (v))
+#define SPLAT(x)      _mm_set1_pd(x)
+#define ADD(a, b)     _mm_add_pd((a), (b))
+#define MUL(a, b)     _mm_mul_pd((a), (b))
+#define ZERO()        _mm_setzero_pd()
+#define SUM_LANES(v)  (_mm_cvtsd_f64(v) + _mm_cvtsd_f64(_mm_unpackhi_pd((v), (v))))
+#define LANES 2
+#elif defined(VECTOR_NEON)
+typedef float64x2_t Lanes;
+#define LOAD(p)       vld1q_f64(p)
+#define STORE(p, v)   vst1q_f64((p), (v))
+#define SPLAT(x)      vdupq_n_f64(x)
+#define ADD(a, b)     vaddq_f64((a), (b))
+#define MUL(a, b)     vmulq_f64((a), (b))
+#define ZERO()        vdupq_n_f64(0.0)
+#define SUM_LANES(v)  vaddvq_f64(v)
+#define LANES 2
+#endif
+
+double vectorSum(const double *values, int count) {
+    int i = 0;
+    double sum = 0;
+#ifdef LANES
+    // Two accumulators keep two additions in flight.
+    Lanes first = ZERO();
+    Lanes second = ZERO();
+    for (; i + 2 * LANES <= count; i += 2 * LANES) {
+        first = ADD(first, LOAD(values + i));
+        second = ADD(second, LOAD(values + i + LANES));
+    }
+    sum = SUM_LANES(ADD(first, second));
+#endif
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+double vectorDot(const double *a, const double *b, int count) {
+    int i = 0;
+    double sum = 0;
+#ifdef LANES
+    Lanes first = ZERO();
+    Lanes second = ZERO();
+    for (; i + 2 * LANES <= count; i += 2 * LANES) {
+        first = ADD(first, MUL(LOAD(a + i), LOAD(b + i)));
+        second = ADD(second, MUL(LOAD(a + i + LANES), LOAD(b + i + LANES)));
+    }
+    sum = SUM_LANES(ADD(first, second));
+#endif
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+void vectorAdd(double *target, const double *values, int count) {
+    int i = 0;
+#ifdef LANES
+    for (; i + LANES <= count; i += LANES) {
+        STORE(target + i, ADD(LOAD(target + i), LOAD(values + i)));
+    }
+#endif
+    for (; i < count; i++) target[i] += values[i];
+}
+
+void vectorAddScalar(double *target, double value, int count) {
+    int i = 0;
+#ifdef LANES
+    Lanes addend = SPLAT(value);
+    for (; i + LANES <= count; i += LANES) {
+        STORE(target + i, ADD(LOAD(target + i), addend));
+    }
+#endif
+    for (; i < count; i++) target[i] += value;
+}
+
+void vectorScale(double *target, double factor, int count) {
+    int i = 0;
+#ifdef LANES
+    Lanes multiplier = SPLAT(factor);
+    for (; i + LANES <= count; i += LANES) {
+        STORE(target + i, MUL(LOAD(target + i), multiplier));
+    }
+#endif
+    for (; i < count; i++) target[i] *= factor;
+}
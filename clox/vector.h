@@ -0,0 +1,53 @@
+#ifndef CLOX_VECTOR_H
+#define CLOX_VECTOR_H
+
+#include "common.h"
+
+/*
+ * Loops over packed numbers, used by the bulk natives of Float64Array. They use
+ * SSE2 or NEON where available. Sums are accumulated in several lanes at once, so
+ * they may round differently from adding the numbers one by one in order.
+ */
+
+/**
+ * Adds up numbers.
+ * @param values the numbers.
+ * @param count the number of numbers.
+ * @return the sum.
+ */
+double vectorSum(const double *values, int count);
+
+/**
+ * Computes the dot product of two arrays of numbers.
+ * @param a the first numbers.
+ * @param b the second numbers.
+ * @param count the number of numbers in each.
+ * @return the dot product.
+ */
+double vectorDot(const double *a, const double *b, int count);
+
+/**
+ * Adds numbers to numbers in place.
+ * @param target the numbers added to.
+ * @param values the numbers to add, which may be the target.
+ * @param count the number of numbers in each.
+ */
+void vectorAdd(double *target, const double *values, int count);
+
+/**
+ * Adds a number to numbers in place.
+ * @param target the numbers added to.
+ * @param value the number to add.
+ * @param count the number of numbers.
+ */
+void vectorAddScalar(double *target, double value, int count);
+
+/**
+ * Multiplies numbers by a number in place.
+ * @param target the numbers multiplied.
+ * @param factor the number to multiply by.
+ * @param count the number of numbers.
+ */
+void vectorScale(double *target, double factor, int count);
+
+#endif //CLOX_VECTOR_H
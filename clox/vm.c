@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
@@ -7,31 +8,125 @@
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "jit.h"
+#include "profiler.h"
 #include "object.h"
 #include "memory.h"
+#include "vector.h"
 
-VM vm;
+#if defined(CLOX_COMPUTED_GOTO) && defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
 
 /* ===== Static functions ===== */
 
 /**
  * Native clock function.
  * This function invokes the clock() function from the C standard library.
+ * @param vm the virtual machine.
  * @param argCount the number of arguments taken by the native function.
  * @param args the list of arguments.
  * @return the value returned from the native function.
  */
-static Value clockNative(int argCount, Value *args) {
+static Value clockNative(VM *vm, int argCount, Value *args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+/**
+ * The names gcStats() reports object counts under, by ObjType.
+ * They are plural so none of them collide with a keyword.
+ */
+static const char *objTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_BOUND_METHOD]  = "boundMethods",
+    [OBJ_BUILDER]       = "builders",
+    [OBJ_CLASS]         = "classes",
+    [OBJ_CLOSURE]       = "closures",
+    [OBJ_FIBER]         = "fibers",
+    [OBJ_FLOAT64_ARRAY] = "float64Arrays",
+    [OBJ_FUNCTION]      = "functions",
+    [OBJ_INSTANCE]      = "instances",
+    [OBJ_LIST]          = "lists",
+    [OBJ_NATIVE]        = "natives",
+    [OBJ_SHAPE]         = "shapes",
+    [OBJ_STRING]        = "strings",
+    [OBJ_UPVALUE]       = "upvalues",
+};
+
+/**
+ * Creates an empty instance of a new class, and leaves it on top of the stack.
+ * @param vm the virtual machine.
+ * @param name the name of the class.
+ * @return the instance.
+ */
+static ObjInstance *pushNativeInstance(VM *vm, const char *name) {
+    ObjString *className = copyString(vm, name, (int)strlen(name));
+    push(vm, OBJ_VAL(className));
+    ObjClass *klass = newClass(vm, className);
+    pop(vm);
+    push(vm, OBJ_VAL(klass));
+    ObjInstance *instance = newInstance(vm, klass);
+    pop(vm);
+    push(vm, OBJ_VAL(instance));
+    return instance;
+}
+
+/**
+ * Sets a field of an instance built by a native function.
+ * @param vm the virtual machine.
+ * @param instance the instance, which must be reachable from the stack.
+ * @param name the name of the field.
+ * @param value the value of the field.
+ */
+static void setNativeField(VM *vm, ObjInstance *instance, const char *name, Value value) {
+    ObjString *fieldName = copyString(vm, name, (int)strlen(name));
+    push(vm, OBJ_VAL(fieldName));
+    instanceSetField(vm, instance, fieldName, value);
+    pop(vm);
+}
+
+/**
+ * Native gcStats function.
+ * Returns an instance holding the garbage collector statistics, with the object
+ * counts in a nested instance under the "objects" field.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value gcStatsNative(VM *vm, int argCount, Value *args) {
+    GcStats stats;
+    getGcStats(vm, &stats);
+
+    ObjInstance *result = pushNativeInstance(vm, "GcStats");
+    setNativeField(vm, result, "collections", NUMBER_VAL(stats.collections));
+    setNativeField(vm, result, "minorCollections", NUMBER_VAL(stats.minorCollections));
+    setNativeField(vm, result, "totalPause", NUMBER_VAL(stats.totalPause));
+    setNativeField(vm, result, "maxPause", NUMBER_VAL(stats.maxPause));
+    setNativeField(vm, result, "bytesAllocated", NUMBER_VAL((double)stats.bytesAllocated));
+    setNativeField(vm, result, "bytesFreed", NUMBER_VAL((double)stats.bytesFreed));
+    setNativeField(vm, result, "liveBytes", NUMBER_VAL((double)stats.liveBytes));
+    setNativeField(vm, result, "heapBytes", NUMBER_VAL((double)(stats.bytesAllocated - stats.bytesFreed)));
+    setNativeField(vm, result, "nextGC", NUMBER_VAL((double)stats.nextGC));
+
+    ObjInstance *objects = pushNativeInstance(vm, "ObjectCounts");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        setNativeField(vm, objects, objTypeNames[i], NUMBER_VAL(stats.objectCounts[i]));
+    }
+    pop(vm);
+
+    setNativeField(vm, result, "objects", OBJ_VAL(objects));
+    pop(vm);
+    return OBJ_VAL(result);
+}
+
 /**
  * Returns the next value in the stack at the given distance.
+ * @param vm the virtual machine.
  * @param distance the distance.
  * @return the next value.
  */
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+static Value peek(VM *vm, int distance) {
+    return vm->stackTop[-1 - distance];
 }
 
 /**
@@ -44,189 +139,726 @@ static bool isFalsey(Value value) {
 }
 
 /**
- * Concatenates two strings.
+ * Concatenates the two strings on top of the stack.
+ * @param vm the virtual machine.
+ */
+static void concatenate(VM *vm) {
+    Value result = concatenateStrings(vm, peek(vm, 1), peek(vm, 0));
+    pop(vm);
+    pop(vm);
+    push(vm, result);
+}
+
+/**
+ * Doubles the capacity of the value stack. The stack moves, so the stack
+ * pointers held by the VM, its call frames and its open upvalues are rebased.
+ * The old stack is only freed once they are, since comparing them against it
+ * after realloc() had freed it would be undefined.
+ * @param vm the virtual machine.
+ */
+static void growStack(VM *vm) {
+    Value *oldStack = vm->stack;
+    int capacity = GROW_CAPACITY(vm->stackCapacity);
+    Value *stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, oldStack, sizeof(Value) * vm->stackCapacity);
+
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+    vm->stackTop = stack + (vm->stackTop - oldStack);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - oldStack);
+    }
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - oldStack);
+    }
+    free(oldStack);
+}
+
+/**
+ * Doubles the capacity of the call frame array, up to the maximum call depth.
+ * @param vm the virtual machine.
+ */
+static void growFrames(VM *vm) {
+    int capacity = GROW_CAPACITY(vm->frameCapacity);
+    if (capacity > vm->maxFrames) capacity = vm->maxFrames;
+
+    CallFrame *frames = (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) exit(1);
+
+    vm->frames = frames;
+    vm->frameCapacity = capacity;
+}
+
+/**
+ * Stores the VM's frames, stack and open upvalues in the running fiber, before another one runs.
+ * @param vm the virtual machine.
+ */
+static void saveFiber(VM *vm) {
+    ObjFiber *fiber = vm->fiber;
+    fiber->frames = vm->frames;
+    fiber->frameCount = vm->frameCount;
+    fiber->frameCapacity = vm->frameCapacity;
+    fiber->stack = vm->stack;
+    fiber->stackTop = vm->stackTop;
+    fiber->stackCapacity = vm->stackCapacity;
+    fiber->openUpvalues = vm->openUpvalues;
+    // The stack was written without barriers while the fiber ran.
+    barrierObject(vm, (Obj*)fiber);
+}
+
+/**
+ * Makes a fiber the running one, handing its frames, stack and open upvalues to the VM.
+ * @param vm the virtual machine.
+ * @param fiber the fiber.
+ */
+static void loadFiber(VM *vm, ObjFiber *fiber) {
+    vm->fiber = fiber;
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->frameCapacity = fiber->frameCapacity;
+    vm->stack = fiber->stack;
+    vm->stackTop = fiber->stackTop;
+    vm->stackCapacity = fiber->stackCapacity;
+    vm->openUpvalues = fiber->openUpvalues;
+    fiber->state = FIBER_RUNNING;
+}
+
+/**
+ * Switches from the running fiber to another one. The running fiber's state must
+ * already say why it stopped: it resumed a fiber, yielded, was queued or parked, or returned.
+ * @param vm the virtual machine.
+ * @param fiber the fiber to switch to, which is new or suspended in a native call.
+ * @param value the value the fiber continues with: the result of that call, or the
+ * argument of its function if it is new.
+ */
+static void switchFiber(VM *vm, ObjFiber *fiber, Value value) {
+    saveFiber(vm);
+    loadFiber(vm, fiber);
+
+    if (fiber->callSlots == 0) {
+        if (fiber->frames[0].closure->function->arity == 1) vm->stack[1] = value;
+        return;
+    }
+    vm->stackTop -= fiber->callSlots;
+    push(vm, value);
+}
+
+/**
+ * Makes the root fiber the running one again, once the script and the fibers it
+ * started have finished, or one of them failed.
+ * @param vm the virtual machine.
+ */
+static void returnToRootFiber(VM *vm) {
+    if (vm->fiber != vm->rootFiber) {
+        saveFiber(vm);
+        loadFiber(vm, vm->rootFiber);
+    }
+    vm->rootFiber->state = FIBER_RUNNING;
+}
+
+/**
+ * Continues the next fiber the scheduler has ready, after the running one was queued
+ * or parked by a native function, waiting for one if need be.
+ * @param vm the virtual machine.
+ * @return the result of the native call when the running fiber is the one that continues,
+ * so the caller of the native carries on as usual.
  */
-static void concatenate() {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+static Value runNextFiber(VM *vm) {
+    ObjFiber *fiber = nextFiber(vm);
+    Value value = fiber->value;
+    fiber->value = NIL_VAL;
+    if (fiber == vm->fiber) {
+        fiber->state = FIBER_RUNNING;
+        return value;
+    }
 
-    ObjString *result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+    switchFiber(vm, fiber, value);
+    return NIL_VAL;
 }
 
 /**
- * Resets the stack.
+ * Ends the running fiber, whose function has returned, and continues the fiber that
+ * resumed it, or else the next one the scheduler has ready.
+ * @param vm the virtual machine.
+ * @param result the value the function returned.
+ * @return whether a fiber continues, false once every fiber has finished.
  */
-static void resetStack() {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+static bool finishFiber(VM *vm, Value result) {
+    ObjFiber *fiber = vm->fiber;
+    ObjFiber *caller = fiber->caller;
+    fiber->state = FIBER_DONE;
+    fiber->caller = NULL;
+    if (caller != NULL) {
+        switchFiber(vm, caller, result);
+        return true;
+    }
+
+    ObjFiber *next = nextFiber(vm);
+    if (next == NULL) {
+        returnToRootFiber(vm);
+        return false;
+    }
+
+    Value value = next->value;
+    next->value = NIL_VAL;
+    switchFiber(vm, next, value);
+    return true;
+}
+
+/**
+ * Resets the stack. Every fiber but the root one is stopped.
+ * @param vm the virtual machine.
+ */
+static void resetStack(VM *vm) {
+    // The fibers waiting for the running one, which will never yield, are stopped with it.
+    for (ObjFiber *fiber = vm->fiber; fiber != NULL && fiber != vm->rootFiber; fiber = fiber->caller) {
+        fiber->state = FIBER_DONE;
+    }
+    if (vm->rootFiber != NULL) {
+        returnToRootFiber(vm);
+        clearScheduler(&vm->scheduler);
+    }
+
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
 }
 
 /**
  * Displays a runtime error and resets the stack.
+ * @param vm the virtual machine.
  * @param format
  * @param ...
  */
-static void runtimeError(const char *format, ...) {
+static void runtimeError(VM *vm, const char *format, ...) {
+    // What the script printed so far comes first.
+    flushOutput(&vm->output);
+
+    Output *errors = &vm->errorOutput;
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    writeFormattedList(errors, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    writeOutput(errors, "\n", 1);
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame *frame = &vm.frames[i];
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        writeFormatted(errors, "[line %d] in ", getLine(&function->chunk, (int)instruction));
         if (function->name == NULL) {
-            fprintf(stderr, "script\n");
+            writeOutput(errors, "script\n", 7);
         } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            writeFormatted(errors, "%.*s()\n", function->name->length, function->name->chars);
         }
     }
 
-    resetStack();
+    resetStack(vm);
+}
+
+/**
+ * Converts an index value to a position in a collection, reporting a runtime error if it is not one.
+ * @param vm the virtual machine.
+ * @param index the index.
+ * @param count the number of elements in the collection.
+ * @return the position, or -1 if the index is not an integer in range.
+ */
+static int collectionIndex(VM *vm, Value index, int count) {
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "Index must be a number.");
+        return -1;
+    }
+
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < count) || number != (double)(int)number) {
+        runtimeError(vm, "Index out of range.");
+        return -1;
+    }
+    return (int)number;
+}
+
+/**
+ * Checks the number of arguments passed to a native function, reporting a runtime error if it is wrong.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments passed.
+ * @param arity the number of arguments expected.
+ * @return whether the number is right.
+ */
+static bool checkArity(VM *vm, int argCount, int arity) {
+    if (argCount == arity) return true;
+    runtimeError(vm, "Expected %d arguments but got %d.", arity, argCount);
+    return false;
+}
+
+/**
+ * Native len function: the number of elements of a list or array, or the length of a string.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value lenNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 1)) return UNDEFINED_VAL;
+    if (IS_LIST(args[0])) return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    if (IS_FLOAT64_ARRAY(args[0])) return NUMBER_VAL(AS_FLOAT64_ARRAY(args[0])->count);
+    if (IS_ANY_STRING(args[0])) return NUMBER_VAL(stringLength(args[0]));
+
+    runtimeError(vm, "Can only take the length of lists, arrays and strings.");
+    return UNDEFINED_VAL;
+}
+
+/**
+ * Native append function: adds a value to the end of a list.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value appendNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 2)) return UNDEFINED_VAL;
+    if (!IS_LIST(args[0])) {
+        runtimeError(vm, "Can only append to lists.");
+        return UNDEFINED_VAL;
+    }
+
+    listAppend(vm, AS_LIST(args[0]), args[1]);
+    return NIL_VAL;
+}
+
+/**
+ * Native float64Array function: makes an array of zeros of the given length,
+ * or an array holding the numbers in the given list.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value float64ArrayNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 1)) return UNDEFINED_VAL;
+
+    if (IS_LIST(args[0])) {
+        ValueArray *items = &AS_LIST(args[0])->items;
+        for (int i = 0; i < items->count; i++) {
+            if (!IS_NUMBER(items->values[i])) {
+                runtimeError(vm, "Array elements must be numbers.");
+                return UNDEFINED_VAL;
+            }
+        }
+
+        ObjFloat64Array *array = newFloat64Array(vm, items->count);
+        for (int i = 0; i < items->count; i++) {
+            array->values[i] = AS_NUMBER(items->values[i]);
+        }
+        return OBJ_VAL(array);
+    }
+
+    double length = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : -1;
+    if (!(length >= 0 && length <= INT32_MAX / sizeof(double)) || length != (double)(int)length) {
+        runtimeError(vm, "Expected a list or an array length.");
+        return UNDEFINED_VAL;
+    }
+    return OBJ_VAL(newFloat64Array(vm, (int)length));
+}
+
+/**
+ * Gets an array argument of a native function, reporting a runtime error if it is not one.
+ * @param vm the virtual machine.
+ * @param value the argument.
+ * @return the array, or NULL if the argument is not an array.
+ */
+static ObjFloat64Array *arrayArgument(VM *vm, Value value) {
+    if (IS_FLOAT64_ARRAY(value)) return AS_FLOAT64_ARRAY(value);
+    runtimeError(vm, "Expected a Float64Array.");
+    return NULL;
+}
+
+/**
+ * Native sum function: adds up the numbers of an array.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value sumNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 1)) return UNDEFINED_VAL;
+    ObjFloat64Array *array = arrayArgument(vm, args[0]);
+    if (array == NULL) return UNDEFINED_VAL;
+
+    return NUMBER_VAL(vectorSum(array->values, array->count));
+}
+
+/**
+ * Native dot function: the dot product of two arrays of the same length.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value dotNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 2)) return UNDEFINED_VAL;
+    ObjFloat64Array *a = arrayArgument(vm, args[0]);
+    if (a == NULL) return UNDEFINED_VAL;
+    ObjFloat64Array *b = arrayArgument(vm, args[1]);
+    if (b == NULL) return UNDEFINED_VAL;
+
+    if (a->count != b->count) {
+        runtimeError(vm, "Arrays must have the same length.");
+        return UNDEFINED_VAL;
+    }
+    return NUMBER_VAL(vectorDot(a->values, b->values, a->count));
+}
+
+/**
+ * Native mapAdd function: adds a number, or the elements of an array of the
+ * same length, to every element of an array in place.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function: the array.
+ */
+static Value mapAddNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 2)) return UNDEFINED_VAL;
+    ObjFloat64Array *target = arrayArgument(vm, args[0]);
+    if (target == NULL) return UNDEFINED_VAL;
+
+    if (IS_NUMBER(args[1])) {
+        vectorAddScalar(target->values, AS_NUMBER(args[1]), target->count);
+        return args[0];
+    }
+
+    ObjFloat64Array *values = arrayArgument(vm, args[1]);
+    if (values == NULL) return UNDEFINED_VAL;
+    if (values->count != target->count) {
+        runtimeError(vm, "Arrays must have the same length.");
+        return UNDEFINED_VAL;
+    }
+    vectorAdd(target->values, values->values, target->count);
+    return args[0];
+}
+
+/**
+ * Native scale function: multiplies every element of an array by a number in place.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function: the array.
+ */
+static Value scaleNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 2)) return UNDEFINED_VAL;
+    ObjFloat64Array *target = arrayArgument(vm, args[0]);
+    if (target == NULL) return UNDEFINED_VAL;
+    if (!IS_NUMBER(args[1])) {
+        runtimeError(vm, "Scale factor must be a number.");
+        return UNDEFINED_VAL;
+    }
+
+    vectorScale(target->values, AS_NUMBER(args[1]), target->count);
+    return args[0];
 }
 
 /**
  * Defines a native function.
+ * @param vm the virtual machine.
  * @param name the name of the function.
  * @param function the native function.
  */
-static void defineNative(const char *name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+static void defineNative(VM *vm, const char *name, NativeFn function) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+    int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+    vm->globalValues.values[slot] = vm->stack[1];
+    GLOBAL_WRITE_BARRIER(vm, vm->stack[1]);
+    pop(vm);
+    pop(vm);
+}
+
+/**
+ * Compiles the body of a function that was deferred to its first call.
+ * @param vm the virtual machine.
+ * @param function the function.
+ * @return whether the body was compiled.
+ */
+static bool compileBody(VM *vm, ObjFunction *function) {
+    if (compileFunction(vm, function)) return true;
+
+    runtimeError(vm, "Could not compile '%.*s'.", function->name->length, function->name->chars);
+    return false;
 }
 
 /**
  * Calls a Lox function.
+ * @param vm the virtual machine.
  * @param function the function to call.
  * @param argCount the number of arguments.
  * @return whether the function was executed.
  */
-static bool call(ObjClosure *closure, int argCount) {
+static bool call(VM *vm, ObjClosure *closure, int argCount) {
     if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    if (vm->frameCount >= vm->maxFrames) {
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    if (closure->function->lazy != NULL && !compileBody(vm, closure->function)) return false;
+    if (vm->frameCount == vm->frameCapacity) growFrames(vm);
+
+    CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
     return true;
 }
 
 /**
  * Attempts to call a value as a function.
+ * @param vm the virtual machine.
  * @param callee the value to call.
  * @param argCount the number of arguments.
  * @return whether the value was called successfully.
  */
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM *vm, Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return call(vm, bound->method, argCount);
             }
             case OBJ_CLASS: {
                 ObjClass *klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
                 Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (tableGet(&klass->methods, vm->initString, &initializer)) {
+                    return call(vm, AS_CLOSURE(initializer), argCount);
                 } else if (argCount != 0) {
-                    runtimeError("Expected 0 arguments but got %d.", argCount);
+                    runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
                     return false;
                 }
 
                 return true;
             }
             case OBJ_CLOSURE:
-                return call(AS_CLOSURE(callee), argCount);
+                return call(vm, AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                ObjFiber *fiber = vm->fiber;
+                Value result = native(vm, argCount, vm->stackTop - argCount);
+                if (IS_UNDEFINED(result)) return false;
+                // A native that switched fibers leaves its call on the old fiber's stack, to be
+                // replaced by a result when that fiber continues.
+                if (vm->fiber != fiber) return true;
+                vm->stackTop -= argCount + 1;
+                push(vm, result);
                 return true;
             }
             default:
                 break;
         }
     }
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
+/**
+ * Finds the inline cache entry resolved for a receiver shape.
+ * @param cache the inline cache.
+ * @param shape the receiver shape.
+ * @return the entry, or NULL on a cache miss.
+ */
+static CacheEntry *findCacheEntry(InlineCache *cache, ObjShape *shape) {
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        if (cache->entries[i].shape == shape) return &cache->entries[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Takes the next inline cache entry to fill, evicting the oldest once the cache is full.
+ * @param cache the inline cache.
+ * @return the entry.
+ */
+static CacheEntry *claimCacheEntry(InlineCache *cache) {
+    CacheEntry *entry = &cache->entries[cache->nextEntry];
+    cache->nextEntry = (cache->nextEntry + 1) % INLINE_CACHE_SIZE;
+    entry->transition = NULL;
+    return entry;
+}
+
+/**
+ * Records the references a filled inline cache entry holds. The entry belongs to
+ * the function running in the current frame.
+ * @param vm the virtual machine.
+ * @param entry the cache entry.
+ */
+static void cacheBarrier(VM *vm, CacheEntry *entry) {
+    Obj *owner = (Obj*)vm->frames[vm->frameCount - 1].closure->function;
+    if (entry->shape != NULL) WRITE_BARRIER(vm, owner, OBJ_VAL(entry->shape));
+    if (entry->transition != NULL) WRITE_BARRIER(vm, owner, OBJ_VAL(entry->transition));
+    if (entry->method != NULL) WRITE_BARRIER(vm, owner, OBJ_VAL(entry->method));
+}
+
+/**
+ * Resolves a property of an instance to either a field or a method of its class.
+ * Because every class has its own root shape, the receiver's shape determines
+ * both its field layout and its class, so one cache entry can hold either.
+ * @param vm the virtual machine.
+ * @param instance the instance.
+ * @param name the name of the property.
+ * @param cache the inline cache of the accessing instruction.
+ * @param field set to the field's value if the property is a field.
+ * @param method set to the method, or NULL if the property does not exist, when it is not a field.
+ * @return whether the property is a field.
+ */
+static bool resolveProperty(VM *vm, ObjInstance *instance, ObjString *name, InlineCache *cache,
+                            Value *field, ObjClosure **method) {
+    ObjShape *shape = instance->shape;
+    ObjClass *klass = instance->klass;
+    Value value;
+
+    if (shape == NULL) {
+        if (tableGet(&instance->dictionary, name, field)) return true;
+        *method = tableGet(&klass->methods, name, &value) ? AS_CLOSURE(value) : NULL;
+        return false;
+    }
+
+    CacheEntry *entry = findCacheEntry(cache, shape);
+    if (entry != NULL) {
+        if (entry->slot != -1) {
+            *field = instance->fields[entry->slot];
+            return true;
+        }
+
+        if (entry->version == klass->version) {
+            *method = entry->method;
+            return false;
+        }
+    } else {
+        entry = claimCacheEntry(cache);
+    }
+
+    int slot = shapeFind(shape, name);
+    if (slot != -1) {
+        entry->shape = shape;
+        entry->slot = slot;
+        cacheBarrier(vm, entry);
+        *field = instance->fields[slot];
+        return true;
+    }
+
+    if (!tableGet(&klass->methods, name, &value)) {
+        entry->shape = NULL;
+        *method = NULL;
+        return false;
+    }
+
+    entry->shape = shape;
+    entry->slot = -1;
+    entry->version = klass->version;
+    entry->method = AS_CLOSURE(value);
+    cacheBarrier(vm, entry);
+    *method = entry->method;
+    return false;
+}
+
+/**
+ * Stores a field of an instance, replaying a cached slot or shape transition when possible.
+ * @param vm the virtual machine.
+ * @param instance the instance.
+ * @param name the name of the field.
+ * @param cache the inline cache of the storing instruction.
+ * @param value the new value of the field.
+ */
+static void setProperty(VM *vm, ObjInstance *instance, ObjString *name, InlineCache *cache, Value value) {
+    ObjShape *shape = instance->shape;
+    if (shape != NULL) {
+        CacheEntry *entry = findCacheEntry(cache, shape);
+        if (entry != NULL) {
+            if (entry->transition == NULL) {
+                instance->fields[entry->slot] = value;
+                WRITE_BARRIER(vm, instance, value);
+            } else {
+                instanceAddField(vm, instance, entry->transition, value);
+            }
+            return;
+        }
+    }
+
+    instanceSetField(vm, instance, name, value);
+
+    if (shape != NULL && instance->shape != NULL) {
+        CacheEntry *entry = claimCacheEntry(cache);
+        entry->shape = shape;
+        if (instance->shape == shape) {
+            entry->slot = shapeFind(shape, name);
+        } else {
+            entry->slot = instance->shape->slotCount - 1;
+            entry->transition = instance->shape;
+        }
+        cacheBarrier(vm, entry);
+    }
+}
+
+static bool invokeFromClass(VM *vm, ObjClass *klass, ObjString *name, int argCount) {
     Value method;
     if (!tableGet(&klass->methods, name,&method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%.*s'.", name->length, name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
-    Value receiver = peek(argCount);
+static bool invoke(VM *vm, ObjString *name, int argCount, InlineCache *cache) {
+    Value receiver = peek(vm, argCount);
 
     if (!IS_INSTANCE(receiver)) {
-        runtimeError("Only instances have methods.");
+        runtimeError(vm, "Only instances have methods.");
         return false;
     }
 
     ObjInstance *instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    ObjClosure *method;
+    if (resolveProperty(vm, instance, name, cache, &value, &method)) {
+        vm->stackTop[-argCount - 1] = value;
+        return callValue(vm, value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    if (method == NULL) {
+        runtimeError(vm, "Undefined property '%.*s'.", name->length, name->chars);
+        return false;
+    }
+    return call(vm, method, argCount);
 }
 
-static bool bindMethod(ObjClass *klass, ObjString *name) {
+static bool bindMethod(VM *vm, ObjClass *klass, ObjString *name) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%.*s'.", name->length, name->chars);
         return false;
     }
 
-    ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+    ObjBoundMethod *bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
 /**
  * Retrieves an upvalue, or creates one if it does not exist.
+ * @param vm the virtual machine.
  * @param local the local value.
  * @return the upvalue.
  */
-static ObjUpvalue *captureUpvalue(Value *local) {
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
     ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
+    ObjUpvalue *upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
@@ -236,11 +868,13 @@ static ObjUpvalue *captureUpvalue(Value *local) {
         return upvalue;
     }
 
-    ObjUpvalue *createdUpvalue = newUpvalue(local);
+    ObjUpvalue *createdUpvalue = newUpvalue(vm, local);
     createdUpvalue->next = upvalue;
+    // Until it is closed, the upvalue keeps the fiber whose stack it points into alive.
+    createdUpvalue->closed = OBJ_VAL(vm->fiber);
 
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
@@ -250,363 +884,1145 @@ static ObjUpvalue *captureUpvalue(Value *local) {
 
 /**
  * Closes an open upvalue.
+ * @param vm the virtual machine.
  * @param last the last upvalue.
  */
-static void closeUpvalues(Value *last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.openUpvalues;
+static void closeUpvalues(VM *vm, Value *last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue *upvalue = vm->openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        WRITE_BARRIER(vm, upvalue, upvalue->closed);
+        vm->openUpvalues = upvalue->next;
     }
 }
 
-static void defineMethod(ObjString *name) {
-    Value method = peek(0);
-    ObjClass *klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
-    pop();
+static void defineMethod(VM *vm, ObjString *name) {
+    Value method = peek(vm, 0);
+    ObjClass *klass = AS_CLASS(peek(vm, 1));
+    tableSet(vm, &klass->methods, name, method);
+    WRITE_BARRIER(vm, klass, method);
+    klass->version++;
+    pop(vm);
 }
 
 /**
  * Instructs the virtual machine to start interpreting.
+ *
+ * The instruction pointer, the frame's stack slots and the constant pool of
+ * the running function are cached in locals so the hot loop works from
+ * registers. They must be written back with STORE_FRAME() before anything
+ * that inspects the frame (calls, runtime errors) and reloaded with
+ * LOAD_FRAME() whenever the active frame changes.
+ *
+ * Instructions that grow the stack push with PUSH(), which keeps STACK_SLACK
+ * free slots above the top so the stack never moves under a helper or native
+ * and rebases the cached slots when it has to grow.
+ *
+ * It returns when the function at the bottom of the running fiber's call stack
+ * returns, leaving its result as the only value on the stack. Natives that
+ * switch fibers do so between instructions, so the loop carries on in the
+ * fiber they switched to.
+ *
+ * @param vm the virtual machine.
  * @return the result.
  */
-static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+static InterpretResult run(VM *vm) {
+    CallFrame *frame;
+    uint32_t constant;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+
+#define LOAD_FRAME()                                                   \
+    do {                                                               \
+        frame = &vm->frames[vm->frameCount - 1];                         \
+        ip = frame->ip;                                                \
+        slots = frame->slots;                                          \
+        constants = frame->closure->function->chunk.constants.values;  \
+    } while (false)
+
+#define STORE_FRAME() (frame->ip = ip)
 
-#define READ_BYTE() (*frame->ip++)
+#define PUSH(value)                                                    \
+    do {                                                               \
+        if (vm->stackTop + STACK_SLACK >= vm->stack + vm->stackCapacity) { \
+            growStack(vm);                                             \
+            slots = frame->slots;                                      \
+        }                                                              \
+        push(vm, value);                                               \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
 
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+#define RUNTIME_ERROR(...)                \
+    do {                                  \
+        STORE_FRAME();                    \
+        runtimeError(vm, __VA_ARGS__);        \
+        return INTERPRET_RUNTIME_ERROR;   \
+    } while (false)
+
 #define BINARY_OP(valueType, op)                          \
     do {                                                  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers.");    \
-            return INTERPRET_RUNTIME_ERROR;               \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        double b = AS_NUMBER(pop(vm));                      \
+        double a = AS_NUMBER(pop(vm));                      \
+        push(vm, valueType(a op b));                          \
+    } while (false)
+
+#define COMPARE_JUMP(op)                                  \
+    do {                                                  \
+        uint16_t offset = READ_SHORT();                   \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            RUNTIME_ERROR("Operands must be numbers.");   \
         }                                                 \
-        double b = AS_NUMBER(pop());                      \
-        double a = AS_NUMBER(pop());                      \
-        push(valueType(a op b));                          \
+        double b = AS_NUMBER(pop(vm));                    \
+        double a = AS_NUMBER(pop(vm));                    \
+        if (!(a op b)) ip += offset;                      \
     } while (false)
 
+#define REGISTER_OP(op)                                   \
+    do {                                                  \
+        uint8_t target = READ_BYTE();                     \
+        Value a = slots[READ_BYTE()];                     \
+        Value b = slots[READ_BYTE()];                     \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {             \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        slots[target] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+#define LOCALS_OP(op)                                     \
+    do {                                                  \
+        Value a = slots[READ_BYTE()];                     \
+        Value b = slots[READ_BYTE()];                     \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {             \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        PUSH(NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)));   \
+    } while (false)
+
+#ifdef COMPUTED_GOTO
+    static void *dispatchTable[] = {
+        [OP_CONSTANT]            = &&label_OP_CONSTANT,
+        [OP_CONSTANT_LONG]       = &&label_OP_CONSTANT_LONG,
+        [OP_NIL]                 = &&label_OP_NIL,
+        [OP_TRUE]                = &&label_OP_TRUE,
+        [OP_FALSE]               = &&label_OP_FALSE,
+        [OP_POP]                 = &&label_OP_POP,
+        [OP_GET_LOCAL]           = &&label_OP_GET_LOCAL,
+        [OP_GET_GLOBAL]          = &&label_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL]       = &&label_OP_DEFINE_GLOBAL,
+        [OP_SET_LOCAL]           = &&label_OP_SET_LOCAL,
+        [OP_SET_GLOBAL]          = &&label_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE]         = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]         = &&label_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY]        = &&label_OP_GET_PROPERTY,
+        [OP_GET_PROPERTY_LONG]   = &&label_OP_GET_PROPERTY_LONG,
+        [OP_SET_PROPERTY]        = &&label_OP_SET_PROPERTY,
+        [OP_SET_PROPERTY_LONG]   = &&label_OP_SET_PROPERTY_LONG,
+        [OP_GET_SUPER]           = &&label_OP_GET_SUPER,
+        [OP_GET_SUPER_LONG]      = &&label_OP_GET_SUPER_LONG,
+        [OP_SUPER_INVOKE]        = &&label_OP_SUPER_INVOKE,
+        [OP_SUPER_INVOKE_LONG]   = &&label_OP_SUPER_INVOKE_LONG,
+        [OP_EQUAL]               = &&label_OP_EQUAL,
+        [OP_GREATER]             = &&label_OP_GREATER,
+        [OP_LESS]                = &&label_OP_LESS,
+        [OP_ADD]                 = &&label_OP_ADD,
+        [OP_SUBTRACT]            = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY]            = &&label_OP_MULTIPLY,
+        [OP_DIVIDE]              = &&label_OP_DIVIDE,
+        [OP_NOT]                 = &&label_OP_NOT,
+        [OP_NEGATE]              = &&label_OP_NEGATE,
+        [OP_PRINT]               = &&label_OP_PRINT,
+        [OP_JUMP]                = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE]       = &&label_OP_JUMP_IF_FALSE,
+        [OP_LOOP]                = &&label_OP_LOOP,
+        [OP_CALL]                = &&label_OP_CALL,
+        [OP_TAIL_CALL]           = &&label_OP_TAIL_CALL,
+        [OP_INVOKE]              = &&label_OP_INVOKE,
+        [OP_INVOKE_LONG]         = &&label_OP_INVOKE_LONG,
+        [OP_CLOSURE]             = &&label_OP_CLOSURE,
+        [OP_CLOSURE_LONG]        = &&label_OP_CLOSURE_LONG,
+        [OP_CLOSE_UPVALUE]       = &&label_OP_CLOSE_UPVALUE,
+        [OP_RETURN]              = &&label_OP_RETURN,
+        [OP_CLASS]               = &&label_OP_CLASS,
+        [OP_CLASS_LONG]          = &&label_OP_CLASS_LONG,
+        [OP_INHERIT]             = &&label_OP_INHERIT,
+        [OP_METHOD]              = &&label_OP_METHOD,
+        [OP_METHOD_LONG]         = &&label_OP_METHOD_LONG,
+        [OP_BUILD_LIST]          = &&label_OP_BUILD_LIST,
+        [OP_GET_INDEX]           = &&label_OP_GET_INDEX,
+        [OP_SET_INDEX]           = &&label_OP_SET_INDEX,
+        [OP_ADD_LOCAL_CONSTANT]  = &&label_OP_ADD_LOCAL_CONSTANT,
+        [OP_JUMP_IF_NOT_LESS]    = &&label_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_GREATER] = &&label_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_EQUAL]   = &&label_OP_JUMP_IF_NOT_EQUAL,
+        [OP_GET_LOCAL_PROPERTY]  = &&label_OP_GET_LOCAL_PROPERTY,
+        [OP_ADD_REGISTERS]       = &&label_OP_ADD_REGISTERS,
+        [OP_SUBTRACT_REGISTERS]  = &&label_OP_SUBTRACT_REGISTERS,
+        [OP_MULTIPLY_REGISTERS]  = &&label_OP_MULTIPLY_REGISTERS,
+        [OP_DIVIDE_REGISTERS]    = &&label_OP_DIVIDE_REGISTERS,
+        [OP_ADD_LOCALS]          = &&label_OP_ADD_LOCALS,
+        [OP_SUBTRACT_LOCALS]     = &&label_OP_SUBTRACT_LOCALS,
+        [OP_MULTIPLY_LOCALS]     = &&label_OP_MULTIPLY_LOCALS,
+        [OP_DIVIDE_LOCALS]       = &&label_OP_DIVIDE_LOCALS
+    };
+
+    // While profiling every opcode is first dispatched to the profiler.
+    void *profileTable[OPCODE_COUNT];
+    void **dispatch = dispatchTable;
+    if (vm->profiler != NULL) {
+        for (int i = 0; i < OPCODE_COUNT; i++) profileTable[i] = &&label_profile;
+        dispatch = profileTable;
+    }
+
+#define DISPATCH()   goto *dispatch[instruction = READ_BYTE()];
+#define CASE(opcode) label_##opcode:
+#ifdef DEBUG_TRACE_EXECUTION
+#define NEXT()       continue
+#else
+#define NEXT()       goto *dispatch[instruction = READ_BYTE()]
+#endif
+#else
+#define DISPATCH()                                   \
+    if (vm->profiler != NULL) {                      \
+        frame->ip = ip + 1;                          \
+        profileInstruction(vm, *ip);                 \
+    }                                                \
+    switch (instruction = READ_BYTE())
+#define CASE(opcode) case opcode:
+#define NEXT()       break
+#endif
+
+    LOAD_FRAME();
+
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
             printf("[ ");
             printValue(*slot);
             printf(" ]");
         }
         printf("\n");
 
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int)(frame->ip - frame->closure->function->chunk.code));
+        disassembleInstruction(vm, &frame->closure->function->chunk,
+                               (int)(ip - frame->closure->function->chunk.code));
 #endif
 
         uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+        DISPATCH() {
+            CASE(OP_CONSTANT) {
+                PUSH(READ_CONSTANT());
+                NEXT();
             }
-            case OP_NIL:      push(NIL_VAL); break;
-            case OP_TRUE:     push(BOOL_VAL(true)); break;
-            case OP_FALSE:    push(BOOL_VAL(false)); break;
-            case OP_POP:      pop(); break;
-            case OP_GET_LOCAL: {
+            CASE(OP_CONSTANT_LONG) {
+                PUSH(constants[READ_LONG()]);
+                NEXT();
+            }
+            CASE(OP_NIL)      PUSH(NIL_VAL); NEXT();
+            CASE(OP_TRUE)     PUSH(BOOL_VAL(true)); NEXT();
+            CASE(OP_FALSE)    PUSH(BOOL_VAL(false)); NEXT();
+            CASE(OP_POP)      pop(vm); NEXT();
+            CASE(OP_GET_LOCAL) {
                 uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+                PUSH(slots[slot]);
+                NEXT();
             }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_GLOBAL) {
+                uint16_t slot = READ_SHORT();
+                Value value = vm->globalValues.values[slot];
+                if (IS_UNDEFINED(value)) {
+                    ObjString *name = AS_STRING(vm->globalNames.values[slot]);
+                    RUNTIME_ERROR("Undefined variable '%.*s'.", name->length, name->chars);
                 }
-                push(value);
-                break;
+                PUSH(value);
+                NEXT();
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            CASE(OP_DEFINE_GLOBAL) {
+                uint16_t slot = READ_SHORT();
+                vm->globalValues.values[slot] = pop(vm);
+                GLOBAL_WRITE_BARRIER(vm, vm->globalValues.values[slot]);
+                NEXT();
             }
-            case OP_SET_LOCAL: {
+            CASE(OP_SET_LOCAL) {
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+                slots[slot] = peek(vm, 0);
+                NEXT();
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SET_GLOBAL) {
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+                    ObjString *name = AS_STRING(vm->globalNames.values[slot]);
+                    RUNTIME_ERROR("Undefined variable '%.*s'.", name->length, name->chars);
                 }
-                break;
+                vm->globalValues.values[slot] = peek(vm, 0);
+                GLOBAL_WRITE_BARRIER(vm, peek(vm, 0));
+                NEXT();
             }
-            case OP_GET_UPVALUE: {
+            CASE(OP_GET_UPVALUE) {
                 uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+                PUSH(*frame->closure->upvalues[slot]->location);
+                NEXT();
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_SET_UPVALUE) {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+                *upvalue->location = peek(vm, 0);
+                WRITE_BARRIER(vm, upvalue, peek(vm, 0));
+                NEXT();
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_PROPERTY_LONG)
+                constant = READ_LONG();
+                goto getProperty;
+            CASE(OP_GET_LOCAL_PROPERTY) {
+                Value receiver = slots[READ_BYTE()];
+                if (!IS_INSTANCE(receiver)) {
+                    RUNTIME_ERROR("Only instances have properties.");
                 }
 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
                 ObjString *name = READ_STRING();
+                InlineCache *cache = READ_CACHE();
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
+                ObjClosure *method;
+                if (resolveProperty(vm, AS_INSTANCE(receiver), name, cache, &value, &method)) {
+                    PUSH(value);
+                    NEXT();
                 }
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (method == NULL) {
+                    RUNTIME_ERROR("Undefined property '%.*s'.", name->length, name->chars);
                 }
-                break;
+
+                PUSH(OBJ_VAL(newBoundMethod(vm, receiver, method)));
+                NEXT();
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_PROPERTY)
+                constant = READ_BYTE();
+            getProperty: {
+                if (!IS_INSTANCE(peek(vm, 0))) {
+                    RUNTIME_ERROR("Only instances have properties.");
                 }
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+                ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
+                ObjString *name = AS_STRING(constants[constant]);
+                InlineCache *cache = READ_CACHE();
+
+                Value value;
+                ObjClosure *method;
+                if (resolveProperty(vm, instance, name, cache, &value, &method)) {
+                    pop(vm);
+                    push(vm, value);
+                    NEXT();
+                }
+
+                if (method == NULL) {
+                    RUNTIME_ERROR("Undefined property '%.*s'.", name->length, name->chars);
+                }
+
+                ObjBoundMethod *bound = newBoundMethod(vm, peek(vm, 0), method);
+                pop(vm);
+                push(vm, OBJ_VAL(bound));
+                NEXT();
             }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
+            CASE(OP_SET_PROPERTY_LONG)
+                constant = READ_LONG();
+                goto setProperty;
+            CASE(OP_SET_PROPERTY)
+                constant = READ_BYTE();
+            setProperty: {
+                if (!IS_INSTANCE(peek(vm, 1))) {
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
 
-                if (!bindMethod(superclass, name)) {
+                ObjInstance *instance = AS_INSTANCE(peek(vm, 1));
+                ObjString *name = AS_STRING(constants[constant]);
+                setProperty(vm, instance, name, READ_CACHE(), peek(vm, 0));
+                Value value = pop(vm);
+                pop(vm);
+                push(vm, value);
+                NEXT();
+            }
+            CASE(OP_GET_SUPER_LONG)
+                constant = READ_LONG();
+                goto getSuper;
+            CASE(OP_GET_SUPER)
+                constant = READ_BYTE();
+            getSuper: {
+                ObjString *name = AS_STRING(constants[constant]);
+                ObjClass *superclass = AS_CLASS(pop(vm));
+
+                STORE_FRAME();
+                if (!bindMethod(vm, superclass, name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                NEXT();
             }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
+            CASE(OP_SUPER_INVOKE_LONG)
+                constant = READ_LONG();
+                goto superInvoke;
+            CASE(OP_SUPER_INVOKE)
+                constant = READ_BYTE();
+            superInvoke: {
+                ObjString *method = AS_STRING(constants[constant]);
                 int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
+                ObjClass *superclass = AS_CLASS(pop(vm));
+                STORE_FRAME();
+                if (!invokeFromClass(vm, superclass, method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                NEXT();
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            CASE(OP_EQUAL) {
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(valuesEqual(a, b)));
+                NEXT();
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+            CASE(OP_GREATER)  BINARY_OP(BOOL_VAL, >); NEXT();
+            CASE(OP_LESS)     BINARY_OP(BOOL_VAL, <); NEXT();
+            CASE(OP_ADD) {
+                if (IS_ANY_STRING(peek(vm, 0)) && IS_ANY_STRING(peek(vm, 1))) {
+                    concatenate(vm);
+                } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                    double b = AS_NUMBER(pop(vm));
+                    double a = AS_NUMBER(pop(vm));
+                    push(vm, NUMBER_VAL(a + b));
                 } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                break;
+                NEXT();
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE: {
-                if (IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_ADD_LOCAL_CONSTANT) {
+                uint8_t slot = READ_BYTE();
+                Value b = READ_CONSTANT();
+                if (IS_NUMBER(slots[slot]) && IS_NUMBER(b)) {
+                    slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) + AS_NUMBER(b));
+                } else if (IS_ANY_STRING(slots[slot]) && IS_STRING(b)) {
+                    push(vm, slots[slot]);
+                    push(vm, b);
+                    concatenate(vm);
+                    slots[slot] = pop(vm);
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+                NEXT();
             }
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                disassembleInstruction(&frame->closure->function->chunk,
-                                       (int)(frame->ip - frame->closure->function->chunk.code));
-                break;
+            CASE(OP_ADD_REGISTERS) {
+                uint8_t target = READ_BYTE();
+                Value a = slots[READ_BYTE()];
+                Value b = slots[READ_BYTE()];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    slots[target] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+                    push(vm, a);
+                    push(vm, b);
+                    concatenate(vm);
+                    slots[target] = pop(vm);
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                NEXT();
             }
-            case OP_JUMP: {
+            CASE(OP_ADD_LOCALS) {
+                Value a = slots[READ_BYTE()];
+                Value b = slots[READ_BYTE()];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+                    PUSH(a);
+                    push(vm, b);
+                    concatenate(vm);
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                NEXT();
+            }
+            CASE(OP_SUBTRACT) BINARY_OP(NUMBER_VAL, -); NEXT();
+            CASE(OP_MULTIPLY) BINARY_OP(NUMBER_VAL, *); NEXT();
+            CASE(OP_DIVIDE)   BINARY_OP(NUMBER_VAL, /); NEXT();
+            CASE(OP_SUBTRACT_REGISTERS) REGISTER_OP(-); NEXT();
+            CASE(OP_MULTIPLY_REGISTERS) REGISTER_OP(*); NEXT();
+            CASE(OP_DIVIDE_REGISTERS)   REGISTER_OP(/); NEXT();
+            CASE(OP_SUBTRACT_LOCALS)    LOCALS_OP(-); NEXT();
+            CASE(OP_MULTIPLY_LOCALS)    LOCALS_OP(*); NEXT();
+            CASE(OP_DIVIDE_LOCALS)      LOCALS_OP(/); NEXT();
+            CASE(OP_NOT)
+                push(vm, BOOL_VAL(isFalsey(pop(vm))));
+                NEXT();
+            CASE(OP_NEGATE) {
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+                NEXT();
+            }
+            CASE(OP_PRINT) {
+                writeValue(&vm->output, pop(vm));
+                writeOutput(&vm->output, "\n", 1);
+                NEXT();
+            }
+            CASE(OP_JUMP) {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                ip += offset;
+                NEXT();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE) {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+                if (isFalsey(peek(vm, 0))) ip += offset;
+                NEXT();
             }
-            case OP_LOOP: {
+            CASE(OP_JUMP_IF_NOT_LESS)    COMPARE_JUMP(<); NEXT();
+            CASE(OP_JUMP_IF_NOT_GREATER) COMPARE_JUMP(>); NEXT();
+            CASE(OP_JUMP_IF_NOT_EQUAL) {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                Value b = pop(vm);
+                Value a = pop(vm);
+                if (!valuesEqual(a, b)) ip += offset;
+                NEXT();
             }
-            case OP_CALL: {
+            CASE(OP_LOOP) {
+                uint16_t offset = READ_SHORT();
+#ifdef JIT
+                ObjFunction *function = frame->closure->function;
+                if (function->jit == NULL && ++function->backEdges == JIT_THRESHOLD) {
+                    function->jit = compileLoops(function);
+                }
+                if (function->jit != NULL) {
+                    JitLoop *loop = findJitLoop(function->jit, (int)(ip - 3 - function->chunk.code));
+                    if (loop != NULL) {
+                        while (vm->stackTop + loop->stackNeeded + STACK_SLACK >= vm->stack + vm->stackCapacity) {
+                            growStack(vm);
+                        }
+                        ip = function->chunk.code + loop->entry(vm, frame->slots, constants);
+                        slots = frame->slots;
+                        NEXT();
+                    }
+                }
+#endif
+                ip -= offset;
+                NEXT();
+            }
+            CASE(OP_CALL) {
                 int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
+                STORE_FRAME();
+                if (!callValue(vm, peek(vm, argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                NEXT();
             }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
+            CASE(OP_TAIL_CALL) {
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                Value callee = peek(vm, argCount);
+                ObjClosure *closure;
+                if (IS_CLOSURE(callee)) {
+                    closure = AS_CLOSURE(callee);
+                } else if (IS_BOUND_METHOD(callee)) {
+                    closure = AS_BOUND_METHOD(callee)->method;
+                    vm->stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+                } else {
+                    // Anything else is called as usual and returned by the OP_RETURN that follows.
+                    STORE_FRAME();
+                    if (!callValue(vm, callee, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    NEXT();
+                }
+
+                if (argCount != closure->function->arity) {
+                    RUNTIME_ERROR("Expected %d arguments but got %d.", closure->function->arity, argCount);
+                }
+                if (closure->function->lazy != NULL) {
+                    STORE_FRAME();
+                    if (!compileBody(vm, closure->function)) return INTERPRET_RUNTIME_ERROR;
+                    // Compiling may have grown the stack.
+                    slots = frame->slots;
+                }
+
+                // Replace the caller's slots with the callee and its arguments.
+                closeUpvalues(vm, slots);
+                memmove(slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+                vm->stackTop = slots + argCount + 1;
+                frame->closure = closure;
+                frame->ip = closure->function->chunk.code;
+                LOAD_FRAME();
+                NEXT();
+            }
+            CASE(OP_INVOKE_LONG)
+                constant = READ_LONG();
+                goto invoke;
+            CASE(OP_INVOKE)
+                constant = READ_BYTE();
+            invoke: {
+                ObjString *method = AS_STRING(constants[constant]);
+                int argCount = READ_BYTE();
+                InlineCache *cache = READ_CACHE();
+                STORE_FRAME();
+                if (!invoke(vm, method, argCount, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                NEXT();
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
+            CASE(OP_CLOSURE_LONG)
+                constant = READ_LONG();
+                goto closure;
+            CASE(OP_CLOSURE)
+                constant = READ_BYTE();
+            closure: {
+                ObjFunction *function = AS_FUNCTION(constants[constant]);
+                if (function->upvalueCount == 0) {
+                    // With nothing to capture, every definition can share one closure.
+                    if (function->closure == NULL) {
+                        function->closure = newClosure(vm, function);
+                        WRITE_BARRIER(vm, function, OBJ_VAL(function->closure));
+                    }
+                    PUSH(OBJ_VAL(function->closure));
+                    NEXT();
+                }
+
+                ObjClosure *closure = newClosure(vm, function);
+                PUSH(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
                     uint8_t index = READ_BYTE();
                     if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        closure->upvalues[i] = captureUpvalue(vm, slots + index);
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    WRITE_BARRIER(vm, closure, OBJ_VAL(closure->upvalues[i]));
                 }
-                break;
+                NEXT();
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            CASE(OP_CLOSE_UPVALUE) {
+                closeUpvalues(vm, vm->stackTop - 1);
+                pop(vm);
+                NEXT();
             }
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
+            CASE(OP_RETURN) {
+                Value result = pop(vm);
+                closeUpvalues(vm, slots);
+                vm->frameCount--;
+                if (vm->frameCount == 0) {
+                    // The result replaces the function, for runFibers() to hand on.
+                    vm->stackTop = slots;
+                    push(vm, result);
                     return INTERPRET_OK;
                 }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                vm->stackTop = slots;
+                push(vm, result);
+                LOAD_FRAME();
+                NEXT();
             }
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
+            CASE(OP_CLASS) {
+                PUSH(OBJ_VAL(newClass(vm, READ_STRING())));
+                NEXT();
+            }
+            CASE(OP_CLASS_LONG) {
+                PUSH(OBJ_VAL(newClass(vm, AS_STRING(constants[READ_LONG()]))));
+                NEXT();
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
+            CASE(OP_INHERIT) {
+                Value superclass = peek(vm, 1);
 
                 if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
-                break;
+                ObjClass *subclass = AS_CLASS(peek(vm, 0));
+                tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+                barrierObject(vm, (Obj*)subclass);
+                subclass->version++;
+                pop(vm);
+                NEXT();
             }
-            case OP_METHOD: {
-                defineMethod(READ_STRING());
-                break;
+            CASE(OP_METHOD) {
+                defineMethod(vm, READ_STRING());
+                NEXT();
             }
+            CASE(OP_METHOD_LONG) {
+                defineMethod(vm, AS_STRING(constants[READ_LONG()]));
+                NEXT();
+            }
+            CASE(OP_BUILD_LIST) {
+                int count = READ_BYTE();
+                ObjList *list = newList(vm, count);
+                if (count > 0) memcpy(list->items.values, vm->stackTop - count, sizeof(Value) * count);
+                vm->stackTop -= count;
+                PUSH(OBJ_VAL(list));
+                NEXT();
+            }
+            CASE(OP_GET_INDEX) {
+                Value target = peek(vm, 1);
+                Value result;
+                STORE_FRAME();
+                if (IS_LIST(target)) {
+                    ObjList *list = AS_LIST(target);
+                    int index = collectionIndex(vm, peek(vm, 0), list->items.count);
+                    if (index < 0) return INTERPRET_RUNTIME_ERROR;
+                    result = list->items.values[index];
+                } else if (IS_FLOAT64_ARRAY(target)) {
+                    ObjFloat64Array *array = AS_FLOAT64_ARRAY(target);
+                    int index = collectionIndex(vm, peek(vm, 0), array->count);
+                    if (index < 0) return INTERPRET_RUNTIME_ERROR;
+                    result = NUMBER_VAL(array->values[index]);
+                } else {
+                    RUNTIME_ERROR("Only lists and arrays can be indexed.");
+                }
+                vm->stackTop -= 2;
+                PUSH(result);
+                NEXT();
+            }
+            CASE(OP_SET_INDEX) {
+                Value target = peek(vm, 2);
+                Value value = peek(vm, 0);
+                STORE_FRAME();
+                if (IS_LIST(target)) {
+                    ObjList *list = AS_LIST(target);
+                    int index = collectionIndex(vm, peek(vm, 1), list->items.count);
+                    if (index < 0) return INTERPRET_RUNTIME_ERROR;
+                    list->items.values[index] = value;
+                    WRITE_BARRIER(vm, list, value);
+                } else if (IS_FLOAT64_ARRAY(target)) {
+                    ObjFloat64Array *array = AS_FLOAT64_ARRAY(target);
+                    int index = collectionIndex(vm, peek(vm, 1), array->count);
+                    if (index < 0) return INTERPRET_RUNTIME_ERROR;
+                    if (!IS_NUMBER(value)) RUNTIME_ERROR("Array elements must be numbers.");
+                    array->values[index] = AS_NUMBER(value);
+                } else {
+                    RUNTIME_ERROR("Only lists and arrays can be indexed.");
+                }
+                vm->stackTop -= 3;
+                PUSH(value);
+                NEXT();
+            }
+#ifdef COMPUTED_GOTO
+            label_profile:
+                STORE_FRAME();
+                profileInstruction(vm, instruction);
+                goto *dispatchTable[instruction];
+#endif
         }
     }
 
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef PUSH
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_STRING
+#undef READ_CACHE
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef REGISTER_OP
+#undef LOCALS_OP
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+}
+
+/**
+ * Runs the script until every fiber has finished. Each time the function of a fiber
+ * returns, the next fiber is continued here rather than in run(), to keep the
+ * interpreter loop small.
+ * @param vm the virtual machine.
+ * @return the result.
+ */
+static InterpretResult runFibers(VM *vm) {
+    for (;;) {
+        InterpretResult result = run(vm);
+        if (result != INTERPRET_OK) return result;
+        if (!finishFiber(vm, pop(vm))) return INTERPRET_OK;
+    }
+}
+
+/**
+ * Gets the closure a fiber is to run, reporting a runtime error if the value is not
+ * a function of at most one parameter. A body deferred by lazy compilation is compiled.
+ * @param vm the virtual machine.
+ * @param value the value.
+ * @return the closure, or NULL after an error.
+ */
+static ObjClosure *fiberClosure(VM *vm, Value value) {
+    if (!IS_CLOSURE(value) || AS_CLOSURE(value)->function->arity > 1) {
+        runtimeError(vm, "A fiber runs a function of 0 or 1 parameters.");
+        return NULL;
+    }
+
+    ObjClosure *closure = AS_CLOSURE(value);
+    if (closure->function->lazy != NULL && !compileBody(vm, closure->function)) return NULL;
+    return closure;
+}
+
+/**
+ * Native fiber function: makes a fiber that runs a function when it is resumed.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value fiberNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 1)) return UNDEFINED_VAL;
+    ObjClosure *closure = fiberClosure(vm, args[0]);
+    if (closure == NULL) return UNDEFINED_VAL;
+    return OBJ_VAL(newFiber(vm, closure));
+}
+
+/**
+ * Native resume function: runs a fiber until it yields, which returns the value it
+ * yielded, or until its function returns, which returns the function's result.
+ * The optional second argument is the result of the yield() the fiber is suspended in,
+ * or the argument of its function when it first runs.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value resumeNative(VM *vm, int argCount, Value *args) {
+    if (argCount != 1 && argCount != 2) {
+        runtimeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+        return UNDEFINED_VAL;
+    }
+    if (!IS_FIBER(args[0])) {
+        runtimeError(vm, "Can only resume fibers.");
+        return UNDEFINED_VAL;
+    }
+
+    ObjFiber *fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_DONE) {
+        runtimeError(vm, "Cannot resume a finished fiber.");
+        return UNDEFINED_VAL;
+    }
+    if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+        runtimeError(vm, "Cannot resume a fiber that is running or scheduled.");
+        return UNDEFINED_VAL;
+    }
+
+    fiber->caller = vm->fiber;
+    WRITE_BARRIER(vm, fiber, OBJ_VAL(vm->fiber));
+    vm->fiber->callSlots = argCount + 1;
+    switchFiber(vm, fiber, argCount == 2 ? args[1] : NIL_VAL);
+    return NIL_VAL;
+}
+
+/**
+ * Native yield function: suspends the running fiber. A fiber started by resume() hands
+ * the optional argument back to the fiber that resumed it, and returns what it is next
+ * resumed with. Any other fiber lets the fibers the scheduler has ready run first, and
+ * returns nil.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value yieldNative(VM *vm, int argCount, Value *args) {
+    if (argCount > 1) {
+        runtimeError(vm, "Expected 0 or 1 arguments but got %d.", argCount);
+        return UNDEFINED_VAL;
+    }
+
+    ObjFiber *fiber = vm->fiber;
+    ObjFiber *caller = fiber->caller;
+    fiber->callSlots = argCount + 1;
+    if (caller == NULL) {
+        scheduleFiber(vm, fiber, NIL_VAL);
+        return runNextFiber(vm);
+    }
+
+    fiber->state = FIBER_SUSPENDED;
+    fiber->caller = NULL;
+    switchFiber(vm, caller, argCount == 1 ? args[0] : NIL_VAL);
+    return NIL_VAL;
+}
+
+/**
+ * Native spawn function: makes a fiber that runs a function once the running fiber
+ * yields, sleeps, waits for input or returns, and returns the fiber.
+ * The optional second argument is passed to the function.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value spawnNative(VM *vm, int argCount, Value *args) {
+    if (argCount != 1 && argCount != 2) {
+        runtimeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+        return UNDEFINED_VAL;
+    }
+    ObjClosure *closure = fiberClosure(vm, args[0]);
+    if (closure == NULL) return UNDEFINED_VAL;
+
+    ObjFiber *fiber = newFiber(vm, closure);
+    scheduleFiber(vm, fiber, argCount == 2 ? args[1] : NIL_VAL);
+    return OBJ_VAL(fiber);
+}
+
+/**
+ * Native sleep function: parks the running fiber for a number of seconds while
+ * other fibers run, and returns nil.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value sleepNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 1)) return UNDEFINED_VAL;
+    if (!IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0)) {
+        runtimeError(vm, "Can only sleep for a number of seconds that is not negative.");
+        return UNDEFINED_VAL;
+    }
+
+    vm->fiber->callSlots = argCount + 1;
+    sleepFiber(vm, vm->fiber, AS_NUMBER(args[0]));
+    return runNextFiber(vm);
+}
+
+/**
+ * Native readLine function: reads a line of the standard input and returns it without
+ * its newline, or nil at the end of the input. Other fibers run while it waits.
+ * @param vm the virtual machine.
+ * @param argCount the number of arguments taken by the native function.
+ * @param args the list of arguments.
+ * @return the value returned from the native function.
+ */
+static Value readLineNative(VM *vm, int argCount, Value *args) {
+    if (!checkArity(vm, argCount, 0)) return UNDEFINED_VAL;
+    Value line = takeInputLine(vm);
+    if (!IS_UNDEFINED(line)) return line;
+
+    vm->fiber->callSlots = argCount + 1;
+    waitForInput(vm, vm->fiber);
+    return runNextFiber(vm);
+}
+
+/**
+ * Defines the native functions as global variables.
+ * @param vm the virtual machine.
+ */
+static void defineNatives(VM *vm) {
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "gcStats", gcStatsNative);
+    defineNative(vm, "len", lenNative);
+    defineNative(vm, "append", appendNative);
+    defineNative(vm, "float64Array", float64ArrayNative);
+    defineNative(vm, "sum", sumNative);
+    defineNative(vm, "dot", dotNative);
+    defineNative(vm, "mapAdd", mapAddNative);
+    defineNative(vm, "scale", scaleNative);
+    defineNative(vm, "fiber", fiberNative);
+    defineNative(vm, "resume", resumeNative);
+    defineNative(vm, "yield", yieldNative);
+    defineNative(vm, "spawn", spawnNative);
+    defineNative(vm, "sleep", sleepNative);
+    defineNative(vm, "readLine", readLineNative);
+}
+
+/**
+ * Initialises the virtual machine.
+ * @param vm the virtual machine.
+ */
+static void initVM(VM *vm) {
+    vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->maxFrames = FRAMES_MAX;
+    vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    vm->stackCapacity = STACK_INITIAL;
+    if (vm->frames == NULL || vm->stack == NULL) exit(1);
+    vm->fiber = NULL;
+    vm->rootFiber = NULL;
+    initScheduler(&vm->scheduler);
+    resetStack(vm);
+    initAllocator(&vm->allocator);
+    vm->objects = NULL;
+
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->oldObjects = NULL;
+    vm->nurseryBytes = 0;
+    vm->nurserySize = GC_NURSERY_SIZE;
+    vm->isMinorGC = false;
+    vm->gcPhase = GC_IDLE;
+    vm->gcStepBudget = GC_STEP_BUDGET;
+    memset(&vm->gcStats, 0, sizeof(GcStats));
+    vm->sweepObjects = NULL;
+
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->remembered = NULL;
+
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    initTable(&vm->strings);
+
+    vm->sources = NULL;
+#ifdef DEBUG_TRACE_EXECUTION
+    // Unbuffered, so that what scripts print stays in order with the trace.
+    initOutput(&vm->output, writeFile, stdout, 0);
+#else
+    initOutput(&vm->output, writeFile, stdout, OUTPUT_BUFFER_SIZE);
+#endif
+    initOutput(&vm->errorOutput, writeFile, stderr, 0);
+    vm->profiler = NULL;
+    vm->parser = NULL;
+    vm->lazyFunctions = false;
+    vm->initString = NULL;
+    vm->initString = copyString(vm, "init", 4);
+    vm->rootFiber = newFiber(vm, NULL);
+    vm->rootFiber->state = FIBER_RUNNING;
+    vm->fiber = vm->rootFiber;
+
+    defineNatives(vm);
 }
 
 /* ===== End static functions ===== */
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
+VM *newVM() {
+    VM *vm = (VM*)malloc(sizeof(VM));
+    if (vm == NULL) exit(1);
+
+    initVM(vm);
+    return vm;
+}
+
+void freeVM(VM *vm) {
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->globalValues);
+    freeTable(vm, &vm->strings);
+    vm->initString = NULL;
+    // The fibers free their own stacks, the root one included.
+    saveFiber(vm);
+    freeObjects(vm);
+    freeScheduler(&vm->scheduler);
+    freeAllocator(&vm->allocator);
+
+    Source *source = vm->sources;
+    while (source != NULL) {
+        Source *next = source->next;
+        closeSource(source);
+        source = next;
+    }
+
+    stopProfiler(vm);
+    freeOutput(&vm->output);
+    freeOutput(&vm->errorOutput);
+    free(vm);
+}
 
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+void resetVM(VM *vm) {
+    resetStack(vm);
 
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->globalValues);
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    defineNatives(vm);
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    collectGarbage(vm);
+}
 
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+void holdSource(VM *vm, Source *source) {
+    source->next = vm->sources;
+    vm->sources = source;
+}
 
-    defineNative("clock", clockNative);
+bool holdsSource(VM *vm, const char *chars) {
+    for (Source *source = vm->sources; source != NULL; source = source->next) {
+        if (chars >= source->chars && chars <= source->chars + source->length) return true;
+    }
+    return false;
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    vm.initString = NULL;
-    freeObjects();
+int globalSlot(VM *vm, ObjString *name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(vm, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+    GLOBAL_WRITE_BARRIER(vm, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+    int index = vm->globalValues.count - 1;
+    tableSet(vm, &vm->globalSlots, name, NUMBER_VAL((double)index));
+    pop(vm);
+    return index;
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+void push(VM *vm, Value value) {
+    if (vm->stackTop == vm->stack + vm->stackCapacity) growStack(vm);
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(VM *vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-InterpretResult interpret(const char *source) {
-    ObjFunction *function = compile(source);
+InterpretResult interpret(VM *vm, const char *source) {
+    ObjFunction *function = compile(vm, source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    ObjClosure *closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
+    return interpretFunction(vm, function);
+}
 
-    return run();
+InterpretResult interpretFunction(VM *vm, ObjFunction *function) {
+    push(vm, OBJ_VAL(function));
+    ObjClosure *closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    call(vm, closure, 0);
+
+    InterpretResult result = runFibers(vm);
+    flushOutput(&vm->output);
+    return result;
+}
+
+void setOutput(VM *vm, WriteFn write, void *context) {
+    flushOutput(&vm->output);
+    vm->output.write = write == NULL ? writeFile : write;
+    vm->output.context = write == NULL ? stdout : context;
 }
 
+void setErrorOutput(VM *vm, WriteFn write, void *context) {
+    flushOutput(&vm->errorOutput);
+    vm->errorOutput.write = write == NULL ? writeFile : write;
+    vm->errorOutput.context = write == NULL ? stderr : context;
+}
+
+void getGcStats(VM *vm, GcStats *stats) {
+    *stats = vm->gcStats;
+    stats->nextGC = vm->nextGC;
+}
@@ -1,41 +1,168 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include "allocator.h"
 #include "object.h"
+#include "output.h"
+#include "scheduler.h"
 #include "table.h"
 #include "value.h"
 #include "chunk.h"
+#include "source.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/** The number of call frames allocated when a VM is created. */
+#define FRAMES_INITIAL 8
 
-typedef struct {
-    ObjClosure *closure;
-    uint8_t *ip;
-    Value *slots;
-} CallFrame;
+/** The default maximum call depth. Hosts may tune this with VM.maxFrames. */
+#define FRAMES_MAX 1024
+
+/** The number of stack slots allocated when a VM is created. */
+#define STACK_INITIAL 256
+
+/** The number of stack slots allocated for a new fiber. It must exceed STACK_SLACK. */
+#define FIBER_STACK_INITIAL 64
+
+/**
+ * The number of free slots kept above the top of the stack by the interpreter loop.
+ * Helpers and natives may push this many temporaries without the stack moving.
+ */
+#define STACK_SLACK 16
+
+/** The default number of bytes allocated between minor collections. */
+#define GC_NURSERY_SIZE (256 * 1024)
+
+/** The default number of objects traced or swept by each incremental collection step. */
+#define GC_STEP_BUDGET 128
 
 /**
- * The state of the VM.
+ * Garbage collector and allocation statistics. These are always collected.
  */
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    /** The number of completed major collections. */
+    int collections;
+    /** The number of minor collections. */
+    int minorCollections;
+
+    /** The total time spent collecting, in seconds. */
+    double totalPause;
+    /** The longest time allocation was paused for collection, in seconds. */
+    double maxPause;
+
+    /** The total number of bytes ever allocated. */
+    size_t bytesAllocated;
+    /** The total number of bytes ever freed. */
+    size_t bytesFreed;
+    /** The number of bytes allocated after the last collection finished. */
+    size_t liveBytes;
+    /** The heap size that starts the next major collection. */
+    size_t nextGC;
+
+    /** The number of objects of each ObjType that have not been freed. */
+    int objectCounts[OBJ_TYPE_COUNT];
+} GcStats;
+
+/**
+ * Phases of a major collection.
+ */
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+} GcPhase;
+
+/**
+ * The state of the VM. Each VM has its own heap, so separate VMs may run on separate threads.
+ */
+struct VM {
+    /** The call frames, grown on demand. Pointers into it are invalidated by calls. */
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
+    /** The call depth beyond which a "Stack overflow." error is raised. Hosts may tune this. */
+    int maxFrames;
 
-    Value stack[STACK_MAX];
+    /** The value stack, grown on demand. Pointers into it are fixed up when it moves. */
+    Value *stack;
     Value *stackTop;
-    Table globals;
+    int stackCapacity;
+
+    /** Maps the name of each global variable to its slot index. */
+    Table globalSlots;
+    /** The name of the global variable in each slot. */
+    ValueArray globalNames;
+    /** The value of each global variable, UNDEFINED_VAL until it is defined. */
+    ValueArray globalValues;
+
+
     Table strings;
     ObjString *initString;
     ObjUpvalue *openUpvalues;
 
+    /** Serves small object and array allocations. */
+    Allocator allocator;
+
     size_t bytesAllocated;
     size_t nextGC;
+
+    /** The young generation: objects allocated since the last collection. */
     Obj *objects;
+    /** The old generation: objects that have survived a collection. */
+    Obj *oldObjects;
+
+    /** Bytes allocated since the last collection. */
+    size_t nurseryBytes;
+    /** Bytes that may be allocated before a minor collection runs. Hosts may tune this. */
+    size_t nurserySize;
+    bool isMinorGC;
+
+    GcStats gcStats;
+
+    /** The phase of the current major collection. */
+    GcPhase gcPhase;
+    /**
+     * Objects traced or swept per allocation while a major collection is running.
+     * Zero runs major collections to completion as soon as they start. Hosts may tune this.
+     */
+    int gcStepBudget;
+    /** Old objects the lazy sweep has yet to visit. */
+    Obj *sweepObjects;
+
+    /** Old objects that may refer to young objects. */
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj **remembered;
+
     int grayCount;
     int grayCapacity;
     Obj **grayStack;
-} VM;
+
+    /** Sources held open for strings that refer into them. */
+    Source *sources;
+
+    /** Where scripts print to: stdout unless the host sets it. Buffered. */
+    Output output;
+    /** Where compile and runtime errors are reported: stderr unless the host sets it. Unbuffered. */
+    Output errorOutput;
+
+    /** The profiler, or NULL unless profiling. */
+    struct Profiler *profiler;
+
+    /** The parser of the compilation in progress, or NULL. */
+    struct Parser *parser;
+
+    /**
+     * Whether compile() only checks the bodies of functions in sources held by the VM,
+     * compiling each on its first call. Off by default. Hosts may set this.
+     */
+    bool lazyFunctions;
+
+    /** The running fiber, whose frames, stack and open upvalues are the VM's while it runs. */
+    ObjFiber *fiber;
+    /** The fiber scripts start on, which runs on the stack allocated with the VM. */
+    ObjFiber *rootFiber;
+    /** The fibers queued to run or parked. */
+    Scheduler scheduler;
+};
 
 /**
  * Interpreter results.
@@ -46,36 +173,104 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-/* The vm. */
-extern VM vm;
+/**
+ * Creates a virtual machine.
+ * @return the virtual machine.
+ */
+VM *newVM();
 
 /**
- * Initialises the virtual machine.
+ * Frees a virtual machine and everything on its heap.
+ * @param vm the virtual machine.
  */
-void initVM();
+void freeVM(VM *vm);
 
 /**
- * Frees the virtual machine.
+ * Prepares a virtual machine to run an unrelated script. Its global variables
+ * are dropped and garbage collected, while the heap and interned strings are kept.
+ * @param vm the virtual machine.
  */
-void freeVM();
+void resetVM(VM *vm);
 
 /**
  * Interpret the given source and return the status.
+ * @param vm the virtual machine.
  * @param source the source code to interpret.
  * @return the status.
  */
-InterpretResult interpret(const char *source);
+InterpretResult interpret(VM *vm, const char *source);
+
+/**
+ * Runs an already compiled script, such as one loaded from a bytecode file.
+ * @param vm the virtual machine.
+ * @param function the top-level function of the script.
+ * @return the status.
+ */
+InterpretResult interpretFunction(VM *vm, ObjFunction *function);
+
+/**
+ * Hands a source to the VM, which keeps it open until the VM is freed.
+ * Strings compiled from a held source refer to it instead of copying it.
+ * @param vm the virtual machine.
+ * @param source the source.
+ */
+void holdSource(VM *vm, Source *source);
+
+/**
+ * Determines whether the given characters lie within a source held by the VM.
+ * @param vm the virtual machine.
+ * @param chars the characters.
+ * @return whether the characters are held.
+ */
+bool holdsSource(VM *vm, const char *chars);
+
+/**
+ * Gets the slot index of the global variable with the given name.
+ * A new, undefined slot is reserved the first time a name is seen.
+ * @param vm the virtual machine.
+ * @param name the name of the global variable.
+ * @return the slot index.
+ */
+int globalSlot(VM *vm, ObjString *name);
 
 /**
  * Pushses a new value onto the stack.
+ * @param vm the virtual machine.
  * @param value the value to push onto the stack.
  */
-void push(Value value);
+void push(VM *vm, Value value);
 
 /**
  * Pops a value from the stack.
+ * @param vm the virtual machine.
  * @return the value from the stack.
  */
-Value pop();
+Value pop(VM *vm);
+
+/**
+ * Sends what a VM's scripts print to a host function instead of stdout. The text is
+ * buffered and handed over when the buffer fills, before an error is reported and
+ * when interpret() or interpretFunction() returns.
+ * @param vm the virtual machine.
+ * @param write the write function, or NULL for stdout.
+ * @param context passed to the write function.
+ */
+void setOutput(VM *vm, WriteFn write, void *context);
+
+/**
+ * Sends a VM's compile and runtime error messages to a host function instead of stderr.
+ * They are handed over as they are written.
+ * @param vm the virtual machine.
+ * @param write the write function, or NULL for stderr.
+ * @param context passed to the write function.
+ */
+void setErrorOutput(VM *vm, WriteFn write, void *context);
+
+/**
+ * Reads the garbage collector statistics.
+ * @param vm the virtual machine.
+ * @param stats set to the statistics.
+ */
+void getGcStats(VM *vm, GcStats *stats);
 
 #endif //CLOX_VM_H
@@ -0,0 +1,1193 @@
+package net.adambruce.lox;
+
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+/**
+ * Compiles a resolved AST once into a tree of executable nodes, an alternative
+ * to walking it with the visitors in Interpreter. Each node does one specific
+ * thing, such as reading a local variable from its slot or subtracting two
+ * operands known to be numbers, so the JVM can inline the hot paths.
+ */
+class Compiler implements Expr.Visitor<Compiler.ExprNode>, Stmt.Visitor<Compiler.StmtNode> {
+
+    /** The interpreter whose global environment the compiled code runs in. */
+    private final Interpreter interpreter;
+
+    Compiler(Interpreter interpreter) {
+        this.interpreter = interpreter;
+    }
+
+    /**
+     * Compiles a list of statements.
+     * @param statements the list of statements.
+     * @return the executable statements.
+     */
+    StmtNode[] compile(List<Stmt> statements) {
+        StmtNode[] nodes = new StmtNode[statements.size()];
+        for (int i = 0; i < nodes.length; i++) {
+            nodes[i] = compile(statements.get(i));
+        }
+        return nodes;
+    }
+
+    /**
+     * Compiles a statement.
+     * @param stmt the statement.
+     * @return the executable statement.
+     */
+    private StmtNode compile(Stmt stmt) {
+        return stmt.accept(this);
+    }
+
+    /**
+     * Compiles an expression.
+     * @param expr the expression.
+     * @return the executable expression.
+     */
+    private ExprNode compile(Expr expr) {
+        return expr.accept(this);
+    }
+
+    /**
+     * Compiles a read of a variable.
+     * @param name the variable's name.
+     * @param depth the distance to the variable's scope, or -1 if it is global.
+     * @param slot the variable's slot.
+     * @return the executable expression.
+     */
+    private ExprNode variable(Token name, int depth, int slot) {
+        if (depth < 0) return new GetGlobalNode(interpreter.globals, name);
+        return new GetLocalNode(depth, slot);
+    }
+
+    /**
+     * Determines whether both operands always evaluate to numbers.
+     * @param left the left operand.
+     * @param right the right operand.
+     * @return whether both operands are numbers.
+     */
+    private static boolean isNumeric(ExprNode left, ExprNode right) {
+        return left instanceof NumberNode && right instanceof NumberNode;
+    }
+
+    /**
+     * Determines whether both operands are numbers.
+     * @param operator the expression's operator.
+     * @param left the left operand's value.
+     * @param right the right operand's value.
+     */
+    private static void checkNumberOperands(Token operator, Object left, Object right) {
+        if (left instanceof Double && right instanceof Double) return;
+        throw new RuntimeError(operator, "Operands must be numbers.");
+    }
+
+    /**
+     * Defines a variable in the given scope.
+     * @param environment the scope.
+     * @param name the variable's name.
+     * @param slot the variable's slot, or -1 if it is global.
+     * @param value the variable's value.
+     */
+    private static void define(Environment environment, Token name, int slot, Object value) {
+        if (slot >= 0) {
+            environment.define(slot, value);
+        } else {
+            environment.define(name.lexeme, value);
+        }
+    }
+
+    @Override
+    public ExprNode visitAssignExpr(Expr.Assign expr) {
+        ExprNode value = compile(expr.value);
+        if (expr.depth < 0) return new SetGlobalNode(interpreter.globals, expr.name, value);
+        return new SetLocalNode(expr.depth, expr.slot, value);
+    }
+
+    @Override
+    public ExprNode visitBinaryExpr(Expr.Binary expr) {
+        ExprNode left = compile(expr.left);
+        ExprNode right = compile(expr.right);
+
+        switch (expr.operator.type) {
+            case MINUS -> { return new SubtractNode(left, expr.operator, right); }
+            case PLUS -> {
+                if (isNumeric(left, right)) return new AddNumbersNode((NumberNode)left, (NumberNode)right);
+                return new AddNode(left, expr.operator, right);
+            }
+            case SLASH -> { return new DivideNode(left, expr.operator, right); }
+            case STAR -> { return new MultiplyNode(left, expr.operator, right); }
+            case GREATER -> { return new GreaterNode(left, expr.operator, right); }
+            case GREATER_EQUAL -> { return new GreaterEqualNode(left, expr.operator, right); }
+            case LESS -> { return new LessNode(left, expr.operator, right); }
+            case LESS_EQUAL -> { return new LessEqualNode(left, expr.operator, right); }
+            case BANG_EQUAL -> { return new NotNode(new EqualNode(left, right)); }
+            case EQUAL_EQUAL -> { return new EqualNode(left, right); }
+        }
+
+        return new ConstantNode(null);
+    }
+
+    @Override
+    public ExprNode visitCallExpr(Expr.Call expr) {
+        ExprNode[] arguments = new ExprNode[expr.arguments.size()];
+        for (int i = 0; i < arguments.length; i++) {
+            arguments[i] = compile(expr.arguments.get(i));
+        }
+        return new CallNode(interpreter, compile(expr.callee), expr.paren, arguments);
+    }
+
+    @Override
+    public ExprNode visitGetExpr(Expr.Get expr) {
+        return new GetPropertyNode(compile(expr.object), expr.name);
+    }
+
+    @Override
+    public ExprNode visitGroupingExpr(Expr.Grouping expr) {
+        return compile(expr.expression);
+    }
+
+    @Override
+    public ExprNode visitLiteralExpr(Expr.Literal expr) {
+        if (expr.value instanceof Double) return new NumberConstantNode((double)expr.value);
+        return new ConstantNode(expr.value);
+    }
+
+    @Override
+    public ExprNode visitLogicalExpr(Expr.Logical expr) {
+        ExprNode left = compile(expr.left);
+        ExprNode right = compile(expr.right);
+        if (expr.operator.type == TokenType.OR) return new OrNode(left, right);
+        return new AndNode(left, right);
+    }
+
+    @Override
+    public ExprNode visitSetExpr(Expr.Set expr) {
+        return new SetPropertyNode(compile(expr.object), expr.name, compile(expr.value));
+    }
+
+    @Override
+    public ExprNode visitSuperExpr(Expr.Super expr) {
+        return new SuperNode(expr.depth, expr.slot, expr.method);
+    }
+
+    @Override
+    public ExprNode visitThisExpr(Expr.This expr) {
+        return variable(expr.keyword, expr.depth, expr.slot);
+    }
+
+    @Override
+    public ExprNode visitUnaryExpr(Expr.Unary expr) {
+        ExprNode right = compile(expr.right);
+
+        switch (expr.operator.type) {
+            case BANG -> { return new NotNode(right); }
+            case MINUS -> { return new NegateNode(expr.operator, right); }
+        }
+
+        return new ConstantNode(null);
+    }
+
+    @Override
+    public ExprNode visitVariableExpr(Expr.Variable expr) {
+        return variable(expr.name, expr.depth, expr.slot);
+    }
+
+    @Override
+    public StmtNode visitBlockStmt(Stmt.Block stmt) {
+        return new BlockNode(compile(stmt.statements), stmt.slotCount);
+    }
+
+    @Override
+    public StmtNode visitClassStmt(Stmt.Class stmt) {
+        ExprNode superclass = stmt.superclass == null ? null : compile(stmt.superclass);
+
+        StmtNode[][] methodBodies = new StmtNode[stmt.methods.size()][];
+        for (int i = 0; i < methodBodies.length; i++) {
+            methodBodies[i] = compile(stmt.methods.get(i).body);
+        }
+
+        return new ClassNode(stmt, superclass, methodBodies);
+    }
+
+    @Override
+    public StmtNode visitExpressionStmt(Stmt.Expression stmt) {
+        return new ExpressionNode(compile(stmt.expression));
+    }
+
+    @Override
+    public StmtNode visitFunctionStmt(Stmt.Function stmt) {
+        return new FunctionNode(stmt, compile(stmt.body));
+    }
+
+    @Override
+    public StmtNode visitIfStmt(Stmt.If stmt) {
+        StmtNode elseBranch = stmt.elseBranch == null ? null : compile(stmt.elseBranch);
+        return new IfNode(compile(stmt.condition), compile(stmt.thenBranch), elseBranch);
+    }
+
+    @Override
+    public StmtNode visitReturnStmt(Stmt.Return stmt) {
+        return new ReturnNode(stmt.value == null ? null : compile(stmt.value));
+    }
+
+    @Override
+    public StmtNode visitVarStmt(Stmt.Var stmt) {
+        ExprNode initializer = stmt.initializer == null ? new ConstantNode(null) : compile(stmt.initializer);
+        if (stmt.slot < 0) return new DefineGlobalNode(stmt.name, initializer);
+        return new DefineLocalNode(stmt.slot, initializer);
+    }
+
+    @Override
+    public StmtNode visitPrintStmt(Stmt.Print stmt) {
+        return new PrintNode(compile(stmt.expression));
+    }
+
+    @Override
+    public StmtNode visitWhileStmt(Stmt.While stmt) {
+        return new WhileNode(compile(stmt.condition), compile(stmt.body));
+    }
+
+    /** An executable expression. */
+    abstract static class ExprNode {
+
+        /**
+         * Evaluates the expression.
+         * @param environment the current environment.
+         * @return the expression's value.
+         */
+        abstract Object evaluate(Environment environment);
+
+        /**
+         * Evaluates the expression as a condition.
+         * @param environment the current environment.
+         * @return whether the expression's value is truthy.
+         */
+        boolean evaluateCondition(Environment environment) {
+            return Interpreter.isTruthy(evaluate(environment));
+        }
+    }
+
+    /** An executable expression whose value is always a number, which can be read unboxed. */
+    abstract static class NumberNode extends ExprNode {
+
+        /**
+         * Evaluates the expression.
+         * @param environment the current environment.
+         * @return the expression's value.
+         */
+        abstract double evaluateNumber(Environment environment);
+
+        @Override
+        Object evaluate(Environment environment) {
+            return evaluateNumber(environment);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            evaluateNumber(environment);
+            return true;
+        }
+    }
+
+    /** An executable expression with two operands. */
+    abstract static class BinaryNode extends ExprNode {
+
+        /** The left operand. */
+        final ExprNode left;
+
+        /** The expression's operator. */
+        final Token operator;
+
+        /** The right operand. */
+        final ExprNode right;
+
+        /** Whether both operands are numbers, so they can be read unboxed. */
+        final boolean numeric;
+
+        BinaryNode(ExprNode left, Token operator, ExprNode right) {
+            this.left = left;
+            this.operator = operator;
+            this.right = right;
+            this.numeric = isNumeric(left, right);
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            return evaluateCondition(environment);
+        }
+    }
+
+    /** An arithmetic expression with two operands. */
+    abstract static class ArithmeticNode extends NumberNode {
+
+        /** The left operand. */
+        final ExprNode left;
+
+        /** The expression's operator. */
+        final Token operator;
+
+        /** The right operand. */
+        final ExprNode right;
+
+        /** Whether both operands are numbers, so they can be read unboxed. */
+        final boolean numeric;
+
+        ArithmeticNode(ExprNode left, Token operator, ExprNode right) {
+            this.left = left;
+            this.operator = operator;
+            this.right = right;
+            this.numeric = isNumeric(left, right);
+        }
+    }
+
+    /** A constant. */
+    static final class ConstantNode extends ExprNode {
+
+        /** The constant's value. */
+        private final Object value;
+
+        ConstantNode(Object value) {
+            this.value = value;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            return value;
+        }
+    }
+
+    /** A number constant. */
+    static final class NumberConstantNode extends NumberNode {
+
+        /** The constant's value. */
+        private final double value;
+
+        /** The constant's value, boxed once. */
+        private final Object boxed;
+
+        NumberConstantNode(double value) {
+            this.value = value;
+            this.boxed = value;
+        }
+
+        @Override
+        double evaluateNumber(Environment environment) {
+            return value;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            return boxed;
+        }
+    }
+
+    /** A read of a local variable. */
+    static final class GetLocalNode extends ExprNode {
+
+        /** The distance to the variable's scope. */
+        private final int depth;
+
+        /** The variable's slot. */
+        private final int slot;
+
+        GetLocalNode(int depth, int slot) {
+            this.depth = depth;
+            this.slot = slot;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            return environment.getAt(depth, slot);
+        }
+    }
+
+    /** A read of a global variable. */
+    static final class GetGlobalNode extends ExprNode {
+
+        /** The global environment. */
+        private final Environment globals;
+
+        /** The variable's name. */
+        private final Token name;
+
+        GetGlobalNode(Environment globals, Token name) {
+            this.globals = globals;
+            this.name = name;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            return globals.get(name);
+        }
+    }
+
+    /** An assignment to a local variable. */
+    static final class SetLocalNode extends ExprNode {
+
+        /** The distance to the variable's scope. */
+        private final int depth;
+
+        /** The variable's slot. */
+        private final int slot;
+
+        /** The value assigned. */
+        private final ExprNode value;
+
+        SetLocalNode(int depth, int slot, ExprNode value) {
+            this.depth = depth;
+            this.slot = slot;
+            this.value = value;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object result = value.evaluate(environment);
+            environment.assignAt(depth, slot, result);
+            return result;
+        }
+    }
+
+    /** An assignment to a global variable. */
+    static final class SetGlobalNode extends ExprNode {
+
+        /** The global environment. */
+        private final Environment globals;
+
+        /** The variable's name. */
+        private final Token name;
+
+        /** The value assigned. */
+        private final ExprNode value;
+
+        SetGlobalNode(Environment globals, Token name, ExprNode value) {
+            this.globals = globals;
+            this.name = name;
+            this.value = value;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object result = value.evaluate(environment);
+            globals.assign(name, result);
+            return result;
+        }
+    }
+
+    /** Addition of numbers or strings. */
+    static final class AddNode extends ExprNode {
+
+        /** The left operand. */
+        private final ExprNode left;
+
+        /** The expression's operator. */
+        private final Token operator;
+
+        /** The right operand. */
+        private final ExprNode right;
+
+        AddNode(ExprNode left, Token operator, ExprNode right) {
+            this.left = left;
+            this.operator = operator;
+            this.right = right;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object a = left.evaluate(environment);
+            Object b = right.evaluate(environment);
+
+            if (a instanceof Double && b instanceof Double) {
+                return (double)a + (double)b;
+            }
+            if (a instanceof String && b instanceof String) {
+                return (String)a + (String)b;
+            }
+
+            /* Mixed doubles and strings. */
+            if (a instanceof String && b instanceof Double) {
+                return (String)a + Interpreter.stringify(b);
+            }
+            if (a instanceof Double && b instanceof String) {
+                return Interpreter.stringify(a) + (String)b;
+            }
+
+            throw new RuntimeError(operator, "Operands must be two numbers or two strings.");
+        }
+    }
+
+    /** Addition of two operands known to be numbers. */
+    static final class AddNumbersNode extends NumberNode {
+
+        /** The left operand. */
+        private final NumberNode left;
+
+        /** The right operand. */
+        private final NumberNode right;
+
+        AddNumbersNode(NumberNode left, NumberNode right) {
+            this.left = left;
+            this.right = right;
+        }
+
+        @Override
+        double evaluateNumber(Environment environment) {
+            return left.evaluateNumber(environment) + right.evaluateNumber(environment);
+        }
+    }
+
+    /** Subtraction. */
+    static final class SubtractNode extends ArithmeticNode {
+
+        SubtractNode(ExprNode left, Token operator, ExprNode right) {
+            super(left, operator, right);
+        }
+
+        @Override
+        double evaluateNumber(Environment environment) {
+            if (numeric) {
+                return ((NumberNode)left).evaluateNumber(environment) - ((NumberNode)right).evaluateNumber(environment);
+            }
+
+            Object a = left.evaluate(environment);
+            Object b = right.evaluate(environment);
+            checkNumberOperands(operator, a, b);
+            return (double)a - (double)b;
+        }
+    }
+
+    /** Multiplication. */
+    static final class MultiplyNode extends ArithmeticNode {
+
+        MultiplyNode(ExprNode left, Token operator, ExprNode right) {
+            super(left, operator, right);
+        }
+
+        @Override
+        double evaluateNumber(Environment environment) {
+            if (numeric) {
+                return ((NumberNode)left).evaluateNumber(environment) * ((NumberNode)right).evaluateNumber(environment);
+            }
+
+            Object a = left.evaluate(environment);
+            Object b = right.evaluate(environment);
+            checkNumberOperands(operator, a, b);
+            return (double)a * (double)b;
+        }
+    }
+
+    /** Division. */
+    static final class DivideNode extends ArithmeticNode {
+
+        DivideNode(ExprNode left, Token operator, ExprNode right) {
+            super(left, operator, right);
+        }
+
+        @Override
+        double evaluateNumber(Environment environment) {
+            double a;
+            double b;
+            if (numeric) {
+                a = ((NumberNode)left).evaluateNumber(environment);
+                b = ((NumberNode)right).evaluateNumber(environment);
+            } else {
+                Object leftValue = left.evaluate(environment);
+                Object rightValue = right.evaluate(environment);
+                checkNumberOperands(operator, leftValue, rightValue);
+                a = (double)leftValue;
+                b = (double)rightValue;
+            }
+
+            if (b == 0) {
+                throw new RuntimeError(operator, "Cannot divide by zero.");
+            }
+
+            return a / b;
+        }
+    }
+
+    /** Negation. */
+    static final class NegateNode extends NumberNode {
+
+        /** The expression's operator. */
+        private final Token operator;
+
+        /** The operand. */
+        private final ExprNode right;
+
+        NegateNode(Token operator, ExprNode right) {
+            this.operator = operator;
+            this.right = right;
+        }
+
+        @Override
+        double evaluateNumber(Environment environment) {
+            if (right instanceof NumberNode) return -((NumberNode)right).evaluateNumber(environment);
+
+            Object value = right.evaluate(environment);
+            if (!(value instanceof Double)) {
+                throw new RuntimeError(operator, "Operand must be a number.");
+            }
+            return -(double)value;
+        }
+    }
+
+    /** Greater than. */
+    static final class GreaterNode extends BinaryNode {
+
+        GreaterNode(ExprNode left, Token operator, ExprNode right) {
+            super(left, operator, right);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            if (numeric) {
+                return ((NumberNode)left).evaluateNumber(environment) > ((NumberNode)right).evaluateNumber(environment);
+            }
+
+            Object a = left.evaluate(environment);
+            Object b = right.evaluate(environment);
+            checkNumberOperands(operator, a, b);
+            return (double)a > (double)b;
+        }
+    }
+
+    /** Greater than or equal to. */
+    static final class GreaterEqualNode extends BinaryNode {
+
+        GreaterEqualNode(ExprNode left, Token operator, ExprNode right) {
+            super(left, operator, right);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            if (numeric) {
+                return ((NumberNode)left).evaluateNumber(environment) >= ((NumberNode)right).evaluateNumber(environment);
+            }
+
+            Object a = left.evaluate(environment);
+            Object b = right.evaluate(environment);
+            checkNumberOperands(operator, a, b);
+            return (double)a >= (double)b;
+        }
+    }
+
+    /** Less than. */
+    static final class LessNode extends BinaryNode {
+
+        LessNode(ExprNode left, Token operator, ExprNode right) {
+            super(left, operator, right);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            if (numeric) {
+                return ((NumberNode)left).evaluateNumber(environment) < ((NumberNode)right).evaluateNumber(environment);
+            }
+
+            Object a = left.evaluate(environment);
+            Object b = right.evaluate(environment);
+            checkNumberOperands(operator, a, b);
+            return (double)a < (double)b;
+        }
+    }
+
+    /** Less than or equal to. */
+    static final class LessEqualNode extends BinaryNode {
+
+        LessEqualNode(ExprNode left, Token operator, ExprNode right) {
+            super(left, operator, right);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            if (numeric) {
+                return ((NumberNode)left).evaluateNumber(environment) <= ((NumberNode)right).evaluateNumber(environment);
+            }
+
+            Object a = left.evaluate(environment);
+            Object b = right.evaluate(environment);
+            checkNumberOperands(operator, a, b);
+            return (double)a <= (double)b;
+        }
+    }
+
+    /** Equality. */
+    static final class EqualNode extends ExprNode {
+
+        /** The left operand. */
+        private final ExprNode left;
+
+        /** The right operand. */
+        private final ExprNode right;
+
+        EqualNode(ExprNode left, ExprNode right) {
+            this.left = left;
+            this.right = right;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            return evaluateCondition(environment);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            return Interpreter.isEqual(left.evaluate(environment), right.evaluate(environment));
+        }
+    }
+
+    /** Logical not. */
+    static final class NotNode extends ExprNode {
+
+        /** The operand. */
+        private final ExprNode right;
+
+        NotNode(ExprNode right) {
+            this.right = right;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            return evaluateCondition(environment);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            return !right.evaluateCondition(environment);
+        }
+    }
+
+    /** Logical and. */
+    static final class AndNode extends ExprNode {
+
+        /** The left operand. */
+        private final ExprNode left;
+
+        /** The right operand. */
+        private final ExprNode right;
+
+        AndNode(ExprNode left, ExprNode right) {
+            this.left = left;
+            this.right = right;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object value = left.evaluate(environment);
+            if (!Interpreter.isTruthy(value)) return value;
+            return right.evaluate(environment);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            return left.evaluateCondition(environment) && right.evaluateCondition(environment);
+        }
+    }
+
+    /** Logical or. */
+    static final class OrNode extends ExprNode {
+
+        /** The left operand. */
+        private final ExprNode left;
+
+        /** The right operand. */
+        private final ExprNode right;
+
+        OrNode(ExprNode left, ExprNode right) {
+            this.left = left;
+            this.right = right;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object value = left.evaluate(environment);
+            if (Interpreter.isTruthy(value)) return value;
+            return right.evaluate(environment);
+        }
+
+        @Override
+        boolean evaluateCondition(Environment environment) {
+            return left.evaluateCondition(environment) || right.evaluateCondition(environment);
+        }
+    }
+
+    /** A call. */
+    static final class CallNode extends ExprNode {
+
+        /** The interpreter passed to the callee. */
+        private final Interpreter interpreter;
+
+        /** The callee. */
+        private final ExprNode callee;
+
+        /** The closing parenthesis, where errors are reported. */
+        private final Token paren;
+
+        /** The arguments. */
+        private final ExprNode[] arguments;
+
+        CallNode(Interpreter interpreter, ExprNode callee, Token paren, ExprNode[] arguments) {
+            this.interpreter = interpreter;
+            this.callee = callee;
+            this.paren = paren;
+            this.arguments = arguments;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object function = callee.evaluate(environment);
+
+            List<Object> values = new ArrayList<>(arguments.length);
+            for (ExprNode argument : arguments) {
+                values.add(argument.evaluate(environment));
+            }
+
+            if (!(function instanceof LoxCallable)) {
+                throw new RuntimeError(paren, "Can only call functions and classes.");
+            }
+
+            LoxCallable callable = (LoxCallable)function;
+            if (values.size() != callable.arity()) {
+                throw new RuntimeError(paren, "Expected " + callable.arity() +
+                    " arguments but got " + values.size() + ".");
+            }
+
+            return callable.call(interpreter, values);
+        }
+    }
+
+    /** A read of a property. */
+    static final class GetPropertyNode extends ExprNode {
+
+        /** The object. */
+        private final ExprNode object;
+
+        /** The property's name. */
+        private final Token name;
+
+        GetPropertyNode(ExprNode object, Token name) {
+            this.object = object;
+            this.name = name;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object value = object.evaluate(environment);
+            if (value instanceof LoxInstance) {
+                return ((LoxInstance)value).get(name);
+            }
+
+            throw new RuntimeError(name, "Only instances have properties.");
+        }
+    }
+
+    /** An assignment to a field. */
+    static final class SetPropertyNode extends ExprNode {
+
+        /** The object. */
+        private final ExprNode object;
+
+        /** The field's name. */
+        private final Token name;
+
+        /** The value assigned. */
+        private final ExprNode value;
+
+        SetPropertyNode(ExprNode object, Token name, ExprNode value) {
+            this.object = object;
+            this.name = name;
+            this.value = value;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            Object instance = object.evaluate(environment);
+
+            if (!(instance instanceof LoxInstance)) {
+                throw new RuntimeError(name, "Only instances have fields.");
+            }
+
+            Object result = value.evaluate(environment);
+            ((LoxInstance)instance).set(name, result);
+            return result;
+        }
+    }
+
+    /** A superclass method. */
+    static final class SuperNode extends ExprNode {
+
+        /** The distance to the scope holding "super". */
+        private final int depth;
+
+        /** The slot of "super". */
+        private final int slot;
+
+        /** The method's name. */
+        private final Token method;
+
+        SuperNode(int depth, int slot, Token method) {
+            this.depth = depth;
+            this.slot = slot;
+            this.method = method;
+        }
+
+        @Override
+        Object evaluate(Environment environment) {
+            LoxClass superclass = (LoxClass)environment.getAt(depth, slot);
+
+            // "this" is in the first slot of the scope just inside the one holding "super".
+            LoxInstance object = (LoxInstance)environment.getAt(depth - 1, 0);
+
+            LoxFunction function = superclass.findMethod(method.lexeme);
+
+            if (function == null) {
+                throw new RuntimeError(method, "Undefined property '" + method.lexeme + "'.");
+            }
+
+            return function.bind(object);
+        }
+    }
+
+    /** An executable statement. */
+    abstract static class StmtNode {
+
+        /**
+         * Executes the statement.
+         * @param environment the current environment.
+         */
+        abstract void execute(Environment environment);
+    }
+
+    /** An expression statement. */
+    static final class ExpressionNode extends StmtNode {
+
+        /** The expression. */
+        private final ExprNode expression;
+
+        ExpressionNode(ExprNode expression) {
+            this.expression = expression;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            expression.evaluate(environment);
+        }
+    }
+
+    /** A print statement. */
+    static final class PrintNode extends StmtNode {
+
+        /** The expression printed. */
+        private final ExprNode expression;
+
+        PrintNode(ExprNode expression) {
+            this.expression = expression;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            System.out.println(Interpreter.stringify(expression.evaluate(environment)));
+        }
+    }
+
+    /** A declaration of a local variable. */
+    static final class DefineLocalNode extends StmtNode {
+
+        /** The variable's slot. */
+        private final int slot;
+
+        /** The variable's initializer. */
+        private final ExprNode initializer;
+
+        DefineLocalNode(int slot, ExprNode initializer) {
+            this.slot = slot;
+            this.initializer = initializer;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            environment.define(slot, initializer.evaluate(environment));
+        }
+    }
+
+    /** A declaration of a global variable. */
+    static final class DefineGlobalNode extends StmtNode {
+
+        /** The variable's name. */
+        private final Token name;
+
+        /** The variable's initializer. */
+        private final ExprNode initializer;
+
+        DefineGlobalNode(Token name, ExprNode initializer) {
+            this.name = name;
+            this.initializer = initializer;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            environment.define(name.lexeme, initializer.evaluate(environment));
+        }
+    }
+
+    /** A block. */
+    static final class BlockNode extends StmtNode {
+
+        /** The block's statements. */
+        private final StmtNode[] statements;
+
+        /** The number of variables declared in the block. */
+        private final int slotCount;
+
+        BlockNode(StmtNode[] statements, int slotCount) {
+            this.statements = statements;
+            this.slotCount = slotCount;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            Environment scope = new Environment(environment, slotCount);
+            for (StmtNode statement : statements) {
+                statement.execute(scope);
+            }
+        }
+    }
+
+    /** An if statement. */
+    static final class IfNode extends StmtNode {
+
+        /** The condition. */
+        private final ExprNode condition;
+
+        /** The statement run when the condition is truthy. */
+        private final StmtNode thenBranch;
+
+        /** The statement run otherwise, or null. */
+        private final StmtNode elseBranch;
+
+        IfNode(ExprNode condition, StmtNode thenBranch, StmtNode elseBranch) {
+            this.condition = condition;
+            this.thenBranch = thenBranch;
+            this.elseBranch = elseBranch;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            if (condition.evaluateCondition(environment)) {
+                thenBranch.execute(environment);
+            } else if (elseBranch != null) {
+                elseBranch.execute(environment);
+            }
+        }
+    }
+
+    /** A while loop. */
+    static final class WhileNode extends StmtNode {
+
+        /** The condition. */
+        private final ExprNode condition;
+
+        /** The loop body. */
+        private final StmtNode body;
+
+        WhileNode(ExprNode condition, StmtNode body) {
+            this.condition = condition;
+            this.body = body;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            while (condition.evaluateCondition(environment)) {
+                body.execute(environment);
+            }
+        }
+    }
+
+    /** A return statement. */
+    static final class ReturnNode extends StmtNode {
+
+        /** The value returned, or null. */
+        private final ExprNode value;
+
+        ReturnNode(ExprNode value) {
+            this.value = value;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            throw new Return(value == null ? null : value.evaluate(environment));
+        }
+    }
+
+    /** A function declaration. */
+    static final class FunctionNode extends StmtNode {
+
+        /** The function's declaration. */
+        private final Stmt.Function declaration;
+
+        /** The function's compiled body. */
+        private final StmtNode[] body;
+
+        FunctionNode(Stmt.Function declaration, StmtNode[] body) {
+            this.declaration = declaration;
+            this.body = body;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            LoxFunction function = new LoxFunction(declaration, environment, false, body);
+            define(environment, declaration.name, declaration.slot, function);
+        }
+    }
+
+    /** A class declaration. */
+    static final class ClassNode extends StmtNode {
+
+        /** The class's declaration. */
+        private final Stmt.Class declaration;
+
+        /** The superclass, or null. */
+        private final ExprNode superclass;
+
+        /** The compiled bodies of the class's methods, in declaration order. */
+        private final StmtNode[][] methodBodies;
+
+        ClassNode(Stmt.Class declaration, ExprNode superclass, StmtNode[][] methodBodies) {
+            this.declaration = declaration;
+            this.superclass = superclass;
+            this.methodBodies = methodBodies;
+        }
+
+        @Override
+        void execute(Environment environment) {
+            Object superclassValue = null;
+            if (superclass != null) {
+                superclassValue = superclass.evaluate(environment);
+                if (!(superclassValue instanceof LoxClass)) {
+                    throw new RuntimeError(declaration.superclass.name, "Superclass must be a class.");
+                }
+            }
+
+            define(environment, declaration.name, declaration.slot, null);
+
+            Environment methodEnvironment = environment;
+            if (superclass != null) {
+                methodEnvironment = new Environment(environment, 1);
+                methodEnvironment.define(0, superclassValue);
+            }
+
+            Map<String, LoxFunction> methods = new HashMap<>();
+            for (int i = 0; i < methodBodies.length; i++) {
+                Stmt.Function method = declaration.methods.get(i);
+                boolean isInitializer = method.name.lexeme.equals("init");
+                methods.put(method.name.lexeme, new LoxFunction(method, methodEnvironment, isInitializer, methodBodies[i]));
+            }
+
+            LoxClass klass = new LoxClass(declaration.name.lexeme, (LoxClass)superclassValue, methods);
+            define(environment, declaration.name, declaration.slot, klass);
+        }
+    }
+}
@@ -4,33 +4,42 @@ import java.util.HashMap;
 import java.util.Map;
 
 /**
- * The Lox environment for a scope.
+ * The Lox environment for a scope. Local scopes keep their variables in the
+ * slots the resolver gave them, while the global scope looks them up by name.
  */
 public class Environment {
 
     /** The scope's enclosed environment. */
     final Environment enclosing;
 
-    /** The map of key value pairs for the scope's variables. */
-    private final Map<String, Object> values = new HashMap<>();
+    /** The values of a local scope's variables, by slot. Null for the global scope. */
+    private final Object[] slots;
+
+    /** The map of key value pairs for the global scope's variables. Null for local scopes. */
+    private final Map<String, Object> values;
 
     /**
-     * Create a new environment with no enclosed scope.
+     * Create a new global environment.
      */
     Environment() {
         enclosing = null;
+        slots = null;
+        values = new HashMap<>();
     }
 
     /**
-     * Create a new environment with the given enclosed scope.
+     * Create a new local environment with the given enclosed scope.
      * @param enclosing the enclosed scope.
+     * @param slotCount the number of variables declared in the scope.
      */
-    Environment(Environment enclosing) {
+    Environment(Environment enclosing, int slotCount) {
         this.enclosing = enclosing;
+        slots = new Object[slotCount];
+        values = null;
     }
 
     /**
-     * Defines a new variable.
+     * Defines a new global variable.
      * @param name the variable's name.
      * @param value the variable's value.
      */
@@ -38,6 +47,15 @@ public class Environment {
         values.put(name, value);
     }
 
+    /**
+     * Defines a new local variable.
+     * @param slot the variable's slot.
+     * @param value the variable's value.
+     */
+    void define(int slot, Object value) {
+        slots[slot] = value;
+    }
+
     /**
      * Gets the scope at the given distance.
      * @param distance the distance.
@@ -53,36 +71,44 @@ public class Environment {
     }
 
     /**
-     * Gets a variable's value from a given scope distance.
+     * Gets a local variable's value from a given scope distance.
      * @param distance the distance.
-     * @param name the variable's name.
+     * @param slot the variable's slot.
      * @return the variable's value.
      */
-    Object getAt(int distance, String name) {
-        return ancestor(distance).values.get(name);
+    Object getAt(int distance, int slot) {
+        return ancestor(distance).slots[slot];
     }
 
     /**
-     * Gets the value of a variable from it's name.
+     * Assigns a new value to a local variable at a given scope distance.
+     * @param distance the distance.
+     * @param slot the variable's slot.
+     * @param value the variable's new value.
+     */
+    void assignAt(int distance, int slot, Object value) {
+        ancestor(distance).slots[slot] = value;
+    }
+
+    /**
+     * Gets the value of a global variable from it's name.
      * @param name the variable's name.
      * @return the variable's value.
-     * @throws RuntimeError the variable is not defined in the scope.
+     * @throws RuntimeError the variable is not defined.
      */
     Object get(Token name) throws RuntimeError {
         if (values.containsKey(name.lexeme)) {
             return values.get(name.lexeme);
         }
 
-        if (enclosing != null) return enclosing.get(name);
-
         throw new RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
     }
 
     /**
-     * Assigns a new value to an existing variable.
+     * Assigns a new value to an existing global variable.
      * @param name the variable's name.
      * @param value the variable's new value.
-     * @throws RuntimeError the variable is not defined in the scope.
+     * @throws RuntimeError the variable is not defined.
      */
     public void assign(Token name, Object value) throws RuntimeError {
         if (values.containsKey(name.lexeme)) {
@@ -90,11 +116,6 @@ public class Environment {
             return;
         }
 
-        if (enclosing != null) {
-            enclosing.assign(name, value);
-            return;
-        }
-
         throw new RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
     }
 }
@@ -30,6 +30,8 @@ abstract class Expr {
 
     final Token name;
     final Expr value;
+    int depth = -1;
+    int slot = -1;
   }
   static class Binary extends Expr{
     Binary(Expr left, Token operator, Expr right) {
@@ -146,6 +148,8 @@ abstract class Expr {
 
     final Token keyword;
     final Token method;
+    int depth = -1;
+    int slot = -1;
   }
   static class This extends Expr{
     This(Token keyword) {
@@ -158,6 +162,8 @@ abstract class Expr {
     }
 
     final Token keyword;
+    int depth = -1;
+    int slot = -1;
   }
   static class Unary extends Expr{
     Unary(Token operator, Expr right) {
@@ -184,6 +190,8 @@ abstract class Expr {
     }
 
     final Token name;
+    int depth = -1;
+    int slot = -1;
   }
 
   abstract <R> R accept(Visitor<R> visitor);
@@ -16,9 +16,6 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     /** The global environment. */
     private Environment environment = globals;
 
-    /** Local variables. */
-    private final Map<Expr, Integer> locals = new HashMap<>();
-
     Interpreter() {
         globals.define("clock", new LoxCallable() {
             @Override
@@ -52,6 +49,20 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
         }
     }
 
+    /**
+     * Compiles the given list of statements into executable nodes and runs them.
+     * @param statements the list of statements.
+     */
+    void interpretCompiled(List<Stmt> statements) {
+        try {
+            for (Compiler.StmtNode statement : new Compiler(this).compile(statements)) {
+                statement.execute(globals);
+            }
+        } catch (RuntimeError error) {
+            Lox.runtimeError(error);
+        }
+    }
+
     @Override
     public Object visitBinaryExpr(Expr.Binary expr) {
         Object left = evaluate(expr.left);
@@ -204,10 +215,10 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Object visitSuperExpr(Expr.Super expr) {
-        int distance = locals.get(expr);
-        LoxClass superclass = (LoxClass)environment.getAt(distance, "super");
+        LoxClass superclass = (LoxClass)environment.getAt(expr.depth, expr.slot);
 
-        LoxInstance object = (LoxInstance)environment.getAt(distance - 1, "this");
+        // "this" is in the first slot of the scope just inside the one holding "super".
+        LoxInstance object = (LoxInstance)environment.getAt(expr.depth - 1, 0);
 
         LoxFunction method = superclass.findMethod(expr.method.lexeme);
 
@@ -220,7 +231,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Object visitThisExpr(Expr.This expr) {
-        return lookUpVariable(expr.keyword, expr);
+        return lookUpVariable(expr.keyword, expr.depth, expr.slot);
     }
 
     @Override
@@ -240,25 +251,39 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Object visitVariableExpr(Expr.Variable expr) {
-        return lookUpVariable(expr.name, expr);
+        return lookUpVariable(expr.name, expr.depth, expr.slot);
     }
 
     /**
      * Gets a variable from the corresponding scope distance. If no distance is
      * provided, the variable is taken from the global scope.
      * @param name the variable's name.
-     * @param expr the variable's expression.
+     * @param depth the distance to the variable's scope, or -1 if it is global.
+     * @param slot the variable's slot.
      * @return the variable's value.
      */
-    private Object lookUpVariable(Token name, Expr expr) {
-        Integer distance = locals.get(expr);
-        if (distance != null) {
-            return environment.getAt(distance, name.lexeme);
+    private Object lookUpVariable(Token name, int depth, int slot) {
+        if (depth >= 0) {
+            return environment.getAt(depth, slot);
         } else {
             return globals.get(name);
         }
     }
 
+    /**
+     * Defines a variable in the current scope.
+     * @param name the variable's name.
+     * @param slot the variable's slot, or -1 if it is global.
+     * @param value the variable's value.
+     */
+    private void define(Token name, int slot, Object value) {
+        if (slot >= 0) {
+            environment.define(slot, value);
+        } else {
+            environment.define(name.lexeme, value);
+        }
+    }
+
     /**
      * Determines whether the given operand is a number.
      * @param operator the expression's operator.
@@ -298,15 +323,6 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
         stmt.accept(this);
     }
 
-    /**
-     * Resolves an expression and puts it in the corresponding scope.
-     * @param expr the expression.
-     * @param depth the scope depth.
-     */
-    void resolve(Expr expr, int depth) {
-        locals.put(expr, depth);
-    }
-
     /**
      * Executes the given block.
      * @param statements the list of statements.
@@ -327,7 +343,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
     @Override
     public Void visitBlockStmt(Stmt.Block stmt) {
-        executeBlock(stmt.statements, new Environment(environment));
+        executeBlock(stmt.statements, new Environment(environment, stmt.slotCount));
         return null;
     }
 
@@ -341,11 +357,11 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
             }
         }
 
-        environment.define(stmt.name.lexeme, null);
+        define(stmt.name, stmt.slot, null);
 
         if (stmt.superclass != null) {
-            environment = new Environment(environment);
-            environment.define("super", superclass);
+            environment = new Environment(environment, 1);
+            environment.define(0, superclass);
         }
 
         Map<String, LoxFunction> methods = new HashMap<>();
@@ -360,7 +376,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
             environment = environment.enclosing;
         }
 
-        environment.assign(stmt.name, klass);
+        define(stmt.name, stmt.slot, klass);
         return null;
     }
 
@@ -373,7 +389,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     @Override
     public Void visitFunctionStmt(Stmt.Function stmt) {
         LoxFunction function = new LoxFunction(stmt, environment, false);
-        environment.define(stmt.name.lexeme, function);
+        define(stmt.name, stmt.slot, function);
         return null;
     }
 
@@ -409,7 +425,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
             value = evaluate(stmt.initializer);
         }
 
-        environment.define(stmt.name.lexeme, value);
+        define(stmt.name, stmt.slot, value);
         return null;
     }
 
@@ -424,7 +440,11 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     @Override
     public Object visitAssignExpr(Expr.Assign expr) {
         Object value = evaluate(expr.value);
-        environment.assign(expr.name, value);
+        if (expr.depth >= 0) {
+            environment.assignAt(expr.depth, expr.slot, value);
+        } else {
+            globals.assign(expr.name, value);
+        }
         return value;
     }
 
@@ -433,7 +453,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
      * @param object the object.
      * @return whether the object is considered true or false.
      */
-    private boolean isTruthy(Object object) {
+    static boolean isTruthy(Object object) {
         if (object == null) return false;
         if (object instanceof Boolean) return (boolean)object;
         return true;
@@ -445,7 +465,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
      * @param b the second object.
      * @return whether the objects are equal.
      */
-    private boolean isEqual(Object a, Object b) {
+    static boolean isEqual(Object a, Object b) {
         if (a == null && b == null) return true;
         if (a == null) return false;
 
@@ -457,7 +477,7 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
      * @param object the object.
      * @return the string representation of the object.
      */
-    private String stringify(Object object) {
+    static String stringify(Object object) {
         if (object == null) return "nil";
 
         if (object instanceof Double) {
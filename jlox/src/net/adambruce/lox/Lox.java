@@ -6,6 +6,7 @@ import java.io.InputStreamReader;
 import java.nio.charset.Charset;
 import java.nio.file.Files;
 import java.nio.file.Paths;
+import java.util.Arrays;
 import java.util.List;
 
 /**
@@ -22,9 +23,17 @@ public class Lox {
     /** Flag indicating that a runtime error has occurred. */
     static boolean hadRuntimeError = false;
 
+    /** Flag indicating that programs are compiled into executable nodes rather than interpreted. */
+    static boolean compiled = false;
+
     public static void main(String[] args) throws IOException {
+        if (args.length > 0 && args[0].equals("--compiled")) {
+            compiled = true;
+            args = Arrays.copyOfRange(args, 1, args.length);
+        }
+
         if (args.length > 1) {
-            System.out.println("Usage: jlox [script]");
+            System.out.println("Usage: jlox [--compiled] [script]");
             System.exit(64);
         } else if (args.length == 1) {
             runFile(args[0]);
@@ -76,12 +85,16 @@ public class Lox {
 
         if (hadError) return;
 
-        Resolver resolver = new Resolver(interpreter);
+        Resolver resolver = new Resolver();
         resolver.resolve(statements);
 
         if (hadError) return;
 
-        interpreter.interpret(statements);
+        if (compiled) {
+            interpreter.interpretCompiled(statements);
+        } else {
+            interpreter.interpret(statements);
+        }
     }
 
     /**
@@ -16,10 +16,18 @@ public class LoxFunction implements LoxCallable {
     /** Whether this function is an initializer. */
     private final boolean isInitializer;
 
+    /** The function's compiled body, or null if the body is interpreted. */
+    private final Compiler.StmtNode[] body;
+
     LoxFunction(Stmt.Function declaration, Environment closure, boolean isInitializer) {
+        this(declaration, closure, isInitializer, null);
+    }
+
+    LoxFunction(Stmt.Function declaration, Environment closure, boolean isInitializer, Compiler.StmtNode[] body) {
         this.closure = closure;
         this.declaration = declaration;
         this.isInitializer = isInitializer;
+        this.body = body;
     }
 
     /**
@@ -28,9 +36,9 @@ public class LoxFunction implements LoxCallable {
      * @return the bound function.
      */
     LoxFunction bind(LoxInstance instance) {
-        Environment environment = new Environment(closure);
-        environment.define("this", instance);
-        return new LoxFunction(declaration, environment, isInitializer);
+        Environment environment = new Environment(closure, 1);
+        environment.define(0, instance);
+        return new LoxFunction(declaration, environment, isInitializer, body);
     }
 
     @Override
@@ -40,20 +48,27 @@ public class LoxFunction implements LoxCallable {
 
     @Override
     public Object call(Interpreter interpreter, List<Object> arguments) {
-        Environment environment = new Environment(closure);
+        // The parameters take the first slots of the function's scope, in order.
+        Environment environment = new Environment(closure, declaration.slotCount);
         for (int i = 0; i < declaration.params.size(); i++) {
-            environment.define(declaration.params.get(i).lexeme, arguments.get(i));
+            environment.define(i, arguments.get(i));
         }
 
         try {
-            interpreter.executeBlock(declaration.body, environment);
+            if (body == null) {
+                interpreter.executeBlock(declaration.body, environment);
+            } else {
+                for (Compiler.StmtNode statement : body) {
+                    statement.execute(environment);
+                }
+            }
         } catch (Return returnValue) {
-            if (isInitializer) return closure.getAt(0, "this");
+            if (isInitializer) return closure.getAt(0, 0);
 
             return returnValue.value;
         }
 
-        if (isInitializer) return closure.getAt(0, "this");
+        if (isInitializer) return closure.getAt(0, 0);
 
         return null;
     }
@@ -6,15 +6,14 @@ import java.util.Map;
 import java.util.Stack;
 
 /**
- * Resolves statement and expression types.
+ * Resolves statement and expression types. Each local variable gets a slot in
+ * its scope, which is recorded on the AST nodes that declare and use it along
+ * with the distance to that scope.
  */
 public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
-    /** The interpreter. */
-    private Interpreter interpreter;
-
-    /** The scope stack. */
-    private final Stack<Map<String, Boolean>> scopes = new Stack<>();
+    /** The scope stack, mapping each name declared in a scope to its local variable. */
+    private final Stack<Map<String, Local>> scopes = new Stack<>();
 
     /** The current function type. */
     private FunctionType currentFunction = FunctionType.NONE;
@@ -22,8 +21,17 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     /** The current class type. */
     private ClassType currentClass = ClassType.NONE;
 
-    Resolver(Interpreter interpreter) {
-        this.interpreter = interpreter;
+    /** A local variable. */
+    private static class Local {
+        /** The variable's slot in its scope. */
+        final int slot;
+
+        /** Whether the variable's initializer has been resolved. */
+        boolean defined = false;
+
+        Local(int slot) {
+            this.slot = slot;
+        }
     }
 
     /** The possible function types. */
@@ -68,17 +76,27 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     }
 
     /**
-     * Resolves a local expression.
-     * @param expr the expression.
+     * Finds the scope of a local variable.
      * @param name the identifier name.
+     * @return the distance to the variable's scope, or -1 if it is global.
      */
-    private void resolveLocal(Expr expr, Token name) {
+    private int resolveDepth(Token name) {
         for (int i = scopes.size() - 1; i >= 0; i--) {
             if (scopes.get(i).containsKey(name.lexeme)) {
-                interpreter.resolve(expr, scopes.size() - 1 - i);
-                return;
+                return scopes.size() - 1 - i;
             }
         }
+        return -1;
+    }
+
+    /**
+     * Gets the slot of a local variable.
+     * @param name the identifier name.
+     * @param depth the distance to the variable's scope.
+     * @return the variable's slot.
+     */
+    private int resolveSlot(Token name, int depth) {
+        return scopes.get(scopes.size() - 1 - depth).get(name.lexeme).slot;
     }
 
     /**
@@ -96,6 +114,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
             define(param);
         }
         resolve(function.body);
+        function.slotCount = scopes.peek().size();
         endScope();
         currentFunction = enclosingFunction;
     }
@@ -104,7 +123,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
      * Pushes a new scope onto the stack.
      */
     private void beginScope() {
-        scopes.push(new HashMap<String, Boolean>());
+        scopes.push(new HashMap<String, Local>());
     }
 
     /**
@@ -117,16 +136,20 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     /**
      * Declares a new identifier.
      * @param name the identifier.
+     * @return the identifier's slot, or -1 if it is global.
      */
-    private void declare(Token name) {
-        if (scopes.isEmpty()) return;
+    private int declare(Token name) {
+        if (scopes.isEmpty()) return -1;
 
-        Map<String, Boolean> scope = scopes.peek();
+        Map<String, Local> scope = scopes.peek();
         if (scope.containsKey(name.lexeme)) {
             Lox.error(name, "Already a variable with this name in this scope.");
+            return scope.get(name.lexeme).slot;
         }
 
-        scope.put(name.lexeme, false);
+        Local local = new Local(scope.size());
+        scope.put(name.lexeme, local);
+        return local.slot;
     }
 
     /**
@@ -135,13 +158,24 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
      */
     private void define(Token name) {
         if (scopes.isEmpty()) return;
-        scopes.peek().put(name.lexeme, true);
+        scopes.peek().get(name.lexeme).defined = true;
+    }
+
+    /**
+     * Declares and defines a name the interpreter puts in the first slot of a scope of its own.
+     * @param name the name.
+     */
+    private void defineImplicit(String name) {
+        Local local = new Local(0);
+        local.defined = true;
+        scopes.peek().put(name, local);
     }
 
     @Override
     public Void visitBlockStmt(Stmt.Block stmt) {
         beginScope();
         resolve(stmt.statements);
+        stmt.slotCount = scopes.peek().size();
         endScope();
         return null;
     }
@@ -150,7 +184,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     public Void visitClassStmt(Stmt.Class stmt) {
         ClassType enclosingClass = currentClass;
         currentClass = ClassType.CLASS;
-        declare(stmt.name);
+        stmt.slot = declare(stmt.name);
         define(stmt.name);
 
         if(stmt.superclass != null && stmt.name.lexeme.equals(stmt.superclass.name.lexeme)) {
@@ -164,11 +198,11 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
         if (stmt.superclass != null) {
             beginScope();
-            scopes.peek().put("super", true);
+            defineImplicit("super");
         }
 
         beginScope();
-        scopes.peek().put("this", true);
+        defineImplicit("this");
 
         for (Stmt.Function method : stmt.methods) {
             FunctionType declaration = FunctionType.METHOD;
@@ -189,7 +223,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     @Override
     public Void visitFunctionStmt(Stmt.Function stmt) {
-        declare(stmt.name);
+        stmt.slot = declare(stmt.name);
         define(stmt.name);
         resolveFunction(stmt, FunctionType.FUNCTION);
         return null;
@@ -234,7 +268,7 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     @Override
     public Void visitVarStmt(Stmt.Var stmt) {
-        declare(stmt.name);
+        stmt.slot = declare(stmt.name);
         if (stmt.initializer != null) {
             resolve(stmt.initializer);
         }
@@ -252,7 +286,8 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     @Override
     public Void visitAssignExpr(Expr.Assign expr) {
         resolve(expr.value);
-        resolveLocal(expr, expr.name);
+        expr.depth = resolveDepth(expr.name);
+        if (expr.depth >= 0) expr.slot = resolveSlot(expr.name, expr.depth);
         return null;
     }
 
@@ -313,7 +348,8 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
             Lox.error(expr.keyword, "Can't use 'super' in a class with no subclass.");
         }
 
-        resolveLocal(expr, expr.keyword);
+        expr.depth = resolveDepth(expr.keyword);
+        if (expr.depth >= 0) expr.slot = resolveSlot(expr.keyword, expr.depth);
         return null;
     }
 
@@ -324,7 +360,8 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
             return null;
         }
 
-        resolveLocal(expr, expr.keyword);
+        expr.depth = resolveDepth(expr.keyword);
+        if (expr.depth >= 0) expr.slot = resolveSlot(expr.keyword, expr.depth);
         return null;
     }
 
@@ -336,11 +373,15 @@ public class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     @Override
     public Void visitVariableExpr(Expr.Variable expr) {
-        if (!scopes.isEmpty() && scopes.peek().get(expr.name.lexeme) == Boolean.FALSE) {
-            Lox.error(expr.name, "Can't read local variable in it's own initializer.");
+        if (!scopes.isEmpty()) {
+            Local local = scopes.peek().get(expr.name.lexeme);
+            if (local != null && !local.defined) {
+                Lox.error(expr.name, "Can't read local variable in it's own initializer.");
+            }
         }
 
-        resolveLocal(expr, expr.name);
+        expr.depth = resolveDepth(expr.name);
+        if (expr.depth >= 0) expr.slot = resolveSlot(expr.name, expr.depth);
         return null;
     }
 }
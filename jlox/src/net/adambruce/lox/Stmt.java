@@ -25,6 +25,7 @@ abstract class Stmt {
     }
 
     final List<Stmt> statements;
+    int slotCount;
   }
   static class Class extends Stmt{
     Class(Token name, Expr.Variable superclass, List<Stmt.Function> methods) {
@@ -41,6 +42,7 @@ abstract class Stmt {
     final Token name;
     final Expr.Variable superclass;
     final List<Stmt.Function> methods;
+    int slot = -1;
   }
   static class Expression extends Stmt{
     Expression(Expr expression) {
@@ -69,6 +71,8 @@ abstract class Stmt {
     final Token name;
     final List<Token> params;
     final List<Stmt> body;
+    int slot = -1;
+    int slotCount;
   }
   static class If extends Stmt{
     If(Expr condition, Stmt thenBranch, Stmt elseBranch) {
@@ -113,6 +117,7 @@ abstract class Stmt {
 
     final Token name;
     final Expr initializer;
+    int slot = -1;
   }
   static class Print extends Stmt{
     Print(Expr expression) {
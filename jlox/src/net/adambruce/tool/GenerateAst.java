@@ -18,8 +18,9 @@ public class GenerateAst {
         }
         String outputDir = args[0];
 
+        // An optional third section lists fields the resolver fills in after parsing.
         defineAst(outputDir, "Expr", Arrays.asList(
-            "Assign   : Token name, Expr value",
+            "Assign   : Token name, Expr value : int depth = -1, int slot = -1",
             "Binary   : Expr left, Token operator, Expr right",
             "Call     : Expr callee, Token paren, List<Expr> arguments",
             "Get      : Expr object, Token name",
@@ -27,21 +28,21 @@ public class GenerateAst {
             "Literal  : Object value",
             "Logical  : Expr left, Token operator, Expr right",
             "Set      : Expr object, Token name, Expr value",
-            "Super    : Token keyword, Token method",
-            "This     : Token keyword",
+            "Super    : Token keyword, Token method : int depth = -1, int slot = -1",
+            "This     : Token keyword : int depth = -1, int slot = -1",
             "Unary    : Token operator, Expr right",
-            "Variable : Token name"
+            "Variable : Token name : int depth = -1, int slot = -1"
             ));
 
         defineAst(outputDir, "Stmt", Arrays.asList(
-            "Block      : List<Stmt> statements",
+            "Block      : List<Stmt> statements : int slotCount",
             "Class      : Token name, Expr.Variable superclass," +
-                        " List<Stmt.Function> methods",
+                        " List<Stmt.Function> methods : int slot = -1",
             "Expression : Expr expression",
-            "Function   : Token name, List<Token> params, List<Stmt> body",
+            "Function   : Token name, List<Token> params, List<Stmt> body : int slot = -1, int slotCount",
             "If         : Expr condition, Stmt thenBranch, Stmt elseBranch",
             "Return     : Token keyword, Expr value",
-            "Var        : Token name, Expr initializer",
+            "Var        : Token name, Expr initializer : int slot = -1",
             "Print      : Expr expression",
             "While      : Expr condition, Stmt body"
         ));
@@ -60,9 +61,11 @@ public class GenerateAst {
         defineVisitor(writer, baseName, types);
 
         for (String type : types) {
-            String className = type.split(":")[0].trim();
-            String fields = type.split(":")[1].trim();
-            defineType(writer, baseName, className, fields);
+            String[] sections = type.split(":");
+            String className = sections[0].trim();
+            String fields = sections[1].trim();
+            String resolvedFields = sections.length > 2 ? sections[2].trim() : null;
+            defineType(writer, baseName, className, fields, resolvedFields);
         }
 
         // The base accept() method
@@ -74,7 +77,8 @@ public class GenerateAst {
         writer.close();
     }
 
-    private static void defineType(PrintWriter writer, String baseName, String className, String fieldList) {
+    private static void defineType(PrintWriter writer, String baseName, String className, String fieldList,
+                                   String resolvedFieldList) {
         writer.println("  static class " + className + " extends " + baseName + "{");
         writer.println("    " + className + "(" + fieldList + ") {");
 
@@ -97,6 +101,11 @@ public class GenerateAst {
         for (String field : fields) {
             writer.println("    final " + field + ";");
         }
+        if (resolvedFieldList != null) {
+            for (String field : resolvedFieldList.split(", ")) {
+                writer.println("    " + field + ";");
+            }
+        }
 
         writer.println("  }");
     }